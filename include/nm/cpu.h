@@ -0,0 +1,98 @@
+#ifndef NM_CPU_H
+#define NM_CPU_H
+
+#include <stdint.h>
+
+#define NM_MAX_CPUS 8
+
+#ifdef NEVERMIND_HOST_TEST
+// Host tests and benches model CPUs as threads, each picking its own slot.
+extern _Thread_local uint32_t nm_host_cpu_id;
+#endif
+
+// Only the bootstrap processor runs today; once APs are started this reads the
+// per-CPU id instead of returning the BSP slot.
+static inline uint32_t cpu_current_id(void)
+{
+#ifdef NEVERMIND_HOST_TEST
+    return nm_host_cpu_id;
+#else
+    return 0;
+#endif
+}
+
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+                     : "a"(leaf), "c"(subleaf));
+}
+
+// CPUID.80000001h:EDX[26] advertises 1 GiB pages at the PDPT level.
+static inline int cpu_has_gbpages(void)
+{
+    uint32_t regs[4];
+    cpu_cpuid(0x80000000U, 0, regs);
+    if (regs[0] < 0x80000001U) {
+        return 0;
+    }
+    cpu_cpuid(0x80000001U, 0, regs);
+    return (regs[3] & (1U << 26)) != 0;
+}
+
+// CPUID.80000001h:EDX[20] advertises the execute-disable bit, which EFER.NXE turns on.
+static inline int cpu_has_nx(void)
+{
+    uint32_t regs[4];
+    cpu_cpuid(0x80000000U, 0, regs);
+    if (regs[0] < 0x80000001U) {
+        return 0;
+    }
+    cpu_cpuid(0x80000001U, 0, regs);
+    return (regs[3] & (1U << 20)) != 0;
+}
+
+static inline uint64_t cpu_rdmsr(uint32_t msr)
+{
+    uint32_t lo;
+    uint32_t hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpu_wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+static inline uint64_t cpu_rdtsc(void)
+{
+    uint32_t lo;
+    uint32_t hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t cpu_irq_save(void)
+{
+#ifdef NEVERMIND_HOST_TEST
+    return 0;
+#else
+    uint64_t flags;
+    __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+#endif
+}
+
+static inline void cpu_irq_restore(uint64_t flags)
+{
+#ifdef NEVERMIND_HOST_TEST
+    (void)flags;
+#else
+    if ((flags & (1ULL << 9)) != 0) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+#endif
+}
+
+#endif
@@ -10,6 +10,7 @@
 #define NM_ENOENT 2
 #define NM_ENOMEM 12
 #define NM_EBUSY 16
+#define NM_EFAULT 14
 #define NM_ENOSYS 38
 
 #define NM_ERR(code) (-(int64_t)(code))
@@ -5,47 +5,438 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "nm/cpu.h"
+
 struct nm_mem_range {
     uint64_t base;
     uint64_t length;
     uint32_t type;
 };
 
+#define NM_HUGE_PAGE_SIZE (2ULL * 1024ULL * 1024ULL)
+#define NM_HUGE_PAGE_FRAMES 512U
+
+enum nm_mm_zone {
+    NM_ZONE_DMA = 0,
+    NM_ZONE_DMA32,
+    NM_ZONE_NORMAL,
+    NM_ZONE_COUNT,
+};
+
+#define NM_ZONE_MASK_DMA (1U << NM_ZONE_DMA)
+#define NM_ZONE_MASK_DMA32 (1U << NM_ZONE_DMA32)
+#define NM_ZONE_MASK_NORMAL (1U << NM_ZONE_NORMAL)
+#define NM_ZONE_MASK_ANY (NM_ZONE_MASK_DMA | NM_ZONE_MASK_DMA32 | NM_ZONE_MASK_NORMAL)
+
+struct nm_mm_zone_stats {
+    uint64_t managed_frames;
+    uint64_t free_frames;
+    uint64_t fallback_allocs;
+};
+
 struct nm_mm_stats {
     uint64_t total_frames;
     uint64_t free_frames;
     uint64_t used_frames;
     uint64_t reserved_frames;
+    uint64_t pcp_alloc_hits;
+    uint64_t pcp_alloc_misses;
+    uint64_t pcp_refills;
+    uint64_t pcp_drains;
+    uint64_t init_cycles;
+    uint64_t huge_free_blocks;
+    uint64_t zero_pool_frames;
+    uint64_t zero_pool_hits;
+    uint64_t zero_pool_misses;
+    struct nm_mm_zone_stats zones[NM_ZONE_COUNT];
 };
 
 enum {
     NM_MEM_AVAILABLE = 1,
 };
 
+// One descriptor per physical frame, indexed by frame number. While a frame is free the
+// PMM threads its buddy list through `next`/`prev`; the owner of an allocated frame may
+// reuse them as its own list link. Every allocated frame starts with refcount 1. The zone
+// follows from the frame number, see pmm_page_zone().
+struct nm_page {
+    uint32_t next;
+    uint32_t prev;
+    uint16_t refcount;
+    uint8_t order;
+    uint8_t flags;
+};
+
+// Owner flags; the PMM clears them whenever it hands a frame out.
+#define NM_PAGE_PGTABLE (1U << 0)
+#define NM_PAGE_KHEAP (1U << 1)
+#define NM_PAGE_USER (1U << 2)
+// First frame of a multi-frame allocation whose owner keeps run metadata in it.
+#define NM_PAGE_HEAD (1U << 3)
+
 void mm_init(uint64_t mb2_info_ptr);
 
 void pmm_init_from_multiboot2(uint64_t mb2_info_ptr);
 void pmm_init_from_ranges(const struct nm_mem_range *ranges, size_t count);
 uint64_t pmm_alloc_pages(size_t count);
 uint64_t pmm_alloc_page(void);
+uint64_t pmm_alloc_pages_zone(size_t count, uint32_t zone_mask, uint64_t align);
 void pmm_free_page(uint64_t phys_addr);
+void pmm_free_pages(uint64_t phys_addr, size_t count);
+// Extend an allocated run of `count` frames in place to `new_count` frames. Fails without
+// side effects unless every frame directly after the run is free.
+bool pmm_grow_pages(uint64_t phys_addr, size_t count, size_t new_count);
+size_t pmm_alloc_batch(uint64_t *frames, size_t count);
+void pmm_free_batch(const uint64_t *frames, size_t count);
+uint64_t pmm_alloc_huge(void);
+uint64_t pmm_alloc_zeroed_page(void);
+size_t pmm_zero_pool_fill(size_t max_frames);
+void pmm_free_huge(uint64_t phys_addr);
+struct nm_page *pmm_phys_to_page(uint64_t phys_addr);
+uint64_t pmm_page_to_phys(const struct nm_page *page);
+uint32_t pmm_page_get(uint64_t phys_addr);
+void pmm_page_put(uint64_t phys_addr);
+uint32_t pmm_page_refcount(uint64_t phys_addr);
+enum nm_mm_zone pmm_page_zone(const struct nm_page *page);
 struct nm_mm_stats pmm_get_stats(void);
 
 #ifdef NEVERMIND_HOST_TEST
 void *pmm_host_ptr_from_key(uint64_t key);
+uint64_t pmm_host_key_from_ptr(const void *ptr);
 #endif
 
+// All RAM is mapped at NM_DIRECT_MAP_BASE + phys. The boot page tables already cover the
+// first 1 GiB of the window; vmm_init() extends it to the top of physical memory.
+#define NM_DIRECT_MAP_BASE 0xFFFF888000000000ULL
+#define NM_KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL
+
+static inline void *nm_phys_to_virt(uint64_t phys)
+{
+#ifdef NEVERMIND_HOST_TEST
+    return pmm_host_ptr_from_key(phys);
+#else
+    return (void *)(uintptr_t)(NM_DIRECT_MAP_BASE + phys);
+#endif
+}
+
+// Accepts direct-map, kernel-image and (low 1 GiB) identity-mapped addresses.
+static inline uint64_t nm_virt_to_phys(const void *ptr)
+{
+#ifdef NEVERMIND_HOST_TEST
+    return pmm_host_key_from_ptr(ptr);
+#else
+    uint64_t addr = (uint64_t)(uintptr_t)ptr;
+    if (addr >= NM_KERNEL_VIRT_BASE) {
+        return addr - NM_KERNEL_VIRT_BASE;
+    }
+    if (addr >= NM_DIRECT_MAP_BASE) {
+        return addr - NM_DIRECT_MAP_BASE;
+    }
+    return addr;
+#endif
+}
+
+struct nm_vmm_stats {
+    uint64_t tables_allocated;
+    uint64_t tables_freed;
+    uint64_t huge_leaves;   // 2 MiB leaves installed by range maps
+    uint64_t page_flushes;  // pages invalidated with invlpg
+    uint64_t full_flushes;  // CR3 reloads
+    uint64_t leaves_shared; // 4 KiB leaves shared copy-on-write by vmm_clone_range
+    uint64_t xlate_hits;    // vmm_translate answered from the per-CPU cache
+    uint64_t xlate_misses;
+    uint64_t leaves_protected; // leaves whose permissions vmm_protect changed
+    uint64_t huge_collapsed;   // page tables folded into a 2 MiB leaf by NM_MADV_HUGEPAGE
+};
+
+// Leaf attribute bits beyond P/RW/US that walkers look at.
+#define NM_PTE_ACCESSED 0x20ULL
+#define NM_PTE_DIRTY 0x40ULL
+#define NM_PTE_GLOBAL 0x100ULL
+#define NM_PTE_NX (1ULL << 63)
+
+enum nm_madvise {
+    NM_MADV_DONTNEED = 1, // drop the pages (and a reference on their frames)
+    NM_MADV_WILLNEED,     // populate them ahead of the first touch
+    NM_MADV_HUGEPAGE,     // back 2 MiB-aligned stretches with huge leaves
+};
+
+// Called by vmm_walk for each present leaf (4 KiB, 2 MiB or 1 GiB) overlapping the range,
+// with vmm_lock held: it must not call back into the VMM or PMM. `virt_addr` is the leaf's
+// own base. The callback may rewrite the entry's attribute bits; changed leaves are
+// flushed once when the walk ends. A nonzero return stops the walk and is passed back.
+typedef int (*nm_vmm_leaf_fn)(void *ctx, uint64_t virt_addr, uint64_t size, uint64_t *entry);
+
 void vmm_init(void);
 uint64_t *vmm_kernel_root(void);
+// Bytes of physical memory reachable through the direct map, and the leaf size it uses.
+uint64_t vmm_direct_map_bytes(void);
+uint64_t vmm_direct_map_page_size(void);
 bool vmm_map_page_in(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
 bool vmm_unmap_page_in(uint64_t *pml4, uint64_t virt_addr);
 bool vmm_map_2m_in(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
+// Map or unmap a page-aligned range in one pass: only missing tables are allocated,
+// 2 MiB-aligned stretches get huge leaves, and the TLB is flushed once at the end.
+// A failed map leaves nothing of the range mapped. vmm_unmap_range returns false if
+// nothing in the range was mapped.
+bool vmm_map_range(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t len, uint64_t flags);
+bool vmm_unmap_range(uint64_t *pml4, uint64_t virt_addr, uint64_t len);
+// Like vmm_unmap_range, but also drops a reference on every frame behind the leaves once
+// the TLB has been flushed. 1 GiB leaves are split first.
+bool vmm_unmap_range_release(uint64_t *pml4, uint64_t virt_addr, uint64_t len);
+// Map count frames, in order and wherever they lie, at consecutive pages from virt_addr.
+bool vmm_map_frames(uint64_t *pml4, uint64_t virt_addr, const uint64_t *frames, size_t count, uint64_t flags);
+struct nm_vrange {
+    uint64_t start;
+    uint64_t len;
+};
+// Unmap several page-aligned ranges under a single TLB flush.
+bool vmm_unmap_ranges(uint64_t *pml4, const struct nm_vrange *ranges, size_t count);
+// Give the PML4 slot covering virt_addr a PDPT that is never freed, so address spaces
+// created later share whatever gets mapped under it.
+bool vmm_pin_pdpt(uint64_t *pml4, uint64_t virt_addr);
+// Share every present leaf of src in the range into dst (whose range must be empty):
+// both sides lose RW and each frame gains a reference, so a later write faults and can
+// be copied. Huge leaves in src are split first. The source flush covers only this CPU.
+bool vmm_clone_range(uint64_t *dst_pml4, uint64_t *src_pml4, uint64_t virt_addr, uint64_t len);
+// The present leaf entry (4 KiB, 2 MiB or 1 GiB) mapping virt_addr, or 0.
+uint64_t vmm_leaf_entry(uint64_t *pml4, uint64_t virt_addr);
+// Physical address behind virt_addr. Repeated lookups of a page hit a small per-CPU cache
+// that any TLB flush invalidates.
+bool vmm_translate(const uint64_t *pml4, uint64_t virt_addr, uint64_t *phys_addr);
+// The range may not cross the non-canonical hole.
+int vmm_walk(uint64_t *pml4, uint64_t virt_addr, uint64_t len, nm_vmm_leaf_fn fn, void *ctx);
+// Clear the accessed and/or dirty bits given in `bits` and count the leaves that had any.
+uint64_t vmm_harvest(uint64_t *pml4, uint64_t virt_addr, uint64_t len, uint64_t bits);
+// One line per run of mappings into `out` ("virt-end -> phys size perms"); returns lines.
+uint64_t vmm_dump(uint64_t *pml4, uint64_t virt_addr, uint64_t len, char *out, size_t cap);
+// Bytes of the range backed by present leaves.
+uint64_t vmm_resident(uint64_t *pml4, uint64_t virt_addr, uint64_t len);
+// Rewrite the permission bits given in `mask` (RW, US and, where the CPU has it, NX) to
+// their value in `flags` on every present leaf in the range, splitting huge leaves that
+// straddle either end. One TLB flush covers the whole change.
+bool vmm_protect(uint64_t *pml4, uint64_t virt_addr, uint64_t len, uint64_t flags, uint64_t mask);
+// DONTNEED unmaps the range like vmm_unmap_range_release. HUGEPAGE folds every page table
+// in the range that maps one aligned, contiguous 2 MiB block into a huge leaf. WILLNEED
+// has no backing store to act on at this level and is accepted as a no-op.
+bool vmm_advise(uint64_t *pml4, uint64_t virt_addr, uint64_t len, enum nm_madvise advice);
+struct nm_vmm_stats vmm_get_stats(void);
 
 bool vmm_map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
 bool vmm_unmap_page(uint64_t virt_addr);
 bool vmm_map_2m(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
 
+// User address spaces own PML4 slots 1..255. Slot 0 keeps the boot identity map (boot
+// stack, VGA buffer) and, like the kernel half, is shared by every address space.
+#define NM_USER_BASE 0x0000008000000000ULL
+#define NM_USER_TOP 0x0000800000000000ULL
+#define NM_PCID_COUNT 4096U
+
+#define NM_VMA_READ 0x1U
+#define NM_VMA_WRITE 0x2U
+#define NM_VMA_EXEC 0x4U
+
+// x86 #PF error code bits.
+#define NM_PF_PRESENT 0x1ULL
+#define NM_PF_WRITE 0x2ULL
+#define NM_PF_USER 0x4ULL
+#define NM_PF_FETCH 0x10ULL
+
+struct nm_vnode;
+
+// A reserved, page-aligned stretch of user address space. Pages are populated on first
+// touch: zero-filled when `file` is 0, otherwise read from `file` at file_offset plus the
+// page's offset into the area (a private copy; bytes past the end of the file read as 0).
+struct nm_vma {
+    uint64_t start;
+    uint64_t end;
+    uint32_t prot;
+    struct nm_vnode *file;
+    uint64_t file_offset;
+    struct nm_vma *next;
+};
+
+// An address space. The PML4's shared slots are copied from the kernel root when it is
+// created; tasks hold references and the last mm_put frees the user half, its frames and
+// its VMAs.
+struct nm_mm {
+    uint64_t *pml4;
+    uint64_t root;
+    uint32_t refcount;
+    volatile uint32_t lock_word;
+    // Sorted by address, non-overlapping; vma_cache is the last area a lookup hit.
+    struct nm_vma *vmas;
+    struct nm_vma *vma_cache;
+    // PCID per CPU, valid only while pcid_gen matches that CPU's allocator generation.
+    uint16_t pcid[NM_MAX_CPUS];
+    uint64_t pcid_gen[NM_MAX_CPUS];
+};
+
+struct nm_mm_switch_stats {
+    uint64_t switches;
+    uint64_t noflush;    // CR3 loads that kept the TLB contents
+    uint64_t flushes;    // loads without PCID or with a freshly assigned PCID
+    uint64_t rollovers;  // PCID generations used up
+};
+
+struct nm_mm_fault_stats {
+    uint64_t zero_fills;  // anonymous pages populated on first touch
+    uint64_t file_reads;  // file-backed pages read in on first touch
+    uint64_t cow_copies;  // shared pages copied on first write
+    uint64_t cow_reused;  // write faults on pages no one else still shared
+    uint64_t huge_fills;  // anonymous 2 MiB blocks populated whole by NM_MADV_HUGEPAGE
+};
+
+// Enables CR4.PCIDE when the CPU has PCIDs; runs after vmm_init.
+void mm_space_init(void);
+struct nm_mm *mm_kernel(void);
+struct nm_mm *mm_create(void);
+void mm_get(struct nm_mm *mm);
+void mm_put(struct nm_mm *mm);
+// A copy of mm for fork: same VMAs, page tables cloned with every populated page shared
+// read-only until one side writes it. Costs page-table size, not resident memory. Kernel
+// threads keep sharing the kernel address space (a new reference is returned).
+struct nm_mm *mm_fork(struct nm_mm *mm);
+// Load `next` on this CPU. Returns the CR3 value written, or 0 if it was already active.
+uint64_t mm_switch(struct nm_mm *next);
+// Forget mm's PCIDs after its user half changed while it was not loaded.
+void mm_tlb_invalidate(struct nm_mm *mm);
+// The address space loaded on this CPU.
+struct nm_mm *mm_current(void);
+// Reserve [start, start + len) in mm's user half; O(1) in len, nothing is allocated until
+// a page is touched. `file` is 0 for anonymous memory.
+int mm_map(struct nm_mm *mm, uint64_t start, uint64_t len, uint32_t prot, struct nm_vnode *file,
+           uint64_t file_offset);
+// Remove areas (splitting them as needed) and free the pages that were populated.
+int mm_unmap(struct nm_mm *mm, uint64_t start, uint64_t len);
+struct nm_vma *mm_find_vma(struct nm_mm *mm, uint64_t addr);
+// Give [start, start + len), which must be fully mapped, the NM_VMA_* access `prot`,
+// splitting areas at the ends and rewriting the populated pages in one pass.
+// NM_ERR(NM_EFAULT) if part of the range is not mapped.
+int mm_protect(struct nm_mm *mm, uint64_t start, uint64_t len, uint32_t prot);
+// DONTNEED frees the populated pages but keeps the areas; WILLNEED populates the range now
+// instead of on first touch; HUGEPAGE backs aligned 2 MiB stretches of anonymous areas
+// with huge leaves, populating untouched ones and folding contiguous ones.
+int mm_advise(struct nm_mm *mm, uint64_t start, uint64_t len, enum nm_madvise advice);
+// Resolve a page fault at addr with #PF error code err: populate a missing page, or give
+// a writer its own copy of a copy-on-write page. Returns 0 when the access can be retried,
+// NM_ERR(NM_EFAULT) for a true fault and NM_ERR(NM_ENOMEM) if no frame was free.
+int mm_handle_fault(struct nm_mm *mm, uint64_t addr, uint64_t err);
+struct nm_mm_fault_stats mm_fault_stats(void);
+bool mm_pcid_supported(void);
+// Turning PCIDs off makes every switch a full flush; either way all CPUs start a new
+// generation so no PCID from before the change is trusted.
+void mm_pcid_set_enabled(bool enabled);
+struct nm_mm_switch_stats mm_switch_stats(void);
+// Context-switch benchmark, built with -DNM_SWITCH_BENCH (`make SWITCH_BENCH=1`);
+// otherwise a no-op. Results go to the kernel log.
+void mm_switch_bench(void);
+
+struct nm_kheap_stats {
+    uint64_t slab_pages;
+    uint64_t large_pages;
+    uint64_t active_objects;
+    // Freed small objects still parked in per-CPU magazines or the depot.
+    uint64_t magazine_objects;
+    uint64_t arena_pages;
+    uint64_t arena_free_bytes;
+    uint64_t arena_largest_free;
+    // 0 when all free arena space is one block, approaching 1000 as it shatters.
+    uint32_t fragmentation_permille;
+};
+
+struct nm_kmem_cache_stats {
+    const char *name;
+    uint32_t obj_size;
+    uint64_t slabs;
+    uint64_t active_objs;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+struct kmem_cache;
+
+void kheap_init(void);
 void *kmalloc(size_t size);
+// `align` must be a power of two. Small requests come from the size class that is
+// naturally aligned to it; large ones start on an `align`-aligned page run.
+void *kmalloc_aligned(size_t size, size_t align);
+// Grows in place when the following block or frames are free, otherwise moves. Only the
+// default kmalloc alignment survives a move.
+void *krealloc(void *ptr, size_t size);
 void kfree(void *ptr);
+struct nm_kheap_stats kheap_get_stats(void);
+// Return this CPU's cached kmalloc objects and the depot's to the slabs.
+void kheap_drain(void);
+
+// Typed object caches. A constructor runs once when an object is first carved out, so
+// objects must be freed back in their constructed state.
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+size_t kmem_cache_stats(struct nm_kmem_cache_stats *out, size_t max);
+
+// Virtually contiguous kernel memory built from single frames, in its own PML4 slot.
+#define NM_VMALLOC_BASE 0xFFFFC90000000000ULL
+#define NM_VMALLOC_END 0xFFFFC98000000000ULL
+// Leave an unmapped page on each side of the area, so a stack overflow faults.
+#define NM_VMALLOC_GUARD 0x1U
+
+struct nm_vmalloc_stats {
+    uint64_t areas;
+    uint64_t pages;
+    // Freed but still mapped until the next purge unmaps them under one flush.
+    uint64_t lazy_areas;
+    uint64_t lazy_pages;
+    uint64_t purges;
+};
+
+// Pins the region's page-table slot; runs after kheap_init and before the first mm_create.
+void vmalloc_init(void);
+void *vmalloc(size_t size);
+void *vmalloc_flags(size_t size, uint32_t flags);
+// The area stays mapped, and its frames and addresses reserved, until a purge.
+void vfree(void *ptr);
+void vmalloc_purge(void);
+bool vmalloc_contains(const void *ptr);
+uint64_t vmalloc_to_phys(const void *ptr);
+struct nm_vmalloc_stats vmalloc_get_stats(void);
+// kmalloc up to the heap arena limit (16 KiB), vmalloc above; kvfree and kvrealloc take
+// either kind.
+void *kvmalloc(size_t size);
+void kvfree(void *ptr);
+// old_size is how much of ptr to carry over if the allocation has to move.
+void *kvrealloc(void *ptr, size_t old_size, size_t size);
+
+// Live kmalloc allocations grouped by the return address of the kmalloc/krealloc call.
+struct nm_kheap_site {
+    uintptr_t callsite;
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t oldest_tsc;
+};
+
+// Heap tracking is built in with -DNM_KHEAP_TRACK (`make KHEAP_TRACK=1`). Without it the
+// hooks are empty inlines, kheap_track_sites() reports nothing and the dump is silent.
+#ifdef NM_KHEAP_TRACK
+void kheap_track_alloc(const void *ptr, size_t size, uintptr_t callsite);
+void kheap_track_free(const void *ptr);
+#else
+static inline void kheap_track_alloc(const void *ptr, size_t size, uintptr_t callsite)
+{
+    (void)ptr;
+    (void)size;
+    (void)callsite;
+}
+
+static inline void kheap_track_free(const void *ptr)
+{
+    (void)ptr;
+}
+#endif
+// Fill `out` with the heaviest callsites by live bytes, largest first.
+size_t kheap_track_sites(struct nm_kheap_site *out, size_t max);
+// Write the top `max` callsites and the `max` oldest live allocations to the kernel log.
+void kheap_track_dump(size_t max);
 
 #endif
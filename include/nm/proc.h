@@ -42,6 +42,8 @@ struct nm_regs {
     uint64_t rsp;
 };
 
+struct nm_mm;
+
 struct nm_sched_param {
     uint32_t priority;
     uint32_t timeslice_ticks;
@@ -55,7 +57,8 @@ struct nm_task {
     bool is_kernel_thread;
     enum nm_task_state state;
     struct nm_regs regs;
-    uint64_t cr3;
+    // Address space; kernel threads share mm_kernel(). Held by reference until reaped.
+    struct nm_mm *mm;
     int32_t fd_table[NM_MAX_FDS];
     uint32_t fd_cloexec_mask;
     uint64_t signal_mask;
@@ -63,9 +66,17 @@ struct nm_task {
     uint32_t argc;
     uint32_t envc;
     struct nm_sched_param sched;
+    // Run-queue links, owned by the scheduler: set only while the task waits on a queue.
+    struct nm_task *rq_next;
+    struct nm_task *rq_prev;
+    uint32_t rq_index;
+    bool on_rq;
     uint64_t *kernel_stack_top;
     uint64_t *saved_rsp;
     const char *entry_name;
+    // Kernel copy of the name, argv and envp from the last exec; entry_name and the
+    // argv/envp registers point into it.
+    void *exec_args;
     char name[NM_TASK_NAME_MAX];
 };
 
@@ -89,6 +100,11 @@ void sched_tick(uint64_t ticks);
 void sched_yield(void);
 struct nm_task *sched_pick_next(void);
 void sched_on_run(struct nm_task *task, uint64_t ticks);
+// Run queues hold RUNNABLE tasks other than the one running. The task table puts new and
+// forked tasks on them; sched_yield and sched_tick move tasks on and off as they switch.
+void sched_rq_reset(void);
+void sched_enqueue(struct nm_task *task);
+void sched_dequeue(struct nm_task *task);
 
 void nm_context_switch(uint64_t **old_rsp, uint64_t *new_rsp);
 
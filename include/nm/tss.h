@@ -21,6 +21,10 @@ struct __attribute__((packed)) nm_tss64 {
 	uint16_t iopb;
 };
 
+// IST slot for #DF. A kernel stack overflow hits the guard page, the CPU cannot push the #PF
+// frame there and escalates to #DF, so that handler must not run on the faulting stack.
+#define NM_IST_DOUBLE_FAULT 1
+
 uint64_t tss_base_address(void);
 void tss_init(void);
 
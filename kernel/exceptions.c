@@ -1,6 +1,8 @@
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "nm/console.h"
+#include "nm/mm.h"
 
 static void console_write_hex_u64(uint64_t value)
 {
@@ -12,6 +14,15 @@ static void console_write_hex_u64(uint64_t value)
     }
 }
 
+// #PF entry: returns true when the fault was resolved against the current address space
+// and the access can be retried; anything else falls through to nm_exception_dispatch.
+bool nm_page_fault(const uint64_t *stack)
+{
+    uint64_t cr2;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    return mm_handle_fault(mm_current(), cr2, stack[1]) == 0;
+}
+
 __attribute__((noreturn)) void nm_exception_dispatch(const uint64_t *stack)
 {
     uint64_t vec = stack[0];
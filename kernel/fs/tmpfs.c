@@ -8,12 +8,10 @@
 
 #ifdef NEVERMIND_HOST_TEST
 #include <stdlib.h>
-#define NM_ALLOC(sz) malloc(sz)
-#define NM_FREE(p) free(p)
+#define NM_REALLOC(p, old, sz) realloc(p, sz)
 #else
 #include "nm/mm.h"
-#define NM_ALLOC(sz) kmalloc(sz)
-#define NM_FREE(p) ((void)(p))
+#define NM_REALLOC(p, old, sz) kvrealloc(p, old, sz)
 #endif
 
 #define TMPFS_MAX_NODES 512
@@ -102,17 +100,10 @@ static int tmpfs_reserve(struct nm_vnode *node, uint64_t need)
         cap *= 2;
     }
 
-    uint8_t *new_buf = (uint8_t *)NM_ALLOC((size_t)cap);
+    uint8_t *new_buf = (uint8_t *)NM_REALLOC(node->data, (size_t)node->capacity, (size_t)cap);
     if (new_buf == 0) {
         return NM_ERR(NM_ENOMEM);
     }
-
-    for (uint64_t i = 0; i < node->size; i++) {
-        new_buf[i] = node->data ? node->data[i] : 0;
-    }
-    if (node->data) {
-        NM_FREE(node->data);
-    }
     node->data = new_buf;
     node->capacity = cap;
     return 0;
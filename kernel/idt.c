@@ -1,6 +1,7 @@
 #include <stdint.h>
 
 #include "nm/idt.h"
+#include "nm/tss.h"
 
 extern void nm_isr_ud(void);
 extern void nm_isr_df(void);
@@ -49,7 +50,7 @@ void idt_init(void)
     }
 
     idt_set_gate(6, (uint64_t)nm_isr_ud, 0x8E, 0);
-    idt_set_gate(8, (uint64_t)nm_isr_df, 0x8E, 0);
+    idt_set_gate(8, (uint64_t)nm_isr_df, 0x8E, NM_IST_DOUBLE_FAULT);
     idt_set_gate(13, (uint64_t)nm_isr_gp, 0x8E, 0);
     idt_set_gate(14, (uint64_t)nm_isr_pf, 0x8E, 0);
 
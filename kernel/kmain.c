@@ -18,10 +18,14 @@
 #include "nm/tss.h"
 #include "nm/userspace.h"
 
+#define IDLE_ZERO_BATCH 8
+
 static void idle_thread(void *arg)
 {
     (void)arg;
     for (;;) {
+        // Spend idle time pre-zeroing frames for page tables and other zeroed allocations.
+        (void)pmm_zero_pool_fill(IDLE_ZERO_BATCH);
         sched_yield();
         __asm__ volatile("hlt");
     }
@@ -105,6 +109,12 @@ void kmain(uint64_t mb2_info)
     console_write_u64(stats.free_frames);
     console_write(" used_pages=");
     console_write_u64(stats.used_frames);
+    console_write(" init_cycles=");
+    console_write_u64(stats.init_cycles);
+    console_write(" direct_map_mb=");
+    console_write_u64(vmm_direct_map_bytes() >> 20);
+    console_write(" direct_map_page_kb=");
+    console_write_u64(vmm_direct_map_page_size() >> 10);
     console_write("\n");
 
     proc_init();
@@ -138,6 +148,9 @@ void kmain(uint64_t mb2_info)
     console_write("[00.000900] net ready: arp/ipv4/icmp/udp/tcp/socket\n");
 
     userspace_init();
+    // Boot-time heap owners land in dmesg; empty unless built with KHEAP_TRACK=1.
+    kheap_track_dump(8);
+    mm_switch_bench();
 
     kernel_banner();
     console_write("[00.001000] NeverMind: M8 hardening+ci ready\n");
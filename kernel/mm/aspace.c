@@ -0,0 +1,728 @@
+#include "nm/mm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nm/cpu.h"
+#include "nm/errno.h"
+#include "nm/fs.h"
+#include "nm/string.h"
+
+#define PAGE_SIZE 4096ULL
+#define PTE_PRESENT 0x1ULL
+#define PTE_RW 0x2ULL
+#define PTE_US 0x4ULL
+#define PTE_PS 0x80ULL
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR4_PCIDE (1ULL << 17)
+#define CPUID_1_ECX_PCID (1U << 17)
+
+// PCIDs are handed out per CPU in increasing order and never reused within a generation.
+// When a CPU runs out it starts a new generation; every address space then gets a fresh
+// PCID on its next switch-in, and a fresh PCID is always loaded with a flush, so entries
+// left behind under that number by an earlier owner cannot leak through.
+struct pcid_cpu {
+    uint64_t generation;
+    uint32_t next;
+    struct nm_mm *active;
+    struct nm_mm_switch_stats stats;
+};
+
+// The kernel address space keeps PCID 0 for good but still follows the generations: while
+// PCIDs are off every address space loads as PCID 0, so the first kernel load after they
+// come back on must flush. Shared mappings are flushed from every PCID by the VMM.
+static struct nm_mm kernel_mm = {.refcount = 1};
+static struct pcid_cpu pcid_cpus[NM_MAX_CPUS];
+static bool pcid_supported;
+static bool pcid_enabled;
+static struct nm_mm_fault_stats fault_stats;
+
+static inline void mm_lock(struct nm_mm *mm)
+{
+    while (__sync_lock_test_and_set(&mm->lock_word, 1U) != 0U) {
+        __asm__ volatile("pause");
+    }
+}
+
+static inline void mm_unlock(struct nm_mm *mm)
+{
+    __sync_lock_release(&mm->lock_word);
+}
+
+static inline void load_cr3(uint64_t cr3)
+{
+#ifndef NEVERMIND_HOST_TEST
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+#else
+    (void)cr3;
+#endif
+}
+
+static void pcid_new_generation(void)
+{
+    for (uint32_t cpu = 0; cpu < NM_MAX_CPUS; cpu++) {
+        pcid_cpus[cpu].generation++;
+        pcid_cpus[cpu].next = 1;
+    }
+}
+
+void mm_space_init(void)
+{
+    kernel_mm.pml4 = vmm_kernel_root();
+    kernel_mm.root = kernel_mm.pml4 != 0 ? nm_virt_to_phys(kernel_mm.pml4) : 0;
+    for (uint32_t cpu = 0; cpu < NM_MAX_CPUS; cpu++) {
+        pcid_cpus[cpu] = (struct pcid_cpu){.generation = 1, .next = 1, .active = &kernel_mm};
+    }
+
+#ifndef NEVERMIND_HOST_TEST
+    uint32_t regs[4];
+    cpu_cpuid(1, 0, regs);
+    pcid_supported = (regs[2] & CPUID_1_ECX_PCID) != 0;
+    if (pcid_supported) {
+        // CR3[11:0] is still 0 here, which PCIDE requires at the moment it is set.
+        uint64_t cr4;
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE) : "memory");
+    }
+#else
+    // Host tests model a PCID-capable CPU; nothing is ever loaded.
+    pcid_supported = true;
+#endif
+    pcid_enabled = pcid_supported;
+}
+
+struct nm_mm *mm_kernel(void)
+{
+    return &kernel_mm;
+}
+
+struct nm_mm *mm_create(void)
+{
+    struct nm_mm *mm = (struct nm_mm *)kmalloc(sizeof(*mm));
+    if (mm == 0) {
+        return 0;
+    }
+    uint64_t root = pmm_alloc_zeroed_page();
+    if (root == 0) {
+        kfree(mm);
+        return 0;
+    }
+    pmm_phys_to_page(root)->flags |= NM_PAGE_PGTABLE;
+
+    memset(mm, 0, sizeof(*mm));
+    mm->pml4 = (uint64_t *)nm_phys_to_virt(root);
+    mm->root = root;
+    mm->refcount = 1;
+    // Kernel-half slots are copied, not tracked: every slot the kernel will ever use has
+    // its PDPT in place before the first address space is created.
+    if (kernel_mm.pml4 != 0) {
+        mm->pml4[0] = kernel_mm.pml4[0];
+        for (size_t i = 256; i < 512; i++) {
+            mm->pml4[i] = kernel_mm.pml4[i];
+        }
+    }
+    return mm;
+}
+
+void mm_get(struct nm_mm *mm)
+{
+    if (mm != 0 && mm != &kernel_mm) {
+        __atomic_add_fetch(&mm->refcount, 1U, __ATOMIC_RELAXED);
+    }
+}
+
+// The last reference goes away only once no task runs in mm, so no CPU has it loaded.
+void mm_put(struct nm_mm *mm)
+{
+    if (mm == 0 || mm == &kernel_mm) {
+        return;
+    }
+    if (__atomic_sub_fetch(&mm->refcount, 1U, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    while (mm->vmas != 0) {
+        struct nm_vma *vma = mm->vmas;
+        mm->vmas = vma->next;
+        kfree(vma);
+    }
+    (void)vmm_unmap_range_release(mm->pml4, NM_USER_BASE, NM_USER_TOP - NM_USER_BASE);
+    pmm_free_page(mm->root);
+    kfree(mm);
+}
+
+struct nm_mm *mm_fork(struct nm_mm *mm)
+{
+    if (mm == 0 || mm == &kernel_mm) {
+        return mm;
+    }
+    struct nm_mm *child = mm_create();
+    if (child == 0) {
+        return 0;
+    }
+
+    // The child is private until returned, so only the parent's lock is needed; it also
+    // keeps the parent's areas and leaves still while they are cloned.
+    bool ok = true;
+    struct nm_vma **tail = &child->vmas;
+    mm_lock(mm);
+    for (const struct nm_vma *vma = mm->vmas; vma != 0 && ok; vma = vma->next) {
+        struct nm_vma *copy = (struct nm_vma *)kmalloc(sizeof(*copy));
+        if (copy == 0) {
+            ok = false;
+            break;
+        }
+        *copy = *vma;
+        copy->next = 0;
+        *tail = copy;
+        tail = &copy->next;
+        ok = vmm_clone_range(child->pml4, mm->pml4, vma->start, vma->end - vma->start);
+    }
+    mm_unlock(mm);
+
+    // The parent's pages lost RW; only this CPU's TLB has been told.
+    if (mm_current() != mm) {
+        mm_tlb_invalidate(mm);
+    }
+    if (!ok) {
+        mm_put(child);
+        return 0;
+    }
+    return child;
+}
+
+uint64_t mm_switch(struct nm_mm *next)
+{
+    uint32_t cpu = cpu_current_id();
+    struct pcid_cpu *pc = &pcid_cpus[cpu];
+    if (next == 0 || pc->active == next) {
+        return 0;
+    }
+
+    uint64_t cr3 = next->root;
+    bool keep = false;
+    if (pcid_enabled) {
+        if (next->pcid_gen[cpu] == pc->generation) {
+            keep = true;
+        } else {
+            if (next != &kernel_mm) {
+                if (pc->next == NM_PCID_COUNT) {
+                    pc->generation++;
+                    pc->next = 1;
+                    pc->stats.rollovers++;
+                }
+                next->pcid[cpu] = (uint16_t)pc->next++;
+            }
+            next->pcid_gen[cpu] = pc->generation;
+        }
+        cr3 |= next->pcid[cpu];
+    }
+
+    if (keep) {
+        cr3 |= CR3_NOFLUSH;
+        pc->stats.noflush++;
+    } else {
+        pc->stats.flushes++;
+    }
+    pc->stats.switches++;
+    pc->active = next;
+    load_cr3(cr3);
+    return cr3;
+}
+
+void mm_tlb_invalidate(struct nm_mm *mm)
+{
+    if (mm == 0 || mm == &kernel_mm) {
+        return;
+    }
+    for (uint32_t cpu = 0; cpu < NM_MAX_CPUS; cpu++) {
+        mm->pcid_gen[cpu] = 0;
+    }
+}
+
+struct nm_mm *mm_current(void)
+{
+    return pcid_cpus[cpu_current_id()].active;
+}
+
+static bool user_range_ok(uint64_t start, uint64_t len)
+{
+    return len != 0 && ((start | len) & 0xFFFULL) == 0 && start >= NM_USER_BASE && start < NM_USER_TOP &&
+           len <= NM_USER_TOP - start;
+}
+
+// Caller holds mm's lock.
+static struct nm_vma *find_vma_locked(struct nm_mm *mm, uint64_t addr)
+{
+    struct nm_vma *vma = mm->vma_cache;
+    if (vma != 0 && addr >= vma->start && addr < vma->end) {
+        return vma;
+    }
+    for (vma = mm->vmas; vma != 0 && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) {
+            mm->vma_cache = vma;
+            return vma;
+        }
+    }
+    return 0;
+}
+
+struct nm_vma *mm_find_vma(struct nm_mm *mm, uint64_t addr)
+{
+    if (mm == 0) {
+        return 0;
+    }
+    mm_lock(mm);
+    struct nm_vma *vma = find_vma_locked(mm, addr);
+    mm_unlock(mm);
+    return vma;
+}
+
+int mm_map(struct nm_mm *mm, uint64_t start, uint64_t len, uint32_t prot, struct nm_vnode *file,
+           uint64_t file_offset)
+{
+    if (mm == 0 || !user_range_ok(start, len) || (file_offset & 0xFFFULL) != 0) {
+        return NM_ERR(NM_EINVAL);
+    }
+    struct nm_vma *vma = (struct nm_vma *)kmalloc(sizeof(*vma));
+    if (vma == 0) {
+        return NM_ERR(NM_ENOMEM);
+    }
+    *vma = (struct nm_vma){.start = start, .end = start + len, .prot = prot, .file = file, .file_offset = file_offset};
+
+    mm_lock(mm);
+    struct nm_vma **link = &mm->vmas;
+    while (*link != 0 && (*link)->end <= start) {
+        link = &(*link)->next;
+    }
+    if (*link != 0 && (*link)->start < vma->end) {
+        mm_unlock(mm);
+        kfree(vma);
+        return NM_ERR(NM_EBUSY);
+    }
+    vma->next = *link;
+    *link = vma;
+    mm_unlock(mm);
+    return 0;
+}
+
+int mm_unmap(struct nm_mm *mm, uint64_t start, uint64_t len)
+{
+    if (mm == 0 || !user_range_ok(start, len)) {
+        return NM_ERR(NM_EINVAL);
+    }
+    uint64_t end = start + len;
+    // Punching a hole in one area needs a descriptor for its tail.
+    struct nm_vma *spare = (struct nm_vma *)kmalloc(sizeof(*spare));
+
+    mm_lock(mm);
+    struct nm_vma **link = &mm->vmas;
+    while (*link != 0 && (*link)->start < end) {
+        struct nm_vma *vma = *link;
+        if (vma->end <= start) {
+            link = &vma->next;
+        } else if (vma->start < start && vma->end > end) {
+            if (spare == 0) {
+                mm_unlock(mm);
+                return NM_ERR(NM_ENOMEM);
+            }
+            *spare = *vma;
+            spare->start = end;
+            spare->file_offset += end - vma->start;
+            vma->end = start;
+            vma->next = spare;
+            spare = 0;
+            break;
+        } else if (vma->start < start) {
+            vma->end = start;
+            link = &vma->next;
+        } else if (vma->end > end) {
+            vma->file_offset += end - vma->start;
+            vma->start = end;
+            break;
+        } else {
+            *link = vma->next;
+            kfree(vma);
+        }
+    }
+    mm->vma_cache = 0;
+    (void)vmm_unmap_range_release(mm->pml4, start, len);
+    mm_unlock(mm);
+
+    // The VMM only flushed this CPU's current address space.
+    if (mm_current() != mm) {
+        mm_tlb_invalidate(mm);
+    }
+    if (spare != 0) {
+        kfree(spare);
+    }
+    return 0;
+}
+
+static uint64_t vma_pte_flags(const struct nm_vma *vma)
+{
+    return PTE_PRESENT | PTE_US | ((vma->prot & NM_VMA_WRITE) != 0 ? PTE_RW : 0);
+}
+
+// Populate one page of vma. Caller holds mm's lock.
+static int fault_in_page(struct nm_mm *mm, struct nm_vma *vma, uint64_t page)
+{
+    uint64_t frame = pmm_alloc_zeroed_page();
+    if (frame == 0) {
+        return NM_ERR(NM_ENOMEM);
+    }
+    if (vma->file != 0) {
+        struct nm_vnode *file = vma->file;
+        uint64_t offset = vma->file_offset + (page - vma->start);
+        if (file->ops == 0 || file->ops->read == 0 ||
+            file->ops->read(file, nm_phys_to_virt(frame), offset, PAGE_SIZE) < 0) {
+            pmm_free_page(frame);
+            return NM_ERR(NM_EFAULT);
+        }
+        __atomic_add_fetch(&fault_stats.file_reads, 1U, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&fault_stats.zero_fills, 1U, __ATOMIC_RELAXED);
+    }
+
+    if (!vmm_map_range(mm->pml4, page, frame, PAGE_SIZE, vma_pte_flags(vma))) {
+        pmm_free_page(frame);
+        return NM_ERR(NM_ENOMEM);
+    }
+    return 0;
+}
+
+// Back the zero-filled 2 MiB block of an anonymous vma at `block` with one huge frame.
+// Caller holds mm's lock.
+static int fault_in_huge(struct nm_mm *mm, struct nm_vma *vma, uint64_t block)
+{
+    uint64_t frame = pmm_alloc_huge();
+    if (frame == 0) {
+        return NM_ERR(NM_ENOMEM);
+    }
+    memset(nm_phys_to_virt(frame), 0, NM_HUGE_PAGE_SIZE);
+    if (!vmm_map_range(mm->pml4, block, frame, NM_HUGE_PAGE_SIZE, vma_pte_flags(vma))) {
+        pmm_free_huge(frame);
+        return NM_ERR(NM_ENOMEM);
+    }
+    __atomic_add_fetch(&fault_stats.huge_fills, 1U, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Give mm its own writable copy of the shared page at `page`, mapped by `entry` (which may
+// be a huge leaf around it). The last holder just gets RW back. Caller holds mm's lock,
+// which keeps the reference count from rising: only a fork of mm itself could share the
+// frame again.
+static int cow_page(struct nm_mm *mm, uint64_t page, uint64_t entry)
+{
+    uint64_t frame;
+    if (!vmm_translate(mm->pml4, page, &frame)) {
+        return NM_ERR(NM_EFAULT);
+    }
+    uint64_t flags = (entry & ((0xFFFULL & ~PTE_PS) | NM_PTE_NX)) | PTE_RW;
+    if (pmm_page_refcount(frame) == 1U) {
+        __atomic_add_fetch(&fault_stats.cow_reused, 1U, __ATOMIC_RELAXED);
+        return vmm_map_range(mm->pml4, page, frame, PAGE_SIZE, flags) ? 0 : NM_ERR(NM_ENOMEM);
+    }
+
+    uint64_t copy = pmm_alloc_page();
+    if (copy == 0) {
+        return NM_ERR(NM_ENOMEM);
+    }
+    memcpy(nm_phys_to_virt(copy), nm_phys_to_virt(frame), PAGE_SIZE);
+    if (!vmm_map_range(mm->pml4, page, copy, PAGE_SIZE, flags)) {
+        pmm_free_page(copy);
+        return NM_ERR(NM_ENOMEM);
+    }
+    // The mapping swap above flushed this CPU; the old frame may now go.
+    pmm_page_put(frame);
+    __atomic_add_fetch(&fault_stats.cow_copies, 1U, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int mm_handle_fault(struct nm_mm *mm, uint64_t addr, uint64_t err)
+{
+    if (mm == 0 || addr < NM_USER_BASE || addr >= NM_USER_TOP) {
+        return NM_ERR(NM_EFAULT);
+    }
+
+    uint64_t page = addr & ~(PAGE_SIZE - 1ULL);
+    mm_lock(mm);
+    struct nm_vma *vma = find_vma_locked(mm, addr);
+    bool allowed = vma != 0 && (vma->prot & (NM_VMA_READ | NM_VMA_WRITE | NM_VMA_EXEC)) != 0 &&
+                   ((err & NM_PF_WRITE) == 0 || (vma->prot & NM_VMA_WRITE) != 0) &&
+                   ((err & NM_PF_FETCH) == 0 || (vma->prot & NM_VMA_EXEC) != 0);
+    if (!allowed) {
+        mm_unlock(mm);
+        return NM_ERR(NM_EFAULT);
+    }
+
+    // Another CPU may have populated the page while this one was on its way here.
+    uint64_t entry = vmm_leaf_entry(mm->pml4, page);
+    int rc;
+    if (entry == 0) {
+        rc = fault_in_page(mm, vma, page);
+    } else if ((err & NM_PF_WRITE) == 0 || (entry & PTE_RW) != 0) {
+        rc = 0;
+    } else {
+        // A write the area allows hit a read-only leaf: the page is shared copy-on-write.
+        rc = cow_page(mm, page, entry);
+    }
+    mm_unlock(mm);
+
+    // Another CPU running mm may still hold the old translation.
+    if (rc == 0 && entry != 0 && mm_current() != mm) {
+        mm_tlb_invalidate(mm);
+    }
+    return rc;
+}
+
+int mm_protect(struct nm_mm *mm, uint64_t start, uint64_t len, uint32_t prot)
+{
+    if (mm == 0 || !user_range_ok(start, len)) {
+        return NM_ERR(NM_EINVAL);
+    }
+    uint64_t end = start + len;
+    // Areas reaching past either end are split there; each split needs a descriptor.
+    struct nm_vma *spare[2] = {(struct nm_vma *)kmalloc(sizeof(struct nm_vma)),
+                               (struct nm_vma *)kmalloc(sizeof(struct nm_vma))};
+    size_t used = 0;
+    int rc = 0;
+
+    mm_lock(mm);
+    struct nm_vma *first = mm->vmas;
+    while (first != 0 && first->end <= start) {
+        first = first->next;
+    }
+    // Like mprotect, the whole range has to be mapped.
+    uint64_t covered = start;
+    size_t splits = 0;
+    for (const struct nm_vma *vma = first; vma != 0 && vma->start <= covered && covered < end; vma = vma->next) {
+        splits += (vma->start < start ? 1U : 0U) + (vma->end > end ? 1U : 0U);
+        covered = vma->end;
+    }
+    if (covered < end) {
+        rc = NM_ERR(NM_EFAULT);
+    } else if ((splits > 0 && spare[0] == 0) || (splits > 1 && spare[1] == 0)) {
+        rc = NM_ERR(NM_ENOMEM);
+    } else {
+        for (struct nm_vma *vma = first; vma != 0 && vma->start < end; vma = vma->next) {
+            uint64_t cut = vma->start < start ? start : (vma->end > end ? end : 0);
+            if (cut != 0) {
+                struct nm_vma *tail = spare[used++];
+                *tail = *vma;
+                tail->start = cut;
+                tail->file_offset += cut - vma->start;
+                vma->end = cut;
+                vma->next = tail;
+                if (cut == start) {
+                    continue;
+                }
+            }
+            vma->prot = prot;
+        }
+        // Write access comes back through the write fault, which also sees to pages still
+        // shared copy-on-write. An area with no access keeps its pages but loses US.
+        uint64_t mask = PTE_US | ((prot & NM_VMA_WRITE) == 0 ? PTE_RW : 0);
+        uint64_t flags = (prot & (NM_VMA_READ | NM_VMA_WRITE | NM_VMA_EXEC)) != 0 ? PTE_US : 0;
+        if (!vmm_protect(mm->pml4, start, len, flags, mask)) {
+            rc = NM_ERR(NM_ENOMEM);
+        }
+    }
+    mm_unlock(mm);
+
+    if (rc == 0 && mm_current() != mm) {
+        mm_tlb_invalidate(mm);
+    }
+    for (size_t i = used; i < 2; i++) {
+        if (spare[i] != 0) {
+            kfree(spare[i]);
+        }
+    }
+    return rc;
+}
+
+// Populate what is missing of the accessible areas overlapping [start, end). With `huge`,
+// only aligned 2 MiB stretches of anonymous areas that are still wholly absent are filled,
+// each with one huge frame; others are left to faults. Caller holds mm's lock.
+static int populate_range(struct nm_mm *mm, uint64_t start, uint64_t end, bool huge)
+{
+    for (struct nm_vma *vma = mm->vmas; vma != 0 && vma->start < end; vma = vma->next) {
+        if (vma->end <= start || (vma->prot & (NM_VMA_READ | NM_VMA_WRITE | NM_VMA_EXEC)) == 0) {
+            continue;
+        }
+        uint64_t lo = vma->start > start ? vma->start : start;
+        uint64_t hi = vma->end < end ? vma->end : end;
+        if (huge) {
+            if (vma->file != 0) {
+                continue;
+            }
+            for (uint64_t block = (lo + NM_HUGE_PAGE_SIZE - 1ULL) & ~(NM_HUGE_PAGE_SIZE - 1ULL);
+                 block < hi && hi - block >= NM_HUGE_PAGE_SIZE; block += NM_HUGE_PAGE_SIZE) {
+                if (vmm_resident(mm->pml4, block, NM_HUGE_PAGE_SIZE) == 0 && fault_in_huge(mm, vma, block) != 0) {
+                    return 0;
+                }
+            }
+            continue;
+        }
+        for (uint64_t page = lo; page < hi; page += PAGE_SIZE) {
+            if (vmm_leaf_entry(mm->pml4, page) == 0) {
+                int rc = fault_in_page(mm, vma, page);
+                if (rc != 0) {
+                    return rc;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int mm_advise(struct nm_mm *mm, uint64_t start, uint64_t len, enum nm_madvise advice)
+{
+    if (mm == 0 || !user_range_ok(start, len)) {
+        return NM_ERR(NM_EINVAL);
+    }
+    int rc = 0;
+    bool changed = false;
+
+    mm_lock(mm);
+    switch (advice) {
+    case NM_MADV_DONTNEED:
+        // The areas stay; the next touch zero-fills or rereads each page.
+        if (!vmm_advise(mm->pml4, start, len, NM_MADV_DONTNEED)) {
+            rc = NM_ERR(NM_ENOMEM);
+        }
+        changed = true;
+        break;
+    case NM_MADV_WILLNEED:
+        rc = populate_range(mm, start, start + len, false);
+        break;
+    case NM_MADV_HUGEPAGE:
+        // No frame for a huge block is not an error: the pages simply stay small.
+        (void)populate_range(mm, start, start + len, true);
+        (void)vmm_advise(mm->pml4, start, len, NM_MADV_HUGEPAGE);
+        changed = true;
+        break;
+    default:
+        rc = NM_ERR(NM_EINVAL);
+        break;
+    }
+    mm_unlock(mm);
+
+    if (changed && mm_current() != mm) {
+        mm_tlb_invalidate(mm);
+    }
+    return rc;
+}
+
+struct nm_mm_fault_stats mm_fault_stats(void)
+{
+    struct nm_mm_fault_stats snapshot;
+    snapshot.zero_fills = __atomic_load_n(&fault_stats.zero_fills, __ATOMIC_RELAXED);
+    snapshot.file_reads = __atomic_load_n(&fault_stats.file_reads, __ATOMIC_RELAXED);
+    snapshot.cow_copies = __atomic_load_n(&fault_stats.cow_copies, __ATOMIC_RELAXED);
+    snapshot.cow_reused = __atomic_load_n(&fault_stats.cow_reused, __ATOMIC_RELAXED);
+    snapshot.huge_fills = __atomic_load_n(&fault_stats.huge_fills, __ATOMIC_RELAXED);
+    return snapshot;
+}
+
+bool mm_pcid_supported(void)
+{
+    return pcid_supported;
+}
+
+void mm_pcid_set_enabled(bool enabled)
+{
+    pcid_enabled = enabled && pcid_supported;
+    pcid_new_generation();
+}
+
+struct nm_mm_switch_stats mm_switch_stats(void)
+{
+    struct nm_mm_switch_stats total = {0};
+    for (uint32_t cpu = 0; cpu < NM_MAX_CPUS; cpu++) {
+        total.switches += pcid_cpus[cpu].stats.switches;
+        total.noflush += pcid_cpus[cpu].stats.noflush;
+        total.flushes += pcid_cpus[cpu].stats.flushes;
+        total.rollovers += pcid_cpus[cpu].stats.rollovers;
+    }
+    return total;
+}
+
+#ifdef NM_SWITCH_BENCH
+
+#include "nm/klog.h"
+
+#define BENCH_PAGES 64U
+#define BENCH_ROUNDS 2000U
+
+static void log_u64(uint64_t value)
+{
+    char buf[24];
+    size_t idx = sizeof(buf);
+    buf[--idx] = '\0';
+    do {
+        buf[--idx] = (char)('0' + value % 10U);
+        value /= 10U;
+    } while (value != 0);
+    klog_write(&buf[idx]);
+}
+
+// Each side touches a working set after switching in, so the cost of the CR3 load
+// includes refilling whatever the load threw away.
+static uint64_t bench_round_trips(struct nm_mm *a, struct nm_mm *b)
+{
+    volatile const uint8_t *base = (volatile const uint8_t *)(uintptr_t)NM_USER_BASE;
+    uint64_t sum = 0;
+    uint64_t start = cpu_rdtsc();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+        struct nm_mm *next = (round & 1U) != 0 ? b : a;
+        (void)mm_switch(next);
+        for (uint32_t page = 0; page < BENCH_PAGES; page++) {
+            sum += base[page * 4096U];
+        }
+    }
+    uint64_t cycles = cpu_rdtsc() - start;
+    (void)sum;
+    return cycles / BENCH_ROUNDS;
+}
+
+void mm_switch_bench(void)
+{
+    struct nm_mm *a = mm_create();
+    struct nm_mm *b = mm_create();
+    // Both working sets are demand-faulted in by a first untimed pass.
+    if (a == 0 || b == 0 ||
+        mm_map(a, NM_USER_BASE, BENCH_PAGES * 4096ULL, NM_VMA_READ | NM_VMA_WRITE, 0, 0) != 0 ||
+        mm_map(b, NM_USER_BASE, BENCH_PAGES * 4096ULL, NM_VMA_READ | NM_VMA_WRITE, 0, 0) != 0) {
+        klog_write("switch bench: setup failed\n");
+    } else {
+        bool was_enabled = pcid_enabled;
+        (void)bench_round_trips(a, b);
+        klog_write("switch bench: cycles/switch+touch ");
+        log_u64(BENCH_PAGES);
+        klog_write(" pages: pcid=off ");
+        mm_pcid_set_enabled(false);
+        log_u64(bench_round_trips(a, b));
+        if (pcid_supported) {
+            klog_write(" pcid=on ");
+            mm_pcid_set_enabled(true);
+            log_u64(bench_round_trips(a, b));
+        } else {
+            klog_write(" pcid=unsupported");
+        }
+        klog_write("\n");
+        mm_pcid_set_enabled(was_enabled);
+    }
+    (void)mm_switch(&kernel_mm);
+    mm_put(a);
+    mm_put(b);
+}
+
+#else
+
+void mm_switch_bench(void)
+{
+}
+
+#endif
@@ -1,90 +1,1108 @@
 #include "nm/mm.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "nm/cpu.h"
 #include "nm/string.h"
 
 #define PAGE_SIZE 4096ULL
-#define KMALLOC_MAGIC 0x4D4E564BUL
+#define KMALLOC_MAGIC_SLAB 0x4D4E534CUL
+#define KMALLOC_ALIGN 16U
+#define KMALLOC_MIN_SHIFT 4U
+#define KMALLOC_CLASSES 7U
+#define KMALLOC_MAX_SMALL (1U << (KMALLOC_MIN_SHIFT + KMALLOC_CLASSES - 1U))
+#define KMEM_PAGE_CACHE_MAX 8U
+#define KMEM_FRAME_NIL UINT32_MAX
+#define KHEAP_ARENA_PAGES 16U
+#define KHEAP_ARENA_MAX_ALLOC (16U * 1024U)
+#define KHEAP_BLOCK_MAGIC 0x4D4E4254UL
+#define KHEAP_BLOCK_MIN 64U
+#define KHEAP_BIN_MIN_SHIFT 6U
+#define KHEAP_BIN_SPLIT 2U
+#define KHEAP_BINS (11U << KHEAP_BIN_SPLIT)
+#define KHEAP_BIN_SCAN 8U
+#define KMAG_SIZE 16U
+#define KMAG_DEPOT_FULL_MAX 4U
+#define KMAG_POOL (NM_MAX_CPUS * 2U + KMAG_DEPOT_FULL_MAX)
 
-struct kmalloc_header {
+// Every page the heap takes from the PMM records what it is in its descriptor's owner link
+// fields: `prev` holds the kind and `next` the first frame of the run it belongs to. The
+// first frame of a large run is marked NM_PAGE_HEAD and keeps the run length in `next`.
+enum kheap_page_kind {
+    KHEAP_PAGE_SLAB = 1,
+    KHEAP_PAGE_LARGE,
+    KHEAP_PAGE_ARENA,
+    KHEAP_PAGE_CACHE,
+};
+
+// One page of equally sized objects. The header sits at the start of the page, so kfree
+// finds it by rounding the object pointer down to the page boundary.
+struct kmem_slab {
     uint32_t magic;
+    uint16_t inuse;
+    uint16_t total;
+    struct kmem_cache *cache;
+    void *freelist;
+    struct kmem_slab *next;
+    struct kmem_slab *prev;
+};
+
+struct kmem_cache {
+    const char *name;
+    uint32_t obj_size;
+    uint32_t align;
+    // Distance between objects and where a free object keeps its free-list link. Caches
+    // with a constructor keep the link behind the object so constructed state survives.
+    uint32_t stride;
+    uint32_t link_offset;
+    uint16_t objs_per_slab;
+    uint16_t first_offset;
+    void (*ctor)(void *obj);
+    // Slabs with at least one free object; full slabs are on no list at all.
+    struct kmem_slab *partial;
+    // Objects too big for a one-page slab are whole page runs instead. Freed runs stay
+    // constructed on a short list chained through struct nm_page::next.
+    uint32_t pages_per_obj;
+    uint32_t page_free_head;
+    uint32_t page_free_count;
+    uint64_t slabs;
+    uint64_t active_objs;
+    uint64_t allocs;
+    uint64_t frees;
+    struct kmem_cache *next;
+};
+
+// Mid-sized allocations are carved from 64 KiB arenas of boundary-tagged blocks. Each
+// header records its own size and the size of the block before it, so a freed block can
+// find and merge with both neighbours in O(1). A used zero-size tag ends every arena.
+struct kheap_block {
+    uint32_t magic;
+    uint32_t used;
     uint32_t size;
-    struct kmalloc_header *next;
+    uint32_t prev_size;
+};
+
+struct kheap_free_block {
+    struct kheap_block tag;
+    struct kheap_free_block *next;
+    struct kheap_free_block *prev;
 };
 
-static struct kmalloc_header *free_list;
+struct kheap_arena {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t pad;
+};
+
+// A magazine is a small stack of free objects of one kmalloc class. Each CPU owns two per
+// class and allocates and frees against them with only interrupts disabled; kheap_lock is
+// taken only to swap magazines with the depot or to move objects to and from the slabs.
+struct kmem_magazine {
+    uint32_t count;
+    struct kmem_magazine *next;
+    void *objs[KMAG_SIZE];
+};
+
+struct kmem_cpu_cache {
+    struct kmem_magazine *loaded;
+    struct kmem_magazine *previous;
+};
+
+// Magazines come from a fixed per-class pool: two per CPU plus KMAG_DEPOT_FULL_MAX that
+// live on the depot's full or empty list, so exchanges never allocate.
+struct kmem_depot {
+    struct kmem_magazine *full;
+    struct kmem_magazine *empty;
+    uint32_t full_count;
+    struct kmem_magazine pool[KMAG_POOL];
+};
+
+static struct kmem_cache kmalloc_caches[KMALLOC_CLASSES];
+static struct kmem_depot kmalloc_depots[KMALLOC_CLASSES];
+static struct kmem_cpu_cache kmalloc_cpu[NM_MAX_CPUS][KMALLOC_CLASSES];
+static volatile uint32_t kheap_lock_word;
+static struct kmem_cache *cache_list;
+static uint64_t large_pages;
+
+// Free arena blocks binned by log2(size) with four linear steps per power of two; the
+// last bin takes everything larger.
+static struct kheap_free_block *arena_bins[KHEAP_BINS];
+static uint64_t arena_bin_mask;
+static uint64_t arena_count;
+static uint64_t arena_free_bytes;
+
+static inline void kheap_lock(void)
+{
+    while (__sync_lock_test_and_set(&kheap_lock_word, 1U) != 0U) {
+        __asm__ volatile("pause");
+    }
+}
+
+static inline void kheap_unlock(void)
+{
+    __sync_lock_release(&kheap_lock_word);
+}
+
+static inline void *ptr_from_phys(uint64_t phys)
+{
+    return nm_phys_to_virt(phys);
+}
+
+static inline uint64_t phys_from_ptr(const void *ptr)
+{
+    return nm_virt_to_phys(ptr);
+}
+
+static inline void *page_base(const void *ptr)
+{
+    return (void *)((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE - 1ULL));
+}
+
+static void tag_pages(uint64_t phys, size_t pages, uint32_t kind)
+{
+    for (size_t i = 0; i < pages; i++) {
+        struct nm_page *page = pmm_phys_to_page(phys + i * PAGE_SIZE);
+        page->flags |= NM_PAGE_KHEAP;
+        page->prev = kind;
+        page->next = (uint32_t)(phys / PAGE_SIZE);
+    }
+}
+
+static inline uint32_t size_class(size_t size)
+{
+    if (size <= (1U << KMALLOC_MIN_SHIFT)) {
+        return 0;
+    }
+    return (uint32_t)(64 - __builtin_clzll((unsigned long long)(size - 1U))) - KMALLOC_MIN_SHIFT;
+}
+
+static inline uint32_t align_up_u32(uint32_t value, uint32_t align)
+{
+    return (value + align - 1U) & ~(align - 1U);
+}
+
+static void cache_setup(struct kmem_cache *cache, const char *name, uint32_t obj_size, uint32_t align,
+                        void (*ctor)(void *obj))
+{
+    if (align < KMALLOC_ALIGN) {
+        align = KMALLOC_ALIGN;
+    }
+
+    *cache = (struct kmem_cache){0};
+    cache->name = name;
+    cache->obj_size = obj_size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->link_offset = ctor != 0 ? align_up_u32(obj_size, sizeof(void *)) : 0;
+    cache->stride = align_up_u32(ctor != 0 ? cache->link_offset + (uint32_t)sizeof(void *) : obj_size, align);
+    cache->page_free_head = KMEM_FRAME_NIL;
+
+    uint32_t offset = align_up_u32((uint32_t)sizeof(struct kmem_slab), align);
+    if (offset + cache->stride <= PAGE_SIZE) {
+        cache->first_offset = (uint16_t)offset;
+        cache->objs_per_slab = (uint16_t)((PAGE_SIZE - offset) / cache->stride);
+    } else {
+        cache->pages_per_obj = (uint32_t)((obj_size + PAGE_SIZE - 1ULL) / PAGE_SIZE);
+    }
+
+    cache->next = cache_list;
+    cache_list = cache;
+}
+
+static inline void **free_link(const struct kmem_cache *cache, void *obj)
+{
+    return (void **)((uint8_t *)obj + cache->link_offset);
+}
+
+static void partial_push(struct kmem_cache *cache, struct kmem_slab *slab)
+{
+    slab->prev = 0;
+    slab->next = cache->partial;
+    if (cache->partial != 0) {
+        cache->partial->prev = slab;
+    }
+    cache->partial = slab;
+}
+
+static void partial_remove(struct kmem_cache *cache, struct kmem_slab *slab)
+{
+    if (slab->prev != 0) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next != 0) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = 0;
+    slab->prev = 0;
+}
+
+static struct kmem_slab *slab_create(struct kmem_cache *cache)
+{
+    uint64_t phys = pmm_alloc_page();
+    if (phys == 0) {
+        return 0;
+    }
+    tag_pages(phys, 1, KHEAP_PAGE_SLAB);
+
+    struct kmem_slab *slab = (struct kmem_slab *)ptr_from_phys(phys);
+    slab->magic = KMALLOC_MAGIC_SLAB;
+    slab->inuse = 0;
+    slab->total = cache->objs_per_slab;
+    slab->cache = cache;
+
+    // Thread the free list in address order so fresh slabs hand out objects sequentially.
+    uint8_t *obj = (uint8_t *)slab + cache->first_offset;
+    slab->freelist = obj;
+    for (uint16_t i = 0; i < slab->total; i++) {
+        if (cache->ctor != 0) {
+            cache->ctor(obj);
+        }
+        *free_link(cache, obj) = (i + 1U < slab->total) ? obj + cache->stride : 0;
+        obj += cache->stride;
+    }
+
+    partial_push(cache, slab);
+    cache->slabs++;
+    return slab;
+}
+
+static void *cache_alloc(struct kmem_cache *cache)
+{
+    struct kmem_slab *slab = cache->partial;
+    if (slab == 0) {
+        slab = slab_create(cache);
+        if (slab == 0) {
+            return 0;
+        }
+    }
+
+    void *obj = slab->freelist;
+    slab->freelist = *free_link(cache, obj);
+    slab->inuse++;
+    if (slab->inuse == slab->total) {
+        partial_remove(cache, slab);
+    }
+    cache->active_objs++;
+    cache->allocs++;
+    return obj;
+}
+
+// Only looks at the slab's fixed geometry, so it is safe without kheap_lock.
+static bool slab_owns(const struct kmem_slab *slab, const void *obj)
+{
+    const struct kmem_cache *cache = slab->cache;
+    uintptr_t offset = (uintptr_t)obj - (uintptr_t)slab;
+    return offset >= cache->first_offset && (offset - cache->first_offset) % cache->stride == 0;
+}
+
+static void cache_free(struct kmem_slab *slab, void *obj)
+{
+    struct kmem_cache *cache = slab->cache;
+    if (!slab_owns(slab, obj) || slab->inuse == 0) {
+        return;
+    }
+
+    if (slab->inuse == slab->total) {
+        partial_push(cache, slab);
+    }
+    *free_link(cache, obj) = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->active_objs--;
+    cache->frees++;
+
+    // Keep the last partial slab around so a cache bouncing between empty and one object
+    // does not hit the PMM every time; any other empty slab goes straight back.
+    if (slab->inuse == 0 && (cache->partial != slab || slab->next != 0)) {
+        partial_remove(cache, slab);
+        slab->magic = 0;
+        cache->slabs--;
+        pmm_free_page(phys_from_ptr(slab));
+    }
+}
+
+static void *page_obj_alloc(struct kmem_cache *cache)
+{
+    uint64_t phys;
+    if (cache->page_free_head != KMEM_FRAME_NIL) {
+        phys = (uint64_t)cache->page_free_head * PAGE_SIZE;
+        cache->page_free_head = pmm_phys_to_page(phys)->next;
+        cache->page_free_count--;
+    } else {
+        phys = pmm_alloc_pages_zone(cache->pages_per_obj, NM_ZONE_MASK_ANY,
+                                    cache->align > PAGE_SIZE ? cache->align : 0);
+        if (phys == 0) {
+            return 0;
+        }
+        tag_pages(phys, cache->pages_per_obj, KHEAP_PAGE_CACHE);
+        cache->slabs++;
+        if (cache->ctor != 0) {
+            cache->ctor(ptr_from_phys(phys));
+        }
+    }
+    cache->active_objs++;
+    cache->allocs++;
+    return ptr_from_phys(phys);
+}
+
+static void page_obj_free(struct kmem_cache *cache, void *obj)
+{
+    uint64_t phys = phys_from_ptr(obj);
+    if (phys == 0 || (phys % PAGE_SIZE) != 0 || cache->active_objs == 0) {
+        return;
+    }
+
+    cache->active_objs--;
+    cache->frees++;
+    if (cache->page_free_count < KMEM_PAGE_CACHE_MAX) {
+        pmm_phys_to_page(phys)->next = cache->page_free_head;
+        cache->page_free_head = (uint32_t)(phys / PAGE_SIZE);
+        cache->page_free_count++;
+        return;
+    }
+    cache->slabs--;
+    pmm_free_pages(phys, cache->pages_per_obj);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj))
+{
+    if (size == 0 || size > UINT32_MAX / 2U || (align & (align - 1U)) != 0 || align > UINT32_MAX / 2U) {
+        return 0;
+    }
+
+    struct kmem_cache *cache = (struct kmem_cache *)kmalloc(sizeof(*cache));
+    if (cache == 0) {
+        return 0;
+    }
+    kheap_lock();
+    cache_setup(cache, name, (uint32_t)size, (uint32_t)align, ctor);
+    kheap_unlock();
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    if (cache == 0) {
+        return 0;
+    }
+    kheap_lock();
+    void *obj = cache->pages_per_obj != 0 ? page_obj_alloc(cache) : cache_alloc(cache);
+    kheap_unlock();
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    if (cache == 0 || obj == 0) {
+        return;
+    }
+    kheap_lock();
+    if (cache->pages_per_obj != 0) {
+        page_obj_free(cache, obj);
+    } else {
+        struct kmem_slab *slab = (struct kmem_slab *)page_base(obj);
+        if (slab->magic == KMALLOC_MAGIC_SLAB && slab->cache == cache) {
+            cache_free(slab, obj);
+        }
+    }
+    kheap_unlock();
+}
+
+size_t kmem_cache_stats(struct nm_kmem_cache_stats *out, size_t max)
+{
+    size_t count = 0;
+    kheap_lock();
+    for (const struct kmem_cache *cache = cache_list; cache != 0; cache = cache->next) {
+        if (count < max) {
+            out[count].name = cache->name;
+            out[count].obj_size = cache->obj_size;
+            out[count].slabs = cache->slabs;
+            out[count].active_objs = cache->active_objs;
+            out[count].allocs = cache->allocs;
+            out[count].frees = cache->frees;
+        }
+        count++;
+    }
+    kheap_unlock();
+    return count;
+}
+
+static inline struct kheap_block *block_next(struct kheap_block *block)
+{
+    return (struct kheap_block *)((uint8_t *)block + block->size);
+}
+
+static inline struct kheap_block *block_prev(struct kheap_block *block)
+{
+    return (struct kheap_block *)((uint8_t *)block - block->prev_size);
+}
+
+static inline uint32_t arena_bin(uint32_t size)
+{
+    uint32_t log2 = (uint32_t)(31 - __builtin_clz(size));
+    uint32_t step = (size >> (log2 - KHEAP_BIN_SPLIT)) & ((1U << KHEAP_BIN_SPLIT) - 1U);
+    uint32_t bin = ((log2 - KHEAP_BIN_MIN_SHIFT) << KHEAP_BIN_SPLIT) | step;
+    return bin < KHEAP_BINS ? bin : KHEAP_BINS - 1U;
+}
+
+static void bin_insert(struct kheap_block *block)
+{
+    struct kheap_free_block *free_block = (struct kheap_free_block *)block;
+    uint32_t bin = arena_bin(block->size);
+    free_block->prev = 0;
+    free_block->next = arena_bins[bin];
+    if (arena_bins[bin] != 0) {
+        arena_bins[bin]->prev = free_block;
+    }
+    arena_bins[bin] = free_block;
+    arena_bin_mask |= 1ULL << bin;
+    arena_free_bytes += block->size;
+}
+
+static void bin_remove(struct kheap_block *block)
+{
+    struct kheap_free_block *free_block = (struct kheap_free_block *)block;
+    uint32_t bin = arena_bin(block->size);
+    if (free_block->prev != 0) {
+        free_block->prev->next = free_block->next;
+    } else {
+        arena_bins[bin] = free_block->next;
+        if (arena_bins[bin] == 0) {
+            arena_bin_mask &= ~(1ULL << bin);
+        }
+    }
+    if (free_block->next != 0) {
+        free_block->next->prev = free_block->prev;
+    }
+    arena_free_bytes -= block->size;
+}
+
+// Cut a used block down to `need` bytes when the tail is big enough to be a block of its
+// own, merging the tail into a free successor.
+static void arena_trim(struct kheap_block *block, uint32_t need)
+{
+    if (block->size - need < KHEAP_BLOCK_MIN) {
+        return;
+    }
+    struct kheap_block *rest = (struct kheap_block *)((uint8_t *)block + need);
+    rest->magic = KHEAP_BLOCK_MAGIC;
+    rest->used = 0;
+    rest->size = block->size - need;
+    rest->prev_size = need;
+    block->size = need;
+
+    struct kheap_block *next = block_next(rest);
+    if (next->used == 0) {
+        bin_remove(next);
+        rest->size += next->size;
+        next->magic = 0;
+        next = block_next(rest);
+    }
+    next->prev_size = rest->size;
+    bin_insert(rest);
+}
+
+static bool arena_grow(void)
+{
+    uint64_t phys = pmm_alloc_pages(KHEAP_ARENA_PAGES);
+    if (phys == 0) {
+        return false;
+    }
+    tag_pages(phys, KHEAP_ARENA_PAGES, KHEAP_PAGE_ARENA);
+
+    uint8_t *base = (uint8_t *)ptr_from_phys(phys);
+    uint32_t span = (uint32_t)(KHEAP_ARENA_PAGES * PAGE_SIZE);
+    ((struct kheap_arena *)base)->magic = KHEAP_BLOCK_MAGIC;
+
+    struct kheap_block *block = (struct kheap_block *)(base + sizeof(struct kheap_arena));
+    block->magic = KHEAP_BLOCK_MAGIC;
+    block->used = 0;
+    block->size = span - (uint32_t)(sizeof(struct kheap_arena) + sizeof(struct kheap_block));
+    block->prev_size = 0;
+
+    struct kheap_block *end = block_next(block);
+    end->magic = KHEAP_BLOCK_MAGIC;
+    end->used = 1;
+    end->size = 0;
+    end->prev_size = block->size;
+
+    bin_insert(block);
+    arena_count++;
+    return true;
+}
+
+// Bounded first fit inside the request's own bin, then the head of any larger bin, which
+// always fits. The block is split when the tail is big enough to be useful on its own.
+static struct kheap_block *arena_take(uint32_t need)
+{
+    uint32_t bin = arena_bin(need);
+    struct kheap_free_block *found = 0;
+    uint32_t scanned = 0;
+    for (struct kheap_free_block *cur = arena_bins[bin]; cur != 0 && scanned < KHEAP_BIN_SCAN;
+         cur = cur->next, scanned++) {
+        if (cur->tag.size >= need) {
+            found = cur;
+            break;
+        }
+    }
+    if (found == 0) {
+        uint64_t larger = arena_bin_mask & ~((2ULL << bin) - 1ULL);
+        if (larger == 0) {
+            return 0;
+        }
+        found = arena_bins[__builtin_ctzll(larger)];
+    }
+
+    struct kheap_block *block = &found->tag;
+    bin_remove(block);
+    block->used = 1;
+    arena_trim(block, need);
+    return block;
+}
+
+static inline uint32_t arena_need(size_t size)
+{
+    return align_up_u32((uint32_t)(size + sizeof(struct kheap_block)), KMALLOC_ALIGN);
+}
+
+static struct kheap_block *arena_take_or_grow(uint32_t need)
+{
+    struct kheap_block *block = arena_take(need);
+    if (block == 0 && arena_grow()) {
+        block = arena_take(need);
+    }
+    return block;
+}
+
+static void *arena_alloc(size_t size)
+{
+    struct kheap_block *block = arena_take_or_grow(arena_need(size));
+    return block != 0 ? block + 1 : 0;
+}
+
+// Over-allocate by `align` plus one minimum block, then give the misaligned head back as
+// a free block of its own so the payload starts on the boundary.
+static void *arena_alloc_aligned(size_t size, uint32_t align)
+{
+    uint32_t need = arena_need(size);
+    struct kheap_block *block = arena_take_or_grow(need + align + KHEAP_BLOCK_MIN);
+    if (block == 0) {
+        return 0;
+    }
+
+    uintptr_t payload = (uintptr_t)(block + 1);
+    uintptr_t aligned = (payload + align - 1U) & ~(uintptr_t)(align - 1U);
+    if (aligned != payload && aligned - payload < KHEAP_BLOCK_MIN) {
+        aligned = (payload + KHEAP_BLOCK_MIN + align - 1U) & ~(uintptr_t)(align - 1U);
+    }
+    if (aligned != payload) {
+        uint32_t gap = (uint32_t)(aligned - payload);
+        struct kheap_block *moved = (struct kheap_block *)aligned - 1;
+        moved->magic = KHEAP_BLOCK_MAGIC;
+        moved->used = 1;
+        moved->size = block->size - gap;
+        moved->prev_size = gap;
+        block_next(moved)->prev_size = moved->size;
+        // The block before was used (free neighbours are always merged), so the gap
+        // becomes a free block on its own.
+        block->used = 0;
+        block->size = gap;
+        bin_insert(block);
+        block = moved;
+    }
+    arena_trim(block, need);
+    return block + 1;
+}
+
+static void arena_free(struct kheap_block *block)
+{
+    if (block->magic != KHEAP_BLOCK_MAGIC || block->used == 0 || block->size == 0) {
+        return;
+    }
+    block->used = 0;
+
+    struct kheap_block *next = block_next(block);
+    if (next->used == 0) {
+        bin_remove(next);
+        block->size += next->size;
+        next->magic = 0;
+    }
+    if (block->prev_size != 0) {
+        struct kheap_block *prev = block_prev(block);
+        if (prev->used == 0) {
+            bin_remove(prev);
+            prev->size += block->size;
+            block->magic = 0;
+            block = prev;
+        }
+    }
+    next = block_next(block);
+    next->prev_size = block->size;
+
+    // A fully free arena goes back to the PMM unless it is the last one left.
+    if (block->prev_size == 0 && next->size == 0 && arena_count > 1) {
+        arena_count--;
+        pmm_free_pages(phys_from_ptr((uint8_t *)block - sizeof(struct kheap_arena)), KHEAP_ARENA_PAGES);
+        return;
+    }
+    bin_insert(block);
+}
+
+static uint32_t arena_largest_free(void)
+{
+    if (arena_bin_mask == 0) {
+        return 0;
+    }
+    uint32_t bin = 63U - (uint32_t)__builtin_clzll(arena_bin_mask);
+    uint32_t largest = 0;
+    for (const struct kheap_free_block *cur = arena_bins[bin]; cur != 0; cur = cur->next) {
+        if (cur->tag.size > largest) {
+            largest = cur->tag.size;
+        }
+    }
+    return largest;
+}
+
+static void depot_init(void)
+{
+    for (uint32_t cls = 0; cls < KMALLOC_CLASSES; cls++) {
+        struct kmem_depot *depot = &kmalloc_depots[cls];
+        memset(depot, 0, sizeof(*depot));
+        for (uint32_t cpu = 0; cpu < NM_MAX_CPUS; cpu++) {
+            kmalloc_cpu[cpu][cls].loaded = &depot->pool[cpu * 2U];
+            kmalloc_cpu[cpu][cls].previous = &depot->pool[cpu * 2U + 1U];
+        }
+        for (uint32_t i = NM_MAX_CPUS * 2U; i < KMAG_POOL; i++) {
+            depot->pool[i].next = depot->empty;
+            depot->empty = &depot->pool[i];
+        }
+    }
+}
+
+static inline void magazine_swap(struct kmem_cpu_cache *cc)
+{
+    struct kmem_magazine *tmp = cc->loaded;
+    cc->loaded = cc->previous;
+    cc->previous = tmp;
+}
+
+// Hand every object in `mag` back to its slab. Caller holds kheap_lock.
+static void magazine_flush(struct kmem_magazine *mag)
+{
+    while (mag->count > 0) {
+        void *obj = mag->objs[--mag->count];
+        cache_free((struct kmem_slab *)page_base(obj), obj);
+    }
+}
+
+// Both CPU magazines are empty: trade the spare empty one for a full magazine from the
+// depot, or refill half a magazine straight from the slabs.
+static void magazine_refill(uint32_t cls, struct kmem_cpu_cache *cc)
+{
+    struct kmem_depot *depot = &kmalloc_depots[cls];
+    kheap_lock();
+    if (depot->full != 0) {
+        struct kmem_magazine *full = depot->full;
+        depot->full = full->next;
+        depot->full_count--;
+        cc->previous->next = depot->empty;
+        depot->empty = cc->previous;
+        cc->previous = cc->loaded;
+        cc->loaded = full;
+    } else {
+        while (cc->loaded->count < KMAG_SIZE / 2U) {
+            void *obj = cache_alloc(&kmalloc_caches[cls]);
+            if (obj == 0) {
+                break;
+            }
+            cc->loaded->objs[cc->loaded->count++] = obj;
+        }
+    }
+    kheap_unlock();
+}
+
+// Both CPU magazines are full: park one in the depot and take an empty one back. Once the
+// depot holds its limit, the objects go back to the slabs so idle classes release pages.
+static void magazine_spill(uint32_t cls, struct kmem_cpu_cache *cc)
+{
+    struct kmem_depot *depot = &kmalloc_depots[cls];
+    kheap_lock();
+    if (depot->full_count < KMAG_DEPOT_FULL_MAX) {
+        struct kmem_magazine *empty = depot->empty;
+        depot->empty = empty->next;
+        cc->previous->next = depot->full;
+        depot->full = cc->previous;
+        depot->full_count++;
+        cc->previous = cc->loaded;
+        cc->loaded = empty;
+    } else {
+        magazine_flush(cc->previous);
+        magazine_swap(cc);
+    }
+    kheap_unlock();
+}
+
+static void *magazine_alloc(uint32_t cls)
+{
+    uint64_t irq_flags = cpu_irq_save();
+    struct kmem_cpu_cache *cc = &kmalloc_cpu[cpu_current_id()][cls];
+    if (cc->loaded->count == 0) {
+        if (cc->previous->count != 0) {
+            magazine_swap(cc);
+        } else {
+            magazine_refill(cls, cc);
+        }
+    }
+    void *obj = 0;
+    if (cc->loaded->count != 0) {
+        obj = cc->loaded->objs[--cc->loaded->count];
+    }
+    cpu_irq_restore(irq_flags);
+    return obj;
+}
+
+static void magazine_free(uint32_t cls, void *obj)
+{
+    uint64_t irq_flags = cpu_irq_save();
+    struct kmem_cpu_cache *cc = &kmalloc_cpu[cpu_current_id()][cls];
+    if (cc->loaded->count == KMAG_SIZE) {
+        if (cc->previous->count == 0) {
+            magazine_swap(cc);
+        } else {
+            magazine_spill(cls, cc);
+        }
+    }
+    cc->loaded->objs[cc->loaded->count++] = obj;
+    cpu_irq_restore(irq_flags);
+}
+
+static uint64_t magazine_objects(void)
+{
+    uint64_t total = 0;
+    for (uint32_t cls = 0; cls < KMALLOC_CLASSES; cls++) {
+        for (uint32_t cpu = 0; cpu < NM_MAX_CPUS; cpu++) {
+            total += kmalloc_cpu[cpu][cls].loaded->count + kmalloc_cpu[cpu][cls].previous->count;
+        }
+        total += (uint64_t)kmalloc_depots[cls].full_count * KMAG_SIZE;
+    }
+    return total;
+}
+
+void kheap_drain(void)
+{
+    uint64_t irq_flags = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    kheap_lock();
+    for (uint32_t cls = 0; cls < KMALLOC_CLASSES; cls++) {
+        struct kmem_depot *depot = &kmalloc_depots[cls];
+        magazine_flush(kmalloc_cpu[cpu][cls].loaded);
+        magazine_flush(kmalloc_cpu[cpu][cls].previous);
+        while (depot->full != 0) {
+            struct kmem_magazine *mag = depot->full;
+            depot->full = mag->next;
+            magazine_flush(mag);
+            mag->next = depot->empty;
+            depot->empty = mag;
+        }
+        depot->full_count = 0;
+    }
+    kheap_unlock();
+    cpu_irq_restore(irq_flags);
+}
+
+static inline size_t pages_for(size_t size)
+{
+    return (size + PAGE_SIZE - 1ULL) / PAGE_SIZE;
+}
+
+static void *large_alloc(size_t size, size_t align)
+{
+    size_t pages = pages_for(size);
+    uint64_t phys = pmm_alloc_pages_zone(pages, NM_ZONE_MASK_ANY, align > PAGE_SIZE ? align : 0);
+    if (phys == 0) {
+        return 0;
+    }
+    tag_pages(phys, pages, KHEAP_PAGE_LARGE);
+
+    struct nm_page *head = pmm_phys_to_page(phys);
+    head->flags |= NM_PAGE_HEAD;
+    head->next = (uint32_t)pages;
+    large_pages += pages;
+    return ptr_from_phys(phys);
+}
+
+// Resize a large run in place: shrink by returning the tail, grow by claiming the frames
+// right after it. Caller holds kheap_lock.
+static bool large_resize(uint64_t phys, struct nm_page *head, size_t size)
+{
+    size_t pages = head->next;
+    size_t new_pages = pages_for(size);
+    if (new_pages < pages) {
+        pmm_free_pages(phys + new_pages * PAGE_SIZE, pages - new_pages);
+    } else if (new_pages > pages) {
+        if (!pmm_grow_pages(phys, pages, new_pages)) {
+            return false;
+        }
+        tag_pages(phys + pages * PAGE_SIZE, new_pages - pages, KHEAP_PAGE_LARGE);
+        for (size_t i = pages; i < new_pages; i++) {
+            pmm_phys_to_page(phys + i * PAGE_SIZE)->next = (uint32_t)(phys / PAGE_SIZE);
+        }
+    }
+    large_pages = large_pages - pages + new_pages;
+    head->next = (uint32_t)new_pages;
+    return true;
+}
+
+void kheap_init(void)
+{
+    static const char *const class_names[KMALLOC_CLASSES] = {
+        "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+        "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+    };
+
+    cache_list = 0;
+    for (uint32_t i = KMALLOC_CLASSES; i-- > 0;) {
+        // Aligning each class to its own size costs no objects per slab and makes every
+        // kmalloc object naturally aligned, which kmalloc_aligned relies on.
+        uint32_t size = 1U << (KMALLOC_MIN_SHIFT + i);
+        cache_setup(&kmalloc_caches[i], class_names[i], size, size, 0);
+    }
+    depot_init();
+    kheap_lock_word = 0;
+    large_pages = 0;
+    memset(arena_bins, 0, sizeof(arena_bins));
+    arena_bin_mask = 0;
+    arena_count = 0;
+    arena_free_bytes = 0;
+}
 
 void mm_init(uint64_t mb2_info_ptr)
 {
     pmm_init_from_multiboot2(mb2_info_ptr);
 #ifndef NEVERMIND_HOST_TEST
+    // The direct map has to cover all RAM before the heap hands out frames above the
+    // boot window.
     vmm_init();
+#endif
+    kheap_init();
+#ifndef NEVERMIND_HOST_TEST
+    // mm_create copies the kernel's PML4 slots, so vmalloc pins its slot first.
+    vmalloc_init();
+    mm_space_init();
 #endif
 }
 
-void *kmalloc(size_t size)
+static void *heap_alloc(size_t size)
 {
     if (size == 0) {
         return 0;
     }
+    if (size <= KMALLOC_MAX_SMALL) {
+        return magazine_alloc(size_class(size));
+    }
 
-    struct kmalloc_header **prev = &free_list;
-    struct kmalloc_header *cur = free_list;
-    while (cur != 0) {
-        if (cur->size >= size) {
-            *prev = cur->next;
-            cur->next = 0;
-            return (void *)(cur + 1);
-        }
-        prev = &cur->next;
-        cur = cur->next;
+    kheap_lock();
+    void *ptr = size <= KHEAP_ARENA_MAX_ALLOC ? arena_alloc(size) : large_alloc(size, 0);
+    kheap_unlock();
+    return ptr;
+}
+
+static void *heap_alloc_aligned(size_t size, size_t align)
+{
+    if (size == 0 || (align & (align - 1U)) != 0) {
+        return 0;
+    }
+    if (align <= KMALLOC_ALIGN) {
+        return heap_alloc(size);
+    }
+    if (size <= KMALLOC_MAX_SMALL && align <= KMALLOC_MAX_SMALL) {
+        return magazine_alloc(size_class(size > align ? size : align));
+    }
+
+    kheap_lock();
+    void *ptr;
+    if (size <= KHEAP_ARENA_MAX_ALLOC && align < PAGE_SIZE) {
+        ptr = arena_alloc_aligned(size, (uint32_t)align);
+    } else {
+        ptr = large_alloc(size, align);
     }
+    kheap_unlock();
+    return ptr;
+}
+
+static void heap_free(void *ptr);
 
-    size_t total = sizeof(struct kmalloc_header) + size;
-    size_t pages = (total + PAGE_SIZE - 1ULL) / PAGE_SIZE;
-    uint64_t first_page = pmm_alloc_pages(pages);
-    if (first_page == 0) {
+static void *heap_realloc(void *ptr, size_t size)
+{
+    if (ptr == 0) {
+        return heap_alloc(size);
+    }
+    if (size == 0) {
+        heap_free(ptr);
         return 0;
     }
 
-    struct kmalloc_header *header;
-#ifdef NEVERMIND_HOST_TEST
-    header = (struct kmalloc_header *)pmm_host_ptr_from_key(first_page);
-#else
-    header = (struct kmalloc_header *)(uintptr_t)first_page;
-#endif
-    header->magic = KMALLOC_MAGIC;
-    header->size = (uint32_t)(pages * PAGE_SIZE - sizeof(*header));
-    header->next = 0;
+    uint64_t phys = phys_from_ptr(ptr);
+    struct nm_page *page = pmm_phys_to_page(phys);
+    if (page == 0 || (page->flags & NM_PAGE_KHEAP) == 0) {
+        return 0;
+    }
 
-    if (header->size > size) {
-        size_t remain = header->size - size;
-        if (remain > sizeof(struct kmalloc_header) + 32) {
-            struct kmalloc_header *split = (struct kmalloc_header *)((uint8_t *)(header + 1) + size);
-            split->magic = KMALLOC_MAGIC;
-            split->size = (uint32_t)(remain - sizeof(struct kmalloc_header));
-            split->next = free_list;
-            free_list = split;
-            header->size = (uint32_t)size;
+    size_t old_size = 0;
+    if (page->prev == KHEAP_PAGE_SLAB) {
+        const struct kmem_slab *slab = (const struct kmem_slab *)page_base(ptr);
+        if (slab->magic != KMALLOC_MAGIC_SLAB || slab->cache < kmalloc_caches ||
+            slab->cache >= kmalloc_caches + KMALLOC_CLASSES) {
+            return 0;
+        }
+        old_size = slab->cache->obj_size;
+        if (size <= old_size) {
+            return ptr;
         }
+    } else if (page->prev == KHEAP_PAGE_ARENA) {
+        struct kheap_block *block = (struct kheap_block *)ptr - 1;
+        kheap_lock();
+        if (block->magic != KHEAP_BLOCK_MAGIC || block->used == 0) {
+            kheap_unlock();
+            return 0;
+        }
+        if (size <= KHEAP_ARENA_MAX_ALLOC) {
+            uint32_t need = arena_need(size);
+            struct kheap_block *next = block_next(block);
+            if (need > block->size && next->used == 0 && block->size + next->size >= need) {
+                bin_remove(next);
+                block->size += next->size;
+                next->magic = 0;
+                block_next(block)->prev_size = block->size;
+            }
+            if (need <= block->size) {
+                arena_trim(block, need);
+                kheap_unlock();
+                return ptr;
+            }
+        }
+        old_size = block->size - sizeof(struct kheap_block);
+        kheap_unlock();
+    } else if (page->prev == KHEAP_PAGE_LARGE && (page->flags & NM_PAGE_HEAD) != 0) {
+        kheap_lock();
+        old_size = (size_t)page->next * PAGE_SIZE;
+        bool resized = size > KHEAP_ARENA_MAX_ALLOC && large_resize(phys, page, size);
+        kheap_unlock();
+        if (resized) {
+            return ptr;
+        }
+    } else {
+        return 0;
     }
 
-    return (void *)(header + 1);
+    void *moved = heap_alloc(size);
+    if (moved == 0) {
+        return 0;
+    }
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+    heap_free(ptr);
+    return moved;
 }
 
-void kfree(void *ptr)
+static void heap_free(void *ptr)
 {
     if (ptr == 0) {
         return;
     }
 
-    struct kmalloc_header *header = ((struct kmalloc_header *)ptr) - 1;
-    if (header->magic != KMALLOC_MAGIC) {
+    const struct nm_page *page = pmm_phys_to_page(phys_from_ptr(ptr));
+    if (page == 0 || (page->flags & NM_PAGE_KHEAP) == 0) {
+        return;
+    }
+
+    if (page->prev == KHEAP_PAGE_SLAB) {
+        struct kmem_slab *slab = (struct kmem_slab *)page_base(ptr);
+        if (slab->magic != KMALLOC_MAGIC_SLAB || !slab_owns(slab, ptr)) {
+            return;
+        }
+        uint32_t cls = (uint32_t)(slab->cache - kmalloc_caches);
+        if (cls < KMALLOC_CLASSES) {
+            magazine_free(cls, ptr);
+        } else {
+            kheap_lock();
+            cache_free(slab, ptr);
+            kheap_unlock();
+        }
         return;
     }
 
-    header->next = free_list;
-    free_list = header;
+    kheap_lock();
+    if (page->prev == KHEAP_PAGE_ARENA) {
+        arena_free((struct kheap_block *)ptr - 1);
+    } else if (page->prev == KHEAP_PAGE_LARGE && (page->flags & NM_PAGE_HEAD) != 0 &&
+               ((uintptr_t)ptr % PAGE_SIZE) == 0) {
+        uint32_t pages = page->next;
+        large_pages -= pages;
+        pmm_free_pages(phys_from_ptr(ptr), pages);
+    }
+    kheap_unlock();
+}
+
+// The public entry points only add tracking; the return address they record is the
+// caller's, never an allocator-internal one.
+void *kmalloc(size_t size)
+{
+    void *ptr = heap_alloc(size);
+    if (ptr != 0) {
+        kheap_track_alloc(ptr, size, (uintptr_t)__builtin_return_address(0));
+    }
+    return ptr;
+}
+
+void *kmalloc_aligned(size_t size, size_t align)
+{
+    void *ptr = heap_alloc_aligned(size, align);
+    if (ptr != 0) {
+        kheap_track_alloc(ptr, size, (uintptr_t)__builtin_return_address(0));
+    }
+    return ptr;
+}
+
+void *krealloc(void *ptr, size_t size)
+{
+    void *result = heap_realloc(ptr, size);
+    if (result != ptr && (result != 0 || size == 0)) {
+        kheap_track_free(ptr);
+    }
+    if (result != 0) {
+        kheap_track_alloc(result, size, (uintptr_t)__builtin_return_address(0));
+    }
+    return result;
+}
+
+void kfree(void *ptr)
+{
+    kheap_track_free(ptr);
+    heap_free(ptr);
+}
+
+struct nm_kheap_stats kheap_get_stats(void)
+{
+    struct nm_kheap_stats stats = {0};
+    kheap_lock();
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        stats.slab_pages += kmalloc_caches[i].slabs;
+        stats.active_objects += kmalloc_caches[i].active_objs;
+    }
+    // Objects parked in magazines are free as far as callers are concerned.
+    stats.magazine_objects = magazine_objects();
+    stats.active_objects -= stats.magazine_objects;
+    stats.large_pages = large_pages;
+    stats.arena_pages = arena_count * KHEAP_ARENA_PAGES;
+    stats.arena_free_bytes = arena_free_bytes;
+    stats.arena_largest_free = arena_largest_free();
+    if (arena_free_bytes != 0) {
+        stats.fragmentation_permille = 1000U - (uint32_t)(stats.arena_largest_free * 1000U / arena_free_bytes);
+    }
+    kheap_unlock();
+    return stats;
 }
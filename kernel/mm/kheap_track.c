@@ -0,0 +1,237 @@
+#include "nm/mm.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef NM_KHEAP_TRACK
+
+#include "nm/cpu.h"
+#include "nm/klog.h"
+
+// Open-addressed table of live allocations keyed by pointer. Deletion shifts later
+// entries back instead of leaving tombstones, so lookups never degrade over time.
+#define TRACK_SLOTS 4096U
+#define TRACK_SITES 64U
+
+struct track_entry {
+    uintptr_t ptr;
+    uintptr_t callsite;
+    uint64_t tsc;
+    uint64_t size;
+};
+
+static struct track_entry track_table[TRACK_SLOTS];
+static uint32_t track_live;
+static uint64_t track_dropped;
+static volatile uint32_t track_lock_word;
+
+static inline void track_lock(void)
+{
+    while (__sync_lock_test_and_set(&track_lock_word, 1U) != 0U) {
+        __asm__ volatile("pause");
+    }
+}
+
+static inline void track_unlock(void)
+{
+    __sync_lock_release(&track_lock_word);
+}
+
+static inline uint32_t track_slot(uintptr_t ptr)
+{
+    return (uint32_t)(((uint64_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 52) & (TRACK_SLOTS - 1U);
+}
+
+void kheap_track_alloc(const void *ptr, size_t size, uintptr_t callsite)
+{
+    uintptr_t key = (uintptr_t)ptr;
+    track_lock();
+    uint32_t slot = track_slot(key);
+    for (uint32_t probes = 0; probes < TRACK_SLOTS; probes++) {
+        struct track_entry *entry = &track_table[slot];
+        if (entry->ptr == 0 || entry->ptr == key) {
+            if (entry->ptr == 0) {
+                track_live++;
+            }
+            entry->ptr = key;
+            entry->callsite = callsite;
+            entry->tsc = cpu_rdtsc();
+            entry->size = size;
+            track_unlock();
+            return;
+        }
+        slot = (slot + 1U) & (TRACK_SLOTS - 1U);
+    }
+    track_dropped++;
+    track_unlock();
+}
+
+void kheap_track_free(const void *ptr)
+{
+    uintptr_t key = (uintptr_t)ptr;
+    if (key == 0) {
+        return;
+    }
+
+    track_lock();
+    uint32_t slot = track_slot(key);
+    while (track_table[slot].ptr != 0 && track_table[slot].ptr != key) {
+        slot = (slot + 1U) & (TRACK_SLOTS - 1U);
+    }
+    if (track_table[slot].ptr == 0) {
+        track_unlock();
+        return;
+    }
+
+    // Pull every later entry of the probe run back over the hole if its home slot allows.
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1U) & (TRACK_SLOTS - 1U); track_table[next].ptr != 0;
+         next = (next + 1U) & (TRACK_SLOTS - 1U)) {
+        uint32_t home = track_slot(track_table[next].ptr);
+        if (((next - home) & (TRACK_SLOTS - 1U)) >= ((next - hole) & (TRACK_SLOTS - 1U))) {
+            track_table[hole] = track_table[next];
+            hole = next;
+        }
+    }
+    track_table[hole].ptr = 0;
+    track_live--;
+    track_unlock();
+}
+
+// Caller holds track_lock.
+static size_t collect_sites(struct nm_kheap_site *sites, size_t cap)
+{
+    size_t count = 0;
+    for (uint32_t i = 0; i < TRACK_SLOTS; i++) {
+        const struct track_entry *entry = &track_table[i];
+        if (entry->ptr == 0) {
+            continue;
+        }
+        size_t s = 0;
+        while (s < count && sites[s].callsite != entry->callsite) {
+            s++;
+        }
+        if (s == count) {
+            if (count == cap) {
+                continue;
+            }
+            sites[count++] = (struct nm_kheap_site){.callsite = entry->callsite, .oldest_tsc = UINT64_MAX};
+        }
+        sites[s].allocs++;
+        sites[s].bytes += entry->size;
+        if (entry->tsc < sites[s].oldest_tsc) {
+            sites[s].oldest_tsc = entry->tsc;
+        }
+    }
+    return count;
+}
+
+size_t kheap_track_sites(struct nm_kheap_site *out, size_t max)
+{
+    static struct nm_kheap_site sites[TRACK_SITES];
+    track_lock();
+    size_t count = collect_sites(sites, TRACK_SITES);
+
+    // Partial selection sort: only the first `max` positions need to be in order.
+    size_t n = count < max ? count : max;
+    for (size_t i = 0; i < n; i++) {
+        size_t best = i;
+        for (size_t j = i + 1U; j < count; j++) {
+            if (sites[j].bytes > sites[best].bytes) {
+                best = j;
+            }
+        }
+        struct nm_kheap_site tmp = sites[i];
+        sites[i] = sites[best];
+        sites[best] = tmp;
+        out[i] = sites[i];
+    }
+    track_unlock();
+    return n;
+}
+
+static void log_u64(uint64_t value, unsigned base)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[24];
+    size_t idx = sizeof(buf);
+    buf[--idx] = '\0';
+    do {
+        buf[--idx] = digits[value % base];
+        value /= base;
+    } while (value != 0);
+    if (base == 16U) {
+        klog_write("0x");
+    }
+    klog_write(&buf[idx]);
+}
+
+void kheap_track_dump(size_t max)
+{
+    static struct nm_kheap_site top[TRACK_SITES];
+    if (max > TRACK_SITES) {
+        max = TRACK_SITES;
+    }
+    size_t count = kheap_track_sites(top, max);
+
+    klog_write("kheap track: live=");
+    log_u64(track_live, 10U);
+    klog_write(" dropped=");
+    log_u64(track_dropped, 10U);
+    klog_write("\ntop callsites by live bytes:\n");
+    for (size_t i = 0; i < count; i++) {
+        klog_write("  ");
+        log_u64(top[i].callsite, 16U);
+        klog_write(" allocs=");
+        log_u64(top[i].allocs, 10U);
+        klog_write(" bytes=");
+        log_u64(top[i].bytes, 10U);
+        klog_write("\n");
+    }
+
+    // Leak suspects are simply the longest-lived allocations: repeated dumps that keep
+    // showing the same pointers point at memory nobody frees.
+    klog_write("leak suspects (oldest live):\n");
+    uint64_t now = cpu_rdtsc();
+    uint64_t after = 0;
+    for (size_t n = 0; n < max; n++) {
+        struct track_entry oldest = {0};
+        track_lock();
+        for (uint32_t i = 0; i < TRACK_SLOTS; i++) {
+            const struct track_entry *entry = &track_table[i];
+            if (entry->ptr != 0 && entry->tsc >= after && (oldest.ptr == 0 || entry->tsc < oldest.tsc)) {
+                oldest = *entry;
+            }
+        }
+        track_unlock();
+        if (oldest.ptr == 0) {
+            break;
+        }
+        klog_write("  ");
+        log_u64(oldest.ptr, 16U);
+        klog_write(" size=");
+        log_u64(oldest.size, 10U);
+        klog_write(" site=");
+        log_u64(oldest.callsite, 16U);
+        klog_write(" age_cycles=");
+        log_u64(now > oldest.tsc ? now - oldest.tsc : 0, 10U);
+        klog_write("\n");
+        after = oldest.tsc + 1U;
+    }
+}
+
+#else
+
+size_t kheap_track_sites(struct nm_kheap_site *out, size_t max)
+{
+    (void)out;
+    (void)max;
+    return 0;
+}
+
+void kheap_track_dump(size_t max)
+{
+    (void)max;
+}
+
+#endif
@@ -1,3 +1,7 @@
+#ifdef NEVERMIND_HOST_TEST
+#define _DEFAULT_SOURCE
+#endif
+
 #include "nm/mm.h"
 
 #include <stdbool.h>
@@ -6,177 +10,162 @@
 
 #ifdef NEVERMIND_HOST_TEST
 #include <stdlib.h>
+#include <sys/mman.h>
 #endif
 
+#include "nm/cpu.h"
 #include "nm/multiboot2.h"
 #include "nm/string.h"
 
 #define PAGE_SIZE 4096ULL
-#define KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL
 #define MAX_PHYS_MEM_BYTES (128ULL * 1024ULL * 1024ULL * 1024ULL)
 #define MAX_FRAMES (MAX_PHYS_MEM_BYTES / PAGE_SIZE)
 #define BITMAP_WORD_BITS 64ULL
+// 2^12 frames = 16 MiB, so aligned buddy blocks never straddle the 16 MiB or 4 GiB
+// zone boundaries and coalescing cannot merge frames from different zones.
+#define PMM_MAX_ORDER 12U
+#define PMM_HUGE_ORDER 9U
+#define ZONE_DMA_LIMIT_FRAMES ((16ULL * 1024ULL * 1024ULL) / PAGE_SIZE)
+#define ZONE_DMA32_LIMIT_FRAMES ((4ULL * 1024ULL * 1024ULL * 1024ULL) / PAGE_SIZE)
 
 static struct nm_mm_stats mm_stats;
 
-#ifndef NEVERMIND_HOST_TEST
 static uint64_t *frame_bitmap;
 static uint64_t frame_limit;
 static uint64_t bitmap_words;
 static uint64_t bitmap_phys_base;
 static uint64_t bitmap_bytes;
-static uint64_t alloc_word_cursor;
+static uint64_t metadata_bytes;
 static volatile uint32_t pmm_lock_word;
-#endif
 
-#ifdef NEVERMIND_HOST_TEST
-
-struct host_alloc_entry {
-    uint64_t key;
-    void *ptr;
-    size_t pages;
-    bool used;
+#define PMM_FRAME_NIL UINT32_MAX
+#define PMM_ORDER_NONE 0U
+#define PMM_ORDER_FREE 0x80U
+#define PMM_REFCOUNT_MAX UINT16_MAX
+#define PCP_BATCH 16U
+#define PCP_HIGH 64U
+#define ZERO_POOL_HIGH 128U
+
+struct pmm_free_area {
+    uint32_t head;
+    uint64_t blocks;
 };
 
-#define HOST_MAX_ALLOCS 32768
-
-static struct host_alloc_entry host_allocs[HOST_MAX_ALLOCS];
-static uint64_t host_alloc_key_seed;
-
-static uint64_t host_make_key(void)
-{
-    host_alloc_key_seed += PAGE_SIZE;
-    return host_alloc_key_seed | 1ULL;
-}
+struct pmm_zone {
+    struct pmm_free_area free_area[PMM_MAX_ORDER + 1];
+    uint32_t free_area_mask;
+    uint64_t free_frames;
+    uint64_t managed_frames;
+    uint64_t fallback_allocs;
+};
 
-void pmm_init_from_ranges(const struct nm_mem_range *ranges, size_t count)
-{
-    (void)ranges;
+// Per-CPU hot-frame magazine. Only its owning CPU touches it, with interrupts off, so
+// single-frame alloc/free skip pmm_lock unless a batch has to move to or from the buddy.
+struct pmm_pcp {
+    uint32_t count;
+    uint64_t frames[PCP_HIGH];
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t refills;
+    uint64_t drains;
+};
 
-    mm_stats.total_frames = 0;
-    mm_stats.free_frames = 0;
-    mm_stats.used_frames = 0;
-    mm_stats.reserved_frames = 0;
+// struct nm_page array. The head frame of a block on a free list carries
+// PMM_ORDER_FREE | order; every other frame carries PMM_ORDER_NONE, so an all-zero
+// descriptor is a valid initial state. Free frames, frames in a per-CPU magazine and
+// reserved frames all have refcount 0.
+static struct nm_page *page_array;
+static struct pmm_zone zones[NM_ZONE_COUNT];
+static struct pmm_pcp pcp_cache[NM_MAX_CPUS];
+
+// Frames zeroed ahead of time by the idle thread. Pushes and pops take pmm_lock; the
+// zeroing itself happens with no lock held.
+static uint64_t zero_pool[ZERO_POOL_HIGH];
+static uint32_t zero_pool_count;
+static uint64_t zero_pool_hits;
+static uint64_t zero_pool_misses;
 
-    for (size_t i = 0; i < count; i++) {
-        if (ranges[i].type == NM_MEM_AVAILABLE) {
-            mm_stats.total_frames += ranges[i].length / PAGE_SIZE;
-        }
-    }
+#ifdef NEVERMIND_HOST_TEST
+// Host builds run this allocator over one mmap'd region standing in for physical memory:
+// physical address P lives at host_arena + P. The fake kernel image occupies 1-2 MiB.
+#define HOST_KERNEL_PHYS_START 0x00100000ULL
+#define HOST_KERNEL_PHYS_END 0x00200000ULL
+#define HOST_DEFAULT_RAM_BYTES (64ULL * 1024ULL * 1024ULL)
 
-    mm_stats.reserved_frames = 256;
-    if (mm_stats.total_frames > mm_stats.reserved_frames) {
-        mm_stats.free_frames = mm_stats.total_frames - mm_stats.reserved_frames;
-    } else {
-        mm_stats.free_frames = 0;
-    }
-    mm_stats.used_frames = mm_stats.total_frames - mm_stats.free_frames;
+static uint8_t *host_arena;
+static uint64_t host_arena_bytes;
 
-    for (size_t i = 0; i < HOST_MAX_ALLOCS; i++) {
-        if (host_allocs[i].used) {
-            free(host_allocs[i].ptr);
-        }
-        host_allocs[i].used = false;
-        host_allocs[i].ptr = 0;
-        host_allocs[i].key = 0;
-        host_allocs[i].pages = 0;
-    }
-    host_alloc_key_seed = 0x1000;
-}
+_Thread_local uint32_t nm_host_cpu_id;
+#else
+extern uint8_t __kernel_phys_start[];
+extern uint8_t __kernel_phys_end[];
+#endif
 
-void pmm_init_from_multiboot2(uint64_t mb2_info_ptr)
+static inline uint64_t align_up_u64(uint64_t value, uint64_t align)
 {
-    (void)mb2_info_ptr;
-    const struct nm_mem_range default_ranges[] = {
-        {.base = 0x00100000, .length = 64ULL * 1024ULL * 1024ULL, .type = NM_MEM_AVAILABLE},
-    };
-    pmm_init_from_ranges(default_ranges, 1);
+    return (value + align - 1ULL) & ~(align - 1ULL);
 }
 
-uint64_t pmm_alloc_pages(size_t count)
+#ifdef NEVERMIND_HOST_TEST
+static inline uint64_t kernel_image_start(void)
 {
-    if (count == 0 || mm_stats.free_frames < count) {
-        return 0;
-    }
-
-    for (size_t i = 0; i < HOST_MAX_ALLOCS; i++) {
-        if (!host_allocs[i].used) {
-            void *ptr = calloc(count, PAGE_SIZE);
-            if (ptr == 0) {
-                return 0;
-            }
-
-            host_allocs[i].used = true;
-            host_allocs[i].ptr = ptr;
-            host_allocs[i].key = host_make_key();
-            host_allocs[i].pages = count;
-            mm_stats.free_frames -= count;
-            mm_stats.used_frames += count;
-            return host_allocs[i].key;
-        }
-    }
-
-    return 0;
+    return HOST_KERNEL_PHYS_START;
 }
 
-uint64_t pmm_alloc_page(void)
+static inline uint64_t kernel_image_end(void)
 {
-    return pmm_alloc_pages(1);
+    return HOST_KERNEL_PHYS_END;
 }
 
-void pmm_free_page(uint64_t phys_addr)
+// Grow the arena to cover [0, bytes). A re-init may move it, which is fine because
+// nothing allocated before pmm init survives it.
+static void host_arena_reserve(uint64_t bytes)
 {
-    if (phys_addr == 0) {
+    bytes = align_up_u64(bytes, PAGE_SIZE);
+    if (bytes <= host_arena_bytes) {
         return;
     }
-
-    for (size_t i = 0; i < HOST_MAX_ALLOCS; i++) {
-        if (host_allocs[i].used && host_allocs[i].key == phys_addr) {
-            free(host_allocs[i].ptr);
-            host_allocs[i].used = false;
-            host_allocs[i].ptr = 0;
-            host_allocs[i].key = 0;
-            mm_stats.free_frames += host_allocs[i].pages;
-            mm_stats.used_frames -= host_allocs[i].pages;
-            host_allocs[i].pages = 0;
-            return;
-        }
+    if (host_arena != 0) {
+        munmap(host_arena, (size_t)host_arena_bytes);
+    }
+    void *arena = mmap(0, (size_t)bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+        abort();
     }
+    host_arena = (uint8_t *)arena;
+    host_arena_bytes = bytes;
 }
 
-struct nm_mm_stats pmm_get_stats(void)
+static inline void *frame_ptr(uint64_t phys)
 {
-    return mm_stats;
+    return host_arena + phys;
 }
-
-void *pmm_host_ptr_from_key(uint64_t key)
+#else
+static inline uint64_t kernel_symbol_to_phys(const void *sym)
 {
-    for (size_t i = 0; i < HOST_MAX_ALLOCS; i++) {
-        if (host_allocs[i].used && host_allocs[i].key == key) {
-            return host_allocs[i].ptr;
-        }
+    uint64_t addr = (uint64_t)(uintptr_t)sym;
+    if (addr >= NM_KERNEL_VIRT_BASE) {
+        return addr - NM_KERNEL_VIRT_BASE;
     }
-    return 0;
+    return addr;
 }
 
-#else
-
-extern uint8_t __kernel_phys_start[];
-extern uint8_t __kernel_phys_end[];
+static inline uint64_t kernel_image_start(void)
+{
+    return kernel_symbol_to_phys(__kernel_phys_start);
+}
 
-static inline uint64_t align_up_u64(uint64_t value, uint64_t align)
+static inline uint64_t kernel_image_end(void)
 {
-    return (value + align - 1ULL) & ~(align - 1ULL);
+    return kernel_symbol_to_phys(__kernel_phys_end);
 }
 
-static inline uint64_t kernel_symbol_to_phys(const void *sym)
+static inline void *frame_ptr(uint64_t phys)
 {
-    uint64_t addr = (uint64_t)(uintptr_t)sym;
-    if (addr >= KERNEL_VIRT_BASE) {
-        return addr - KERNEL_VIRT_BASE;
-    }
-    return addr;
+    return nm_phys_to_virt(phys);
 }
+#endif
 
 static void init_runtime_bitmap(uint64_t frames, uint64_t min_phys_base)
 {
@@ -191,13 +180,28 @@ static void init_runtime_bitmap(uint64_t frames, uint64_t min_phys_base)
     bitmap_words = (frame_limit + BITMAP_WORD_BITS - 1ULL) / BITMAP_WORD_BITS;
     bitmap_bytes = bitmap_words * sizeof(uint64_t);
 
-    uint64_t kernel_end_phys = kernel_symbol_to_phys(__kernel_phys_end);
+    uint64_t kernel_end_phys = kernel_image_end();
     if (min_phys_base < kernel_end_phys) {
         min_phys_base = kernel_end_phys;
     }
 
     bitmap_phys_base = align_up_u64(min_phys_base, PAGE_SIZE);
-    frame_bitmap = (uint64_t *)(uintptr_t)bitmap_phys_base;
+
+    // The page array lives right behind the bitmap so both are covered by one reservation.
+    uint64_t meta_phys_base = align_up_u64(bitmap_phys_base + bitmap_bytes, sizeof(uint64_t));
+    metadata_bytes = (meta_phys_base - bitmap_phys_base) +
+                     frame_limit * sizeof(struct nm_page);
+
+#ifdef NEVERMIND_HOST_TEST
+    uint64_t arena_end = bitmap_phys_base + metadata_bytes;
+    if (arena_end < frame_limit * PAGE_SIZE) {
+        arena_end = frame_limit * PAGE_SIZE;
+    }
+    host_arena_reserve(arena_end);
+#endif
+
+    frame_bitmap = (uint64_t *)frame_ptr(bitmap_phys_base);
+    page_array = (struct nm_page *)frame_ptr(meta_phys_base);
 }
 
 static inline bool frame_valid(uint64_t frame)
@@ -233,14 +237,6 @@ static inline void clear_frame(uint64_t frame)
     frame_bitmap[frame / BITMAP_WORD_BITS] &= ~(1ULL << (frame % BITMAP_WORD_BITS));
 }
 
-static inline bool test_frame(uint64_t frame)
-{
-    if (!frame_valid(frame)) {
-        return true;
-    }
-    return (frame_bitmap[frame / BITMAP_WORD_BITS] & (1ULL << (frame % BITMAP_WORD_BITS))) != 0;
-}
-
 static void mark_all_used(void)
 {
     memset(frame_bitmap, 0xFF, bitmap_bytes);
@@ -248,77 +244,344 @@ static void mark_all_used(void)
     mm_stats.free_frames = 0;
     mm_stats.used_frames = frame_limit;
     mm_stats.reserved_frames = 0;
-    alloc_word_cursor = 0;
 }
 
-static uint64_t alloc_single_page_unlocked(void)
+static inline uint32_t floor_log2_u64(uint64_t value)
 {
-    uint64_t start = alloc_word_cursor;
-    for (uint64_t pass = 0; pass < bitmap_words; pass++) {
-        uint64_t word_idx = (start + pass) % bitmap_words;
-        uint64_t word = frame_bitmap[word_idx];
-        if (word == UINT64_MAX) {
-            continue;
+    return 63U - (uint32_t)__builtin_clzll(value);
+}
+
+static inline uint32_t order_for_count(uint64_t count)
+{
+    uint32_t order = floor_log2_u64(count);
+    if ((1ULL << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+// Largest block order that starts at `frame` and fits in `count` frames.
+static inline uint32_t max_block_order(uint64_t frame, uint64_t count)
+{
+    uint32_t order = floor_log2_u64(count);
+    if (frame != 0) {
+        uint32_t align = (uint32_t)__builtin_ctzll(frame);
+        if (align < order) {
+            order = align;
         }
+    }
+    if (order > PMM_MAX_ORDER) {
+        order = PMM_MAX_ORDER;
+    }
+    return order;
+}
 
-        uint64_t free_mask = ~word;
-        if (free_mask == 0) {
-            continue;
+static inline uint32_t zone_of(uint64_t frame)
+{
+    if (frame < ZONE_DMA_LIMIT_FRAMES) {
+        return NM_ZONE_DMA;
+    }
+    if (frame < ZONE_DMA32_LIMIT_FRAMES) {
+        return NM_ZONE_DMA32;
+    }
+    return NM_ZONE_NORMAL;
+}
+
+static void free_area_push(uint64_t frame, uint32_t order)
+{
+    struct pmm_zone *zone = &zones[zone_of(frame)];
+    struct pmm_free_area *area = &zone->free_area[order];
+    struct nm_page *meta = &page_array[frame];
+    uint32_t head = area->head;
+
+    meta->order = (uint8_t)(PMM_ORDER_FREE | order);
+    meta->prev = PMM_FRAME_NIL;
+    meta->next = head;
+    if (head != PMM_FRAME_NIL) {
+        page_array[head].prev = (uint32_t)frame;
+    }
+    area->head = (uint32_t)frame;
+    area->blocks++;
+    zone->free_area_mask |= 1U << order;
+    zone->free_frames += 1ULL << order;
+}
+
+static void free_area_remove(uint64_t frame)
+{
+    struct pmm_zone *zone = &zones[zone_of(frame)];
+    struct nm_page *meta = &page_array[frame];
+    uint32_t order = meta->order & ~PMM_ORDER_FREE;
+    struct pmm_free_area *area = &zone->free_area[order];
+
+    if (meta->prev != PMM_FRAME_NIL) {
+        page_array[meta->prev].next = meta->next;
+    } else {
+        area->head = meta->next;
+        if (meta->next == PMM_FRAME_NIL) {
+            zone->free_area_mask &= ~(1U << order);
         }
+    }
+    if (meta->next != PMM_FRAME_NIL) {
+        page_array[meta->next].prev = meta->prev;
+    }
+    meta->order = PMM_ORDER_NONE;
+    meta->next = PMM_FRAME_NIL;
+    meta->prev = PMM_FRAME_NIL;
+    area->blocks--;
+    zone->free_frames -= 1ULL << order;
+}
 
-        uint64_t bit = (uint64_t)__builtin_ctzll(free_mask);
-        uint64_t frame = word_idx * BITMAP_WORD_BITS + bit;
-        if (!frame_valid(frame)) {
-            continue;
+static uint64_t buddy_alloc_block(uint32_t zone_idx, uint32_t order)
+{
+    const struct pmm_zone *zone = &zones[zone_idx];
+    uint32_t candidates = zone->free_area_mask & ~((1U << order) - 1U);
+    if (candidates == 0) {
+        return PMM_FRAME_NIL;
+    }
+
+    uint32_t cur = (uint32_t)__builtin_ctz(candidates);
+    uint64_t frame = zone->free_area[cur].head;
+    free_area_remove(frame);
+    while (cur > order) {
+        cur--;
+        free_area_push(frame + (1ULL << cur), cur);
+    }
+    return frame;
+}
+
+static void buddy_free_block(uint64_t frame, uint32_t order)
+{
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = frame ^ (1ULL << order);
+        if (!frame_valid(buddy) || page_array[buddy].order != (PMM_ORDER_FREE | order)) {
+            break;
         }
+        free_area_remove(buddy);
+        frame &= ~(1ULL << order);
+        order++;
+    }
+    free_area_push(frame, order);
+}
 
-        set_frame(frame);
-        mm_stats.free_frames--;
-        mm_stats.used_frames++;
-        alloc_word_cursor = word_idx;
-        return frame * PAGE_SIZE;
+static void buddy_free_range(uint64_t frame, uint64_t count)
+{
+    while (count > 0) {
+        uint32_t order = max_block_order(frame, count);
+        buddy_free_block(frame, order);
+        frame += 1ULL << order;
+        count -= 1ULL << order;
     }
-    return 0;
 }
 
-static void mark_range_available(uint64_t base, uint64_t length)
+static uint64_t next_frame_with_state(uint64_t frame, bool used)
 {
-    uint64_t start = (base + PAGE_SIZE - 1ULL) / PAGE_SIZE;
-    uint64_t end = (base + length) / PAGE_SIZE;
-    if (end > frame_limit) {
-        end = frame_limit;
+    while (frame < frame_limit) {
+        uint64_t word_idx = frame / BITMAP_WORD_BITS;
+        uint64_t word = used ? frame_bitmap[word_idx] : ~frame_bitmap[word_idx];
+        word &= UINT64_MAX << (frame % BITMAP_WORD_BITS);
+        if (word != 0) {
+            frame = word_idx * BITMAP_WORD_BITS + (uint64_t)__builtin_ctzll(word);
+            return frame < frame_limit ? frame : frame_limit;
+        }
+        frame = (word_idx + 1ULL) * BITMAP_WORD_BITS;
     }
+    return frame_limit;
+}
 
-    for (uint64_t frame = start; frame < end; frame++) {
-        if (test_frame(frame)) {
-            clear_frame(frame);
-            mm_stats.free_frames++;
-            mm_stats.used_frames--;
+// The bitmap is the source of truth while the memory map is parsed; once every
+// reservation is applied, its free runs are carved into maximal buddy blocks.
+static void buddy_seed_from_bitmap(void)
+{
+    memset(page_array, 0, (size_t)(frame_limit * sizeof(struct nm_page)));
+    memset(zones, 0, sizeof(zones));
+    for (uint32_t zone = 0; zone < NM_ZONE_COUNT; zone++) {
+        for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            zones[zone].free_area[order].head = PMM_FRAME_NIL;
+        }
+    }
+    memset(pcp_cache, 0, sizeof(pcp_cache));
+    zero_pool_count = 0;
+    zero_pool_hits = 0;
+    zero_pool_misses = 0;
+
+    uint64_t frame = next_frame_with_state(0, false);
+    while (frame < frame_limit) {
+        uint64_t run_end = next_frame_with_state(frame, true);
+        uint64_t count = run_end - frame;
+        while (count > 0) {
+            uint32_t order = max_block_order(frame, count);
+            free_area_push(frame, order);
+            frame += 1ULL << order;
+            count -= 1ULL << order;
         }
+        frame = next_frame_with_state(run_end, false);
+    }
+
+    for (uint32_t zone = 0; zone < NM_ZONE_COUNT; zone++) {
+        zones[zone].managed_frames = zones[zone].free_frames;
     }
 }
 
-static void reserve_range(uint64_t base, uint64_t length)
+static inline uint64_t popcount_u64(uint64_t value)
+{
+    value = value - ((value >> 1) & 0x5555555555555555ULL);
+    value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+    value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (value * 0x0101010101010101ULL) >> 56;
+}
+
+static uint64_t fill_word(uint64_t word_idx, uint64_t mask, bool used)
+{
+    uint64_t old = frame_bitmap[word_idx];
+    uint64_t word = used ? (old | mask) : (old & ~mask);
+    if (word == old) {
+        return 0;
+    }
+    frame_bitmap[word_idx] = word;
+    return popcount_u64(old ^ word);
+}
+
+// Set or clear frames [start, end) a word at a time; returns how many frames changed state.
+static uint64_t bitmap_fill(uint64_t start, uint64_t end, bool used)
 {
-    uint64_t start = base / PAGE_SIZE;
-    uint64_t end = (base + length + PAGE_SIZE - 1ULL) / PAGE_SIZE;
     if (end > frame_limit) {
         end = frame_limit;
     }
+    if (start >= end) {
+        return 0;
+    }
+
+    uint64_t flipped = 0;
+    uint64_t word_idx = start / BITMAP_WORD_BITS;
+    uint64_t end_word = end / BITMAP_WORD_BITS;
+
+    if ((start % BITMAP_WORD_BITS) != 0) {
+        uint64_t mask = UINT64_MAX << (start % BITMAP_WORD_BITS);
+        if (word_idx == end_word) {
+            mask &= (1ULL << (end % BITMAP_WORD_BITS)) - 1ULL;
+            return fill_word(word_idx, mask, used);
+        }
+        flipped += fill_word(word_idx, mask, used);
+        word_idx++;
+    }
 
-    for (uint64_t frame = start; frame < end; frame++) {
-        if (!test_frame(frame)) {
-            set_frame(frame);
-            mm_stats.free_frames--;
-            mm_stats.used_frames++;
-            mm_stats.reserved_frames++;
+    if (word_idx < end_word) {
+        uint64_t target = used ? UINT64_MAX : 0;
+        for (uint64_t i = word_idx; i < end_word; i++) {
+            flipped += popcount_u64(frame_bitmap[i] ^ target);
         }
+        memset(&frame_bitmap[word_idx], used ? 0xFF : 0,
+               (size_t)((end_word - word_idx) * sizeof(uint64_t)));
     }
+
+    if ((end % BITMAP_WORD_BITS) != 0) {
+        flipped += fill_word(end_word, (1ULL << (end % BITMAP_WORD_BITS)) - 1ULL, used);
+    }
+    return flipped;
 }
 
-void pmm_init_from_ranges(const struct nm_mem_range *ranges, size_t count)
+static inline void set_frame_range(uint64_t frame, uint64_t count)
+{
+    (void)bitmap_fill(frame, frame + count, true);
+}
+
+static inline void clear_frame_range(uint64_t frame, uint64_t count)
+{
+    (void)bitmap_fill(frame, frame + count, false);
+}
+
+static bool frame_range_used(uint64_t frame, uint64_t count)
+{
+    uint64_t end = frame + count;
+    while (frame < end) {
+        uint64_t word_idx = frame / BITMAP_WORD_BITS;
+        uint64_t bit = frame % BITMAP_WORD_BITS;
+        uint64_t span = BITMAP_WORD_BITS - bit;
+        if (span > end - frame) {
+            span = end - frame;
+        }
+        uint64_t mask = (span == BITMAP_WORD_BITS) ? UINT64_MAX : (((1ULL << span) - 1ULL) << bit);
+        if ((frame_bitmap[word_idx] & mask) != mask) {
+            return false;
+        }
+        frame += span;
+    }
+    return true;
+}
+
+static bool frame_range_free(uint64_t frame, uint64_t count)
+{
+    uint64_t end = frame + count;
+    while (frame < end) {
+        uint64_t word_idx = frame / BITMAP_WORD_BITS;
+        uint64_t bit = frame % BITMAP_WORD_BITS;
+        uint64_t span = BITMAP_WORD_BITS - bit;
+        if (span > end - frame) {
+            span = end - frame;
+        }
+        uint64_t mask = (span == BITMAP_WORD_BITS) ? UINT64_MAX : (((1ULL << span) - 1ULL) << bit);
+        if ((frame_bitmap[word_idx] & mask) != 0) {
+            return false;
+        }
+        frame += span;
+    }
+    return true;
+}
+
+static void mark_range_available(uint64_t base, uint64_t length)
+{
+    uint64_t start = (base + PAGE_SIZE - 1ULL) / PAGE_SIZE;
+    uint64_t end = (base + length) / PAGE_SIZE;
+
+    uint64_t freed = bitmap_fill(start, end, false);
+    mm_stats.free_frames += freed;
+    mm_stats.used_frames -= freed;
+}
+
+static void reserve_range(uint64_t base, uint64_t length)
+{
+    uint64_t start = base / PAGE_SIZE;
+    uint64_t end = (base + length + PAGE_SIZE - 1ULL) / PAGE_SIZE;
+
+    uint64_t taken = bitmap_fill(start, end, true);
+    mm_stats.free_frames -= taken;
+    mm_stats.used_frames += taken;
+    mm_stats.reserved_frames += taken;
+}
+
+static void reserve_boot_regions(void)
+{
+    reserve_range(0, 0x100000);
+
+    // Do not allocate pages that overlap the kernel image, boot stack, or boot page tables.
+    reserve_range(kernel_image_start(), kernel_image_end() - kernel_image_start());
+
+    // Keep PMM bitmap and buddy metadata pages reserved.
+    reserve_range(bitmap_phys_base, metadata_bytes);
+}
+
+static void init_from_ranges(const struct nm_mem_range *ranges, size_t count);
+
+// Without a memory map nothing is allocatable; size the tables to the kernel image only
+// so the per-frame metadata does not spill over memory we know nothing about. Host
+// builds own their fake RAM, so they fall back to a default-sized arena instead.
+static void init_without_memory_map(void)
+{
+#ifdef NEVERMIND_HOST_TEST
+    const struct nm_mem_range default_ranges[] = {
+        {.base = 0x00100000, .length = HOST_DEFAULT_RAM_BYTES, .type = NM_MEM_AVAILABLE},
+    };
+    init_from_ranges(default_ranges, 1);
+#else
+    init_runtime_bitmap(kernel_image_end() / PAGE_SIZE, kernel_image_end());
+    mark_all_used();
+    reserve_boot_regions();
+    buddy_seed_from_bitmap();
+#endif
+}
+
+static void init_from_ranges(const struct nm_mem_range *ranges, size_t count)
 {
-    pmm_lock_word = 0;
     uint64_t highest_end = 0;
     for (size_t i = 0; i < count; i++) {
         if (ranges[i].type != NM_MEM_AVAILABLE) {
@@ -331,7 +594,7 @@ void pmm_init_from_ranges(const struct nm_mem_range *ranges, size_t count)
     }
 
     uint64_t detected_frames = highest_end / PAGE_SIZE;
-    init_runtime_bitmap(detected_frames, kernel_symbol_to_phys(__kernel_phys_end));
+    init_runtime_bitmap(detected_frames, kernel_image_end());
 
     mark_all_used();
 
@@ -341,36 +604,22 @@ void pmm_init_from_ranges(const struct nm_mem_range *ranges, size_t count)
         }
     }
 
-    reserve_range(0, 0x100000);
-    reserve_range(kernel_symbol_to_phys(__kernel_phys_start),
-                  kernel_symbol_to_phys(__kernel_phys_end) - kernel_symbol_to_phys(__kernel_phys_start));
-    reserve_range(bitmap_phys_base, bitmap_bytes);
+    reserve_boot_regions();
+    buddy_seed_from_bitmap();
 }
 
-void pmm_init_from_multiboot2(uint64_t mb2_info_ptr)
+static void init_from_multiboot2(uint64_t mb2_info_ptr)
 {
-    pmm_lock_word = 0;
     if (mb2_info_ptr == 0) {
-        init_runtime_bitmap(MAX_FRAMES, kernel_symbol_to_phys(__kernel_phys_end));
-        mark_all_used();
-        reserve_range(0, 0x100000);
-        reserve_range(kernel_symbol_to_phys(__kernel_phys_start),
-                      kernel_symbol_to_phys(__kernel_phys_end) - kernel_symbol_to_phys(__kernel_phys_start));
-        reserve_range(bitmap_phys_base, bitmap_bytes);
+        init_without_memory_map();
         return;
     }
 
     const struct mb2_info_header *hdr = (const struct mb2_info_header *)(uintptr_t)mb2_info_ptr;
     if (hdr->total_size < sizeof(struct mb2_info_header)) {
-        init_runtime_bitmap(MAX_FRAMES, kernel_symbol_to_phys(__kernel_phys_end));
-        mark_all_used();
-        reserve_range(0, 0x100000);
-        reserve_range(kernel_symbol_to_phys(__kernel_phys_start),
-                      kernel_symbol_to_phys(__kernel_phys_end) - kernel_symbol_to_phys(__kernel_phys_start));
-        reserve_range(bitmap_phys_base, bitmap_bytes);
+        init_without_memory_map();
         return;
     }
-
     const uint8_t *cursor;
     const uint8_t *end = (const uint8_t *)(uintptr_t)(mb2_info_ptr + hdr->total_size);
     uint64_t highest_end = 0;
@@ -475,102 +724,623 @@ void pmm_init_from_multiboot2(uint64_t mb2_info_ptr)
         cursor = next;
     }
 
-    reserve_range(0, 0x100000);
-
-    // Do not allocate pages that overlap the kernel image, boot stack, or boot page tables.
-    reserve_range(kernel_symbol_to_phys(__kernel_phys_start),
-                  kernel_symbol_to_phys(__kernel_phys_end) - kernel_symbol_to_phys(__kernel_phys_start));
-
-    // Keep PMM bitmap pages reserved.
-    reserve_range(bitmap_phys_base, bitmap_bytes);
+    reserve_boot_regions();
 
     // Keep the multiboot2 info structure intact after parsing.
     reserve_range(mb2_info_ptr, hdr->total_size);
+
+    buddy_seed_from_bitmap();
 }
 
-uint64_t pmm_alloc_pages(size_t count)
+void pmm_init_from_ranges(const struct nm_mem_range *ranges, size_t count)
 {
-    if (count == 0 || count > frame_limit) {
-        return 0;
-    }
+    pmm_lock_word = 0;
+    uint64_t start_tsc = cpu_rdtsc();
+    init_from_ranges(ranges, count);
+    mm_stats.init_cycles = cpu_rdtsc() - start_tsc;
+}
 
+void pmm_init_from_multiboot2(uint64_t mb2_info_ptr)
+{
+    pmm_lock_word = 0;
+    uint64_t start_tsc = cpu_rdtsc();
+    init_from_multiboot2(mb2_info_ptr);
+    mm_stats.init_cycles = cpu_rdtsc() - start_tsc;
+}
+
+// Try the allowed zones from the highest down so general allocations leave DMA-capable
+// memory alone for as long as they can.
+static uint64_t buddy_alloc_pages(size_t count, uint32_t order, uint32_t zone_mask)
+{
     pmm_lock();
     if (mm_stats.free_frames < count) {
         pmm_unlock();
         return 0;
     }
 
-    if (count == 1) {
-        uint64_t one = alloc_single_page_unlocked();
+    uint64_t frame = PMM_FRAME_NIL;
+    bool preferred = true;
+    for (uint32_t zone = NM_ZONE_COUNT; zone-- > 0;) {
+        if ((zone_mask & (1U << zone)) == 0) {
+            continue;
+        }
+        frame = buddy_alloc_block(zone, order);
+        if (frame != PMM_FRAME_NIL) {
+            if (!preferred) {
+                zones[zone].fallback_allocs++;
+            }
+            break;
+        }
+        if (zones[zone].managed_frames != 0) {
+            preferred = false;
+        }
+    }
+    if (frame == PMM_FRAME_NIL) {
         pmm_unlock();
-        return one;
+        return 0;
     }
 
-    uint64_t start_frame = (alloc_word_cursor * BITMAP_WORD_BITS) % frame_limit;
-    for (uint64_t pass = 0; pass < frame_limit; pass++) {
-        uint64_t frame = (start_frame + pass) % frame_limit;
-        if (frame + count > frame_limit) {
-            continue;
-        }
+    // Hand the unused tail of a rounded-up block straight back to the free lists.
+    uint64_t block_frames = 1ULL << order;
+    if (block_frames > count) {
+        buddy_free_range(frame + count, block_frames - count);
+    }
 
-        bool ok = true;
-        for (size_t i = 0; i < count; i++) {
-            if (test_frame(frame + i)) {
-                ok = false;
+    set_frame_range(frame, count);
+    for (uint64_t i = 0; i < count; i++) {
+        page_array[frame + i].refcount = 1;
+        page_array[frame + i].flags = 0;
+    }
+    mm_stats.free_frames -= count;
+    mm_stats.used_frames += count;
+    pmm_unlock();
+    return frame * PAGE_SIZE;
+}
+
+static void pcp_refill(struct pmm_pcp *pcp)
+{
+    pmm_lock();
+    uint32_t zone = NM_ZONE_NORMAL;
+    while (pcp->count < PCP_BATCH) {
+        uint64_t frame = buddy_alloc_block(zone, 0);
+        if (frame == PMM_FRAME_NIL) {
+            if (zone == NM_ZONE_DMA) {
                 break;
             }
-        }
-        if (!ok) {
+            zone--;
             continue;
         }
+        set_frame(frame);
+        pcp->frames[pcp->count++] = frame;
+        mm_stats.free_frames--;
+        mm_stats.used_frames++;
+    }
+    pmm_unlock();
+    pcp->refills++;
+}
+
+// Return the coldest `count` frames (bottom of the stack) to the buddy free lists.
+static void pcp_drain(struct pmm_pcp *pcp, uint32_t count)
+{
+    if (count > pcp->count) {
+        count = pcp->count;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    pmm_lock();
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t frame = pcp->frames[i];
+        clear_frame(frame);
+        buddy_free_block(frame, 0);
+    }
+    mm_stats.free_frames += count;
+    mm_stats.used_frames -= count;
+    pmm_unlock();
+
+    for (uint32_t i = count; i < pcp->count; i++) {
+        pcp->frames[i - count] = pcp->frames[i];
+    }
+    pcp->count -= count;
+    pcp->drains++;
+}
 
-        for (size_t i = 0; i < count; i++) {
-            set_frame(frame + i);
+uint64_t pmm_alloc_page(void)
+{
+    uint64_t irq_flags = cpu_irq_save();
+    struct pmm_pcp *pcp = &pcp_cache[cpu_current_id()];
+
+    if (pcp->count > 0) {
+        pcp->alloc_hits++;
+    } else {
+        pcp->alloc_misses++;
+        pcp_refill(pcp);
+    }
+
+    uint64_t phys = 0;
+    if (pcp->count > 0) {
+        uint64_t frame = pcp->frames[--pcp->count];
+        page_array[frame].refcount = 1;
+        page_array[frame].flags = 0;
+        phys = frame * PAGE_SIZE;
+    }
+    cpu_irq_restore(irq_flags);
+
+    // Out of buddy memory: pre-zeroed frames are still perfectly good frames.
+    if (phys == 0) {
+        pmm_lock();
+        if (zero_pool_count > 0) {
+            phys = zero_pool[--zero_pool_count];
         }
-        mm_stats.free_frames -= count;
-        mm_stats.used_frames += count;
-        alloc_word_cursor = (frame + count) / BITMAP_WORD_BITS;
-        uint64_t phys = frame * PAGE_SIZE;
         pmm_unlock();
-        return phys;
     }
+    return phys;
+}
+
+uint64_t pmm_alloc_pages_zone(size_t count, uint32_t zone_mask, uint64_t align)
+{
+    zone_mask &= NM_ZONE_MASK_ANY;
+    if (count == 0 || count > frame_limit || zone_mask == 0) {
+        return 0;
+    }
+    if (align != 0 && (align & (align - 1ULL)) != 0) {
+        return 0;
+    }
+
+    uint32_t align_order = 0;
+    if (align > PAGE_SIZE) {
+        align_order = floor_log2_u64(align / PAGE_SIZE);
+    }
+    if (count == 1 && align_order == 0 && zone_mask == NM_ZONE_MASK_ANY) {
+        return pmm_alloc_page();
+    }
+
+    uint32_t order = order_for_count(count);
+    if (order < align_order) {
+        order = align_order;
+    }
+    if (order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    uint64_t phys = buddy_alloc_pages(count, order, zone_mask);
+    if (phys == 0) {
+        // Frames parked in this CPU's magazine may be what keeps a larger block split.
+        uint64_t irq_flags = cpu_irq_save();
+        struct pmm_pcp *pcp = &pcp_cache[cpu_current_id()];
+        pcp_drain(pcp, pcp->count);
+        cpu_irq_restore(irq_flags);
+        phys = buddy_alloc_pages(count, order, zone_mask);
+    }
+    return phys;
+}
+
+uint64_t pmm_alloc_pages(size_t count)
+{
+    return pmm_alloc_pages_zone(count, NM_ZONE_MASK_ANY, 0);
+}
 
+// Pull [frame, end) out of whichever free buddy blocks cover it, handing the parts of those
+// blocks outside the range back to the free lists. Caller holds pmm_lock and has checked
+// that every frame in the range is free.
+static void buddy_claim_range(uint64_t frame, uint64_t end)
+{
+    uint64_t start = frame;
+    while (frame < end) {
+        uint32_t order = 0;
+        uint64_t head = frame;
+        while (page_array[head].order != (PMM_ORDER_FREE | order)) {
+            order++;
+            head = frame & ~((1ULL << order) - 1ULL);
+        }
+        free_area_remove(head);
+
+        uint64_t block_end = head + (1ULL << order);
+        if (head < start) {
+            buddy_free_range(head, start - head);
+        }
+        if (block_end > end) {
+            buddy_free_range(end, block_end - end);
+            block_end = end;
+        }
+        frame = block_end;
+    }
+}
+
+bool pmm_grow_pages(uint64_t phys_addr, size_t count, size_t new_count)
+{
+    if (phys_addr == 0 || (phys_addr % PAGE_SIZE) != 0 || count == 0) {
+        return false;
+    }
+    if (new_count <= count) {
+        return true;
+    }
+
+    uint64_t frame = phys_addr / PAGE_SIZE + count;
+    uint64_t extra = new_count - count;
+    if (!frame_valid(frame) || extra > frame_limit - frame) {
+        return false;
+    }
+
+    pmm_lock();
+    if (!frame_range_free(frame, extra)) {
+        pmm_unlock();
+        return false;
+    }
+    buddy_claim_range(frame, frame + extra);
+    set_frame_range(frame, extra);
+    for (uint64_t i = 0; i < extra; i++) {
+        page_array[frame + i].refcount = 1;
+        page_array[frame + i].flags = 0;
+    }
+    mm_stats.free_frames -= extra;
+    mm_stats.used_frames += extra;
     pmm_unlock();
-    return 0;
+    return true;
 }
 
-uint64_t pmm_alloc_page(void)
+// Order-9 buddy blocks are exactly the 2 MiB-aligned regions a PD entry can map.
+uint64_t pmm_alloc_huge(void)
 {
-    return pmm_alloc_pages(1);
+    return pmm_alloc_pages_zone(NM_HUGE_PAGE_FRAMES, NM_ZONE_MASK_ANY, NM_HUGE_PAGE_SIZE);
 }
 
-void pmm_free_page(uint64_t phys_addr)
+void pmm_free_huge(uint64_t phys_addr)
 {
-    if (phys_addr == 0 || (phys_addr % PAGE_SIZE) != 0) {
+    if ((phys_addr % NM_HUGE_PAGE_SIZE) != 0) {
+        return;
+    }
+    pmm_free_pages(phys_addr, NM_HUGE_PAGE_FRAMES);
+}
+
+// Drop one reference; true when it was the last one and the frame must go back. Frames
+// that are already free (refcount 0) are left alone, which also absorbs double frees.
+static bool page_release(struct nm_page *page)
+{
+    uint16_t refs = __atomic_load_n(&page->refcount, __ATOMIC_RELAXED);
+    // A sole owner cannot race anyone else for the frame, so skip the locked cmpxchg.
+    if (refs == 1U) {
+        __atomic_store_n(&page->refcount, 0, __ATOMIC_RELEASE);
+        return true;
+    }
+    while (refs != 0) {
+        if (__atomic_compare_exchange_n(&page->refcount, &refs, (uint16_t)(refs - 1U), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return refs == 1U;
+        }
+    }
+    return false;
+}
+
+void pmm_free_pages(uint64_t phys_addr, size_t count)
+{
+    if (phys_addr == 0 || (phys_addr % PAGE_SIZE) != 0 || count == 0) {
+        return;
+    }
+    if (count == 1) {
+        pmm_free_page(phys_addr);
+        return;
+    }
+
+    uint64_t frame = phys_addr / PAGE_SIZE;
+    if (!frame_valid(frame) || count > frame_limit - frame) {
         return;
     }
 
     pmm_lock();
+    if (!frame_range_used(frame, count)) {
+        pmm_unlock();
+        return;
+    }
+
+    // Each frame carries its own count, so a shared frame inside the run stays allocated
+    // while the runs around it go back to the buddy.
+    uint64_t end = frame + count;
+    uint64_t run = frame;
+    for (uint64_t cur = frame; cur <= end; cur++) {
+        if (cur < end && page_release(&page_array[cur])) {
+            continue;
+        }
+        if (cur > run) {
+            clear_frame_range(run, cur - run);
+            buddy_free_range(run, cur - run);
+            mm_stats.free_frames += cur - run;
+            mm_stats.used_frames -= cur - run;
+        }
+        run = cur + 1;
+    }
+    pmm_unlock();
+}
+
+void pmm_free_page(uint64_t phys_addr)
+{
+    if (phys_addr == 0 || (phys_addr % PAGE_SIZE) != 0) {
+        return;
+    }
 
     uint64_t frame = phys_addr / PAGE_SIZE;
-    if (!frame_valid(frame) || !test_frame(frame)) {
+    if (!frame_valid(frame) || !page_release(&page_array[frame])) {
+        return;
+    }
+
+    uint64_t irq_flags = cpu_irq_save();
+    struct pmm_pcp *pcp = &pcp_cache[cpu_current_id()];
+    if (pcp->count == PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+    }
+    pcp->frames[pcp->count++] = frame;
+    cpu_irq_restore(irq_flags);
+}
+
+// Carve `count` single frames out of whole buddy blocks under one lock hold, marking each
+// block in the bitmap a word at a time. All or nothing: the free-frame check up front
+// guarantees the zone walk cannot come up short.
+static size_t buddy_alloc_batch(uint64_t *frames, size_t count)
+{
+    pmm_lock();
+    if (mm_stats.free_frames < count) {
         pmm_unlock();
+        return 0;
+    }
+
+    size_t filled = 0;
+    for (uint32_t zone = NM_ZONE_COUNT; zone-- > 0 && filled < count;) {
+        while (filled < count) {
+            uint32_t order = floor_log2_u64(count - filled);
+            if (order > PMM_MAX_ORDER) {
+                order = PMM_MAX_ORDER;
+            }
+            while (order > 0 && (zones[zone].free_area_mask >> order) == 0) {
+                order--;
+            }
+
+            uint64_t frame = buddy_alloc_block(zone, order);
+            if (frame == PMM_FRAME_NIL) {
+                break;
+            }
+            set_frame_range(frame, 1ULL << order);
+            for (uint64_t i = 0; i < (1ULL << order); i++) {
+                page_array[frame + i].refcount = 1;
+                page_array[frame + i].flags = 0;
+                frames[filled++] = (frame + i) * PAGE_SIZE;
+            }
+        }
+    }
+    mm_stats.free_frames -= filled;
+    mm_stats.used_frames += filled;
+    pmm_unlock();
+    return filled;
+}
+
+size_t pmm_alloc_batch(uint64_t *frames, size_t count)
+{
+    if (frames == 0 || count == 0) {
+        return 0;
+    }
+
+    size_t filled = buddy_alloc_batch(frames, count);
+    if (filled == 0) {
+        uint64_t irq_flags = cpu_irq_save();
+        struct pmm_pcp *pcp = &pcp_cache[cpu_current_id()];
+        pcp_drain(pcp, pcp->count);
+        cpu_irq_restore(irq_flags);
+        filled = buddy_alloc_batch(frames, count);
+    }
+    return filled;
+}
+
+// Frees go straight to the buddy rather than through the magazine. Bitmap bits of
+// neighbouring frames are collected into one mask per word before they are cleared.
+void pmm_free_batch(const uint64_t *frames, size_t count)
+{
+    if (frames == 0 || count == 0) {
         return;
     }
 
-    clear_frame(frame);
-    mm_stats.free_frames++;
-    mm_stats.used_frames--;
-    alloc_word_cursor = frame / BITMAP_WORD_BITS;
+    uint64_t word_idx = UINT64_MAX;
+    uint64_t mask = 0;
+    uint64_t freed = 0;
+
+    pmm_lock();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t phys = frames[i];
+        uint64_t frame = phys / PAGE_SIZE;
+        if (phys == 0 || (phys % PAGE_SIZE) != 0 || !frame_valid(frame) ||
+            !page_release(&page_array[frame])) {
+            continue;
+        }
+
+        if (frame / BITMAP_WORD_BITS != word_idx) {
+            if (mask != 0) {
+                (void)fill_word(word_idx, mask, false);
+            }
+            word_idx = frame / BITMAP_WORD_BITS;
+            mask = 0;
+        }
+        mask |= 1ULL << (frame % BITMAP_WORD_BITS);
+        buddy_free_block(frame, 0);
+        freed++;
+    }
+    if (mask != 0) {
+        (void)fill_word(word_idx, mask, false);
+    }
+    mm_stats.free_frames += freed;
+    mm_stats.used_frames -= freed;
+    pmm_unlock();
+}
+
+struct nm_page *pmm_phys_to_page(uint64_t phys_addr)
+{
+    uint64_t frame = phys_addr / PAGE_SIZE;
+    if (page_array == 0 || !frame_valid(frame)) {
+        return 0;
+    }
+    return &page_array[frame];
+}
+
+uint64_t pmm_page_to_phys(const struct nm_page *page)
+{
+    if (page == 0 || page < page_array || page >= page_array + frame_limit) {
+        return 0;
+    }
+    return (uint64_t)(page - page_array) * PAGE_SIZE;
+}
+
+// Take another reference on an allocated frame. Returns the new count, or 0 when the
+// frame is free, out of range or already at the refcount limit and so cannot be shared.
+uint32_t pmm_page_get(uint64_t phys_addr)
+{
+    struct nm_page *page = pmm_phys_to_page(phys_addr);
+    if (page == 0) {
+        return 0;
+    }
+
+    uint16_t refs = __atomic_load_n(&page->refcount, __ATOMIC_RELAXED);
+    while (refs != 0 && refs != PMM_REFCOUNT_MAX) {
+        if (__atomic_compare_exchange_n(&page->refcount, &refs, (uint16_t)(refs + 1U), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return (uint32_t)refs + 1U;
+        }
+    }
+    return 0;
+}
+
+void pmm_page_put(uint64_t phys_addr)
+{
+    pmm_free_page(phys_addr);
+}
+
+uint32_t pmm_page_refcount(uint64_t phys_addr)
+{
+    const struct nm_page *page = pmm_phys_to_page(phys_addr);
+    if (page == 0) {
+        return 0;
+    }
+    return __atomic_load_n(&page->refcount, __ATOMIC_RELAXED);
+}
+
+enum nm_mm_zone pmm_page_zone(const struct nm_page *page)
+{
+    return (enum nm_mm_zone)zone_of((uint64_t)(page - page_array));
+}
+
+static uint64_t zero_pool_pop(void)
+{
+    uint64_t phys = 0;
+    pmm_lock();
+    if (zero_pool_count > 0) {
+        phys = zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+    } else {
+        zero_pool_misses++;
+    }
     pmm_unlock();
+    return phys;
+}
+
+uint64_t pmm_alloc_zeroed_page(void)
+{
+    uint64_t phys = zero_pool_pop();
+    if (phys != 0) {
+        return phys;
+    }
+
+    phys = pmm_alloc_page();
+    if (phys != 0) {
+        memset(frame_ptr(phys), 0, PAGE_SIZE);
+    }
+    return phys;
+}
+
+size_t pmm_zero_pool_fill(size_t max_frames)
+{
+    size_t filled = 0;
+    while (filled < max_frames) {
+        pmm_lock();
+        bool full = zero_pool_count >= ZERO_POOL_HIGH;
+        pmm_unlock();
+        if (full) {
+            break;
+        }
+
+        uint64_t phys = pmm_alloc_page();
+        if (phys == 0) {
+            break;
+        }
+        memset(frame_ptr(phys), 0, PAGE_SIZE);
+
+        pmm_lock();
+        if (zero_pool_count < ZERO_POOL_HIGH) {
+            zero_pool[zero_pool_count++] = phys;
+            phys = 0;
+        }
+        pmm_unlock();
+        if (phys != 0) {
+            pmm_free_page(phys);
+            break;
+        }
+        filled++;
+    }
+    return filled;
 }
 
 struct nm_mm_stats pmm_get_stats(void)
 {
     pmm_lock();
     struct nm_mm_stats snapshot = mm_stats;
+    snapshot.zero_pool_frames = zero_pool_count;
+    snapshot.zero_pool_hits = zero_pool_hits;
+    snapshot.zero_pool_misses = zero_pool_misses;
+    for (uint32_t zone = 0; zone < NM_ZONE_COUNT; zone++) {
+        snapshot.zones[zone].managed_frames = zones[zone].managed_frames;
+        snapshot.zones[zone].free_frames = zones[zone].free_frames;
+        snapshot.zones[zone].fallback_allocs = zones[zone].fallback_allocs;
+        for (uint32_t order = PMM_HUGE_ORDER; order <= PMM_MAX_ORDER; order++) {
+            snapshot.huge_free_blocks += zones[zone].free_area[order].blocks
+                                         << (order - PMM_HUGE_ORDER);
+        }
+    }
+
+    // Pre-zeroed frames are parked free memory as well.
+    snapshot.free_frames += zero_pool_count;
+    snapshot.used_frames -= zero_pool_count;
+    for (uint32_t i = 0; i < zero_pool_count; i++) {
+        snapshot.zones[zone_of(zero_pool[i] / PAGE_SIZE)].free_frames++;
+    }
     pmm_unlock();
+
+    // Frames parked in per-CPU magazines are still free memory.
+    for (uint32_t cpu = 0; cpu < NM_MAX_CPUS; cpu++) {
+        const struct pmm_pcp *pcp = &pcp_cache[cpu];
+        snapshot.free_frames += pcp->count;
+        snapshot.used_frames -= pcp->count;
+        for (uint32_t i = 0; i < pcp->count; i++) {
+            snapshot.zones[zone_of(pcp->frames[i])].free_frames++;
+        }
+        snapshot.pcp_alloc_hits += pcp->alloc_hits;
+        snapshot.pcp_alloc_misses += pcp->alloc_misses;
+        snapshot.pcp_refills += pcp->refills;
+        snapshot.pcp_drains += pcp->drains;
+    }
     return snapshot;
 }
 
+#ifdef NEVERMIND_HOST_TEST
+void *pmm_host_ptr_from_key(uint64_t key)
+{
+    if (key == 0 || key >= host_arena_bytes) {
+        return 0;
+    }
+    return frame_ptr(key);
+}
+
+uint64_t pmm_host_key_from_ptr(const void *ptr)
+{
+    const uint8_t *p = (const uint8_t *)ptr;
+    if (host_arena == 0 || p <= host_arena || p >= host_arena + host_arena_bytes) {
+        return 0;
+    }
+    return (uint64_t)(p - host_arena);
+}
 #endif
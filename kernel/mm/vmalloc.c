@@ -0,0 +1,290 @@
+#include "nm/mm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nm/string.h"
+
+#define PAGE_SIZE 4096ULL
+#define VMALLOC_FLAGS 0x3ULL
+// Freed areas are unmapped together once this many pages or areas have piled up.
+#define VMALLOC_LAZY_PAGES 2048U
+#define VMALLOC_LAZY_AREAS 64U
+#define KVMALLOC_MAX_KMALLOC (16U * 1024U)
+
+enum vm_state {
+    VM_LIVE,
+    VM_LAZY,
+    VM_PURGING,
+};
+
+// One allocation. [span_start, span_end) includes the guard pages and is what the area
+// reserves; the frames are mapped from `start`.
+struct vm_area {
+    uint64_t span_start;
+    uint64_t span_end;
+    uint64_t start;
+    uint64_t pages;
+    enum vm_state state;
+    struct vm_area *next;
+    uint64_t frames[];
+};
+
+// Sorted by address. The lock covers only the list and the counters; page tables, frames
+// and the heap are touched outside it.
+static struct vm_area *vm_areas;
+static struct nm_vmalloc_stats vm_stats;
+static uint64_t *vmalloc_root;
+static volatile uint32_t vmalloc_lock_word;
+
+static inline void vmalloc_lock(void)
+{
+    while (__sync_lock_test_and_set(&vmalloc_lock_word, 1U) != 0U) {
+        __asm__ volatile("pause");
+    }
+}
+
+static inline void vmalloc_unlock(void)
+{
+    __sync_lock_release(&vmalloc_lock_word);
+}
+
+void vmalloc_init(void)
+{
+    vm_areas = 0;
+    vm_stats = (struct nm_vmalloc_stats){0};
+#ifdef NEVERMIND_HOST_TEST
+    // Host tests have no boot tables; the region gets a root of its own.
+    vmalloc_root = (uint64_t *)nm_phys_to_virt(pmm_alloc_zeroed_page());
+#else
+    vmalloc_root = vmm_kernel_root();
+#endif
+    (void)vmm_pin_pdpt(vmalloc_root, NM_VMALLOC_BASE);
+}
+
+// Caller holds vmalloc_lock. First fit over the gaps between areas.
+static bool reserve_span(struct vm_area *area, uint64_t span)
+{
+    uint64_t base = NM_VMALLOC_BASE;
+    struct vm_area **link = &vm_areas;
+    while (*link != 0 && (*link)->span_start - base < span) {
+        base = (*link)->span_end;
+        link = &(*link)->next;
+    }
+    if (NM_VMALLOC_END - base < span) {
+        return false;
+    }
+    area->span_start = base;
+    area->span_end = base + span;
+    area->next = *link;
+    *link = area;
+    return true;
+}
+
+static void unlink_area(struct vm_area *area)
+{
+    struct vm_area **link = &vm_areas;
+    while (*link != area) {
+        link = &(*link)->next;
+    }
+    *link = area->next;
+}
+
+void *vmalloc_flags(size_t size, uint32_t flags)
+{
+    if (size == 0 || vmalloc_root == 0) {
+        return 0;
+    }
+    uint64_t pages = ((uint64_t)size + PAGE_SIZE - 1ULL) / PAGE_SIZE;
+    uint64_t guard = (flags & NM_VMALLOC_GUARD) != 0 ? PAGE_SIZE : 0;
+    struct vm_area *area = (struct vm_area *)kmalloc(sizeof(*area) + (size_t)pages * sizeof(uint64_t));
+    if (area == 0) {
+        return 0;
+    }
+
+    // Any frames will do, so this never needs a contiguous run.
+    uint64_t got = 0;
+    while (got < pages) {
+        size_t n = pmm_alloc_batch(&area->frames[got], (size_t)(pages - got));
+        if (n == 0) {
+            pmm_free_batch(area->frames, (size_t)got);
+            kfree(area);
+            return 0;
+        }
+        got += n;
+    }
+
+    uint64_t span = pages * PAGE_SIZE + 2ULL * guard;
+    vmalloc_lock();
+    bool reserved = reserve_span(area, span);
+    vmalloc_unlock();
+    if (!reserved) {
+        // Lazily freed areas may be all that stands in the way.
+        vmalloc_purge();
+        vmalloc_lock();
+        reserved = reserve_span(area, span);
+        vmalloc_unlock();
+    }
+    if (reserved) {
+        area->start = area->span_start + guard;
+        area->pages = pages;
+        area->state = VM_LIVE;
+        if (vmm_map_frames(vmalloc_root, area->start, area->frames, (size_t)pages, VMALLOC_FLAGS)) {
+            vmalloc_lock();
+            vm_stats.areas++;
+            vm_stats.pages += pages;
+            vmalloc_unlock();
+            return (void *)(uintptr_t)area->start;
+        }
+        vmalloc_lock();
+        unlink_area(area);
+        vmalloc_unlock();
+    }
+    pmm_free_batch(area->frames, (size_t)pages);
+    kfree(area);
+    return 0;
+}
+
+void *vmalloc(size_t size)
+{
+    return vmalloc_flags(size, 0);
+}
+
+// Caller holds vmalloc_lock.
+static struct vm_area *find_area(uint64_t addr)
+{
+    for (struct vm_area *area = vm_areas; area != 0 && area->span_start <= addr; area = area->next) {
+        if (addr < area->span_end) {
+            return area;
+        }
+    }
+    return 0;
+}
+
+void vfree(void *ptr)
+{
+    if (ptr == 0) {
+        return;
+    }
+    vmalloc_lock();
+    struct vm_area *area = find_area((uint64_t)(uintptr_t)ptr);
+    if (area == 0 || area->start != (uint64_t)(uintptr_t)ptr || area->state != VM_LIVE) {
+        vmalloc_unlock();
+        return;
+    }
+    area->state = VM_LAZY;
+    vm_stats.areas--;
+    vm_stats.pages -= area->pages;
+    vm_stats.lazy_areas++;
+    vm_stats.lazy_pages += area->pages;
+    bool purge = vm_stats.lazy_pages >= VMALLOC_LAZY_PAGES || vm_stats.lazy_areas >= VMALLOC_LAZY_AREAS;
+    vmalloc_unlock();
+    if (purge) {
+        vmalloc_purge();
+    }
+}
+
+void vmalloc_purge(void)
+{
+    struct vm_area *batch[VMALLOC_LAZY_AREAS];
+    struct nm_vrange ranges[VMALLOC_LAZY_AREAS];
+
+    for (;;) {
+        // Lazy areas keep their addresses until they are unmapped, so nothing can be
+        // mapped over them in the meantime.
+        size_t count = 0;
+        vmalloc_lock();
+        for (struct vm_area *area = vm_areas; area != 0 && count < VMALLOC_LAZY_AREAS; area = area->next) {
+            if (area->state == VM_LAZY) {
+                area->state = VM_PURGING;
+                vm_stats.lazy_areas--;
+                vm_stats.lazy_pages -= area->pages;
+                ranges[count] = (struct nm_vrange){.start = area->start, .len = area->pages * PAGE_SIZE};
+                batch[count++] = area;
+            }
+        }
+        if (count != 0) {
+            vm_stats.purges++;
+        }
+        vmalloc_unlock();
+        if (count == 0) {
+            return;
+        }
+
+        (void)vmm_unmap_ranges(vmalloc_root, ranges, count);
+        vmalloc_lock();
+        for (size_t i = 0; i < count; i++) {
+            unlink_area(batch[i]);
+        }
+        vmalloc_unlock();
+        for (size_t i = 0; i < count; i++) {
+            pmm_free_batch(batch[i]->frames, (size_t)batch[i]->pages);
+            kfree(batch[i]);
+        }
+    }
+}
+
+bool vmalloc_contains(const void *ptr)
+{
+    uint64_t addr = (uint64_t)(uintptr_t)ptr;
+    return addr >= NM_VMALLOC_BASE && addr < NM_VMALLOC_END;
+}
+
+uint64_t vmalloc_to_phys(const void *ptr)
+{
+    uint64_t phys;
+    if (!vmalloc_contains(ptr) || !vmm_translate(vmalloc_root, (uint64_t)(uintptr_t)ptr, &phys)) {
+        return 0;
+    }
+    return phys;
+}
+
+struct nm_vmalloc_stats vmalloc_get_stats(void)
+{
+    vmalloc_lock();
+    struct nm_vmalloc_stats snapshot = vm_stats;
+    vmalloc_unlock();
+    return snapshot;
+}
+
+void *kvmalloc(size_t size)
+{
+    return size <= KVMALLOC_MAX_KMALLOC ? kmalloc(size) : vmalloc(size);
+}
+
+void kvfree(void *ptr)
+{
+    if (vmalloc_contains(ptr)) {
+        vfree(ptr);
+    } else {
+        kfree(ptr);
+    }
+}
+
+void *kvrealloc(void *ptr, size_t old_size, size_t size)
+{
+    if (ptr == 0 || !vmalloc_contains(ptr)) {
+        if (size <= KVMALLOC_MAX_KMALLOC) {
+            return krealloc(ptr, size);
+        }
+    } else {
+        vmalloc_lock();
+        struct vm_area *area = find_area((uint64_t)(uintptr_t)ptr);
+        bool fits = area != 0 && size <= area->pages * PAGE_SIZE;
+        vmalloc_unlock();
+        if (fits) {
+            return ptr;
+        }
+    }
+
+    void *moved = kvmalloc(size);
+    if (moved == 0) {
+        return 0;
+    }
+    if (ptr != 0) {
+        memcpy(moved, ptr, old_size < size ? old_size : size);
+        kvfree(ptr);
+    }
+    return moved;
+}
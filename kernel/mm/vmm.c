@@ -4,28 +4,75 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "nm/cpu.h"
+#include "nm/string.h"
+
 #define PAGE_SIZE 4096ULL
 #define PAGE_FLAG_PRESENT 0x1ULL
 #define PAGE_FLAG_RW 0x2ULL
 #define PAGE_FLAG_US 0x4ULL
 #define PAGE_FLAG_PS 0x80ULL
-#define KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+#define GIB (1024ULL * 1024ULL * 1024ULL)
+#define PML4_SPAN (512ULL * GIB)
+// The boot tables map this much of the direct map; frames below it are reachable while
+// the rest of the direct map is still being built.
+#define BOOT_DIRECT_MAP_BYTES GIB
+#define HUGE_MASK (NM_HUGE_PAGE_SIZE - 1ULL)
+// Table frames fetched from the PMM at a time, and tables retired before they are freed.
+#define VMM_BATCH_FRAMES 8U
+// Leaf frames an unmap may release before it has to drop vmm_lock and hand them back.
+#define VMM_RELEASE_FRAMES 64U
+// Past this many 4 KiB pages a single CR3 reload is cheaper than one invlpg per page.
+#define VMM_FLUSH_ALL_PAGES 32ULL
+// Hot translations cached per CPU, direct-mapped by virtual page number.
+#define XLATE_SLOTS 16U
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+#define MSR_EFER 0xC0000080U
+#define EFER_NXE (1ULL << 11)
+#define PTE_ACCESS_BITS (NM_PTE_ACCESSED | NM_PTE_DIRTY)
+// Marks a released frame that heads a whole 2 MiB leaf rather than a single page.
+#define RELEASED_HUGE 0x1ULL
 
 static uint64_t *kernel_pml4;
 static volatile uint32_t vmm_lock_word;
+static uint64_t direct_map_bytes = BOOT_DIRECT_MAP_BYTES;
+static uint64_t direct_map_page_size = NM_HUGE_PAGE_SIZE;
+static struct nm_vmm_stats vmm_stats;
+// NM_PTE_NX once EFER.NXE is on; until then bit 63 is reserved and is never set.
+#ifdef NEVERMIND_HOST_TEST
+static uint64_t leaf_nx_mask = NM_PTE_NX;
+#else
+static uint64_t leaf_nx_mask;
+#endif
+
+// A cached 4 KiB translation is only trusted while `gen` matches xlate_gen, which every
+// TLB flush bumps: whatever changes an existing mapping also flushes it.
+struct xlate_entry {
+    const uint64_t *pml4;
+    uint64_t vpage;
+    uint64_t phys;
+    uint64_t gen;
+};
+
+struct xlate_cpu {
+    struct xlate_entry slots[XLATE_SLOTS];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static struct xlate_cpu xlate_cpus[NM_MAX_CPUS];
+static uint64_t xlate_gen = 1;
 
 static inline uint64_t ptr_to_phys(const void *ptr)
 {
-    uint64_t addr = (uint64_t)(uintptr_t)ptr;
-    if (addr >= KERNEL_VIRT_BASE) {
-        return addr - KERNEL_VIRT_BASE;
-    }
-    return addr;
+    return nm_virt_to_phys(ptr);
 }
 
 static inline uint64_t *phys_to_ptr(uint64_t phys)
 {
-    return (uint64_t *)(uintptr_t)phys;
+    return (uint64_t *)nm_phys_to_virt(phys);
 }
 
 static inline uint64_t table_flags_from_leaf(uint64_t flags)
@@ -52,6 +99,11 @@ static inline void vmm_unlock(void)
     __sync_lock_release(&vmm_lock_word);
 }
 
+static inline uint16_t table_index(uint64_t virt_addr, unsigned shift)
+{
+    return (uint16_t)((virt_addr >> shift) & 0x1FF);
+}
+
 static bool table_empty(const uint64_t *table)
 {
     for (size_t i = 0; i < 512; i++) {
@@ -62,83 +114,491 @@ static bool table_empty(const uint64_t *table)
     return true;
 }
 
-static uint64_t *alloc_table(void)
+// State carried across one range operation. Page-table frames are taken from the PMM in
+// batches outside vmm_lock (pmm_lock orders first) and only once a walk finds a level
+// missing. Tables emptied or replaced by the operation are retired and freed only after
+// the TLB flush, so no stale paging-structure cache entry can point at a reused frame;
+// frames behind unmapped leaves are released at the same point when asked to.
+struct vmm_batch {
+    uint64_t pool[VMM_BATCH_FRAMES];
+    size_t pool_count;
+    uint64_t retired[VMM_BATCH_FRAMES];
+    size_t retired_count;
+    bool release;
+    uint64_t released[VMM_RELEASE_FRAMES];
+    size_t released_count;
+    uint64_t flush_start;
+    uint64_t flush_end;
+};
+
+static void batch_init(struct vmm_batch *batch)
 {
-    uint64_t phys = pmm_alloc_page();
-    if (phys == 0) {
+    batch->pool_count = 0;
+    batch->retired_count = 0;
+    batch->release = false;
+    batch->released_count = 0;
+    batch->flush_start = UINT64_MAX;
+    batch->flush_end = 0;
+}
+
+// Caller holds vmm_lock.
+static uint64_t *batch_take_table(struct vmm_batch *batch)
+{
+    if (batch->pool_count == 0) {
         return 0;
     }
-
+    uint64_t phys = batch->pool[--batch->pool_count];
     uint64_t *table = phys_to_ptr(phys);
-    for (int i = 0; i < 512; i++) {
-        table[i] = 0;
-    }
+    memset(table, 0, PAGE_SIZE);
+    pmm_phys_to_page(phys)->flags |= NM_PAGE_PGTABLE;
+    vmm_stats.tables_allocated++;
     return table;
 }
 
-static bool alloc_table_pool(uint64_t **pool, size_t count)
+// Caller holds vmm_lock. Only tables the VMM allocated are freed; the boot tables live in
+// the kernel image.
+static bool batch_retire_if_empty(struct vmm_batch *batch, uint64_t *entry)
 {
-    for (size_t i = 0; i < count; i++) {
-        pool[i] = alloc_table();
-        if (pool[i] == 0) {
-            for (size_t j = 0; j < i; j++) {
-                pmm_free_page(ptr_to_phys(pool[j]));
-                pool[j] = 0;
-            }
-            return false;
-        }
+    uint64_t phys = *entry & ~0xFFFULL;
+    if (!table_empty(phys_to_ptr(phys)) || (pmm_phys_to_page(phys)->flags & NM_PAGE_PGTABLE) == 0) {
+        return false;
     }
+    *entry = 0;
+    batch->retired[batch->retired_count++] = phys;
+    vmm_stats.tables_freed++;
     return true;
 }
 
-static void free_table_pool(uint64_t **pool, size_t count)
+static inline void batch_mark(struct vmm_batch *batch, uint64_t virt_addr, uint64_t len)
 {
-    for (size_t i = 0; i < count; i++) {
-        if (pool[i] != 0) {
-            pmm_free_page(ptr_to_phys(pool[i]));
-            pool[i] = 0;
+    if (virt_addr < batch->flush_start) {
+        batch->flush_start = virt_addr;
+    }
+    if (virt_addr + len > batch->flush_end) {
+        batch->flush_end = virt_addr + len;
+    }
+}
+
+// Caller holds vmm_lock. One invlpg per page for short spans, one CR3 reload otherwise.
+static void batch_flush(struct vmm_batch *batch)
+{
+    if (batch->flush_end <= batch->flush_start) {
+        return;
+    }
+    uint64_t pages = (batch->flush_end - batch->flush_start) / PAGE_SIZE;
+    __atomic_add_fetch(&xlate_gen, 1U, __ATOMIC_RELEASE);
+#ifndef NEVERMIND_HOST_TEST
+    // Shared mappings may be cached under every PCID, and invlpg or a CR3 reload only
+    // reaches the current one. Toggling CR4.PGE drops all of them.
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    if ((cr4 & CR4_PCIDE) != 0 && (batch->flush_start < NM_USER_BASE || batch->flush_end > NM_USER_TOP)) {
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 ^ CR4_PGE) : "memory");
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+        vmm_stats.full_flushes++;
+        batch->flush_start = UINT64_MAX;
+        batch->flush_end = 0;
+        return;
+    }
+#endif
+    if (pages > VMM_FLUSH_ALL_PAGES) {
+#ifndef NEVERMIND_HOST_TEST
+        uint64_t cr3;
+        __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+        __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+#endif
+        vmm_stats.full_flushes++;
+    } else {
+#ifndef NEVERMIND_HOST_TEST
+        for (uint64_t addr = batch->flush_start; addr < batch->flush_end; addr += PAGE_SIZE) {
+            __asm__ volatile("invlpg (%0)" : : "r"((void *)(uintptr_t)addr) : "memory");
         }
+#endif
+        vmm_stats.page_flushes += pages;
     }
+    batch->flush_start = UINT64_MAX;
+    batch->flush_end = 0;
 }
 
-static uint64_t *take_prealloc(uint64_t **pool, size_t count)
+// Called without vmm_lock once the batch has been flushed.
+static void batch_release(struct vmm_batch *batch)
 {
-    for (size_t i = 0; i < count; i++) {
-        if (pool[i] != 0) {
-            uint64_t *table = pool[i];
-            pool[i] = 0;
-            return table;
+    pmm_free_batch(batch->retired, batch->retired_count);
+    batch->retired_count = 0;
+    for (size_t i = 0; i < batch->released_count; i++) {
+        if ((batch->released[i] & RELEASED_HUGE) != 0) {
+            pmm_free_pages(batch->released[i] & ~RELEASED_HUGE, NM_HUGE_PAGE_FRAMES);
+        } else {
+            pmm_page_put(batch->released[i]);
         }
     }
-    return 0;
+    batch->released_count = 0;
+}
+
+static bool batch_refill(struct vmm_batch *batch)
+{
+    size_t want = VMM_BATCH_FRAMES - batch->pool_count;
+    if (want == 0) {
+        return true;
+    }
+    if (pmm_alloc_batch(&batch->pool[batch->pool_count], want) == want) {
+        batch->pool_count += want;
+        return true;
+    }
+    // Nearly out of memory: one frame still lets the walk make progress.
+    if (pmm_alloc_batch(&batch->pool[batch->pool_count], 1) == 1) {
+        batch->pool_count++;
+        return true;
+    }
+    return false;
+}
+
+// Drop vmm_lock to free retired tables and top up the pool, then take it back. Returns
+// false if no table frame could be found.
+static bool batch_recharge(struct vmm_batch *batch)
+{
+    batch_flush(batch);
+    vmm_unlock();
+    batch_release(batch);
+    bool ok = batch_refill(batch);
+    vmm_lock();
+    return ok;
 }
 
-static uint64_t *get_or_create_next(uint64_t *table, uint16_t index, uint64_t flags,
-                                    uint64_t **prealloc_pool, size_t prealloc_count)
+static void batch_finish(struct vmm_batch *batch)
+{
+    batch_flush(batch);
+    vmm_unlock();
+    batch_release(batch);
+    pmm_free_batch(batch->pool, batch->pool_count);
+    batch->pool_count = 0;
+}
+
+// Returns the table below table[index], creating it from the pool if absent. A huge leaf
+// in the way is split into 512 leaves of child_size with the same attributes, which
+// leaves every translation unchanged. Returns 0 if the pool ran dry.
+static uint64_t *next_table(uint64_t *table, uint16_t index, uint64_t table_flags, uint64_t child_size,
+                            struct vmm_batch *batch, uint64_t virt_addr)
 {
     uint64_t entry = table[index];
-    if ((entry & PAGE_FLAG_PRESENT) != 0) {
-        uint64_t want = flags & (PAGE_FLAG_RW | PAGE_FLAG_US);
-        if ((entry & want) != want) {
-            table[index] = entry | want;
+    if ((entry & PAGE_FLAG_PRESENT) != 0 && (entry & PAGE_FLAG_PS) == 0) {
+        if ((entry & table_flags) != table_flags) {
+            table[index] = entry | table_flags;
         }
         return phys_to_ptr(entry & ~0xFFFULL);
     }
 
-    uint64_t *next = take_prealloc(prealloc_pool, prealloc_count);
+    uint64_t *next = batch_take_table(batch);
     if (next == 0) {
         return 0;
     }
-
-    table[index] = ptr_to_phys(next) | flags | PAGE_FLAG_PRESENT;
+    if ((entry & PAGE_FLAG_PRESENT) != 0) {
+        uint64_t span = child_size * 512ULL;
+        uint64_t base = entry & ~(span - 1ULL);
+        uint64_t attrs = entry & 0xFFFULL & ~PAGE_FLAG_PS;
+        if (child_size != PAGE_SIZE) {
+            attrs |= PAGE_FLAG_PS;
+        }
+        for (uint64_t i = 0; i < 512; i++) {
+            next[i] = (base + i * child_size) | attrs;
+        }
+        table_flags |= entry & (PAGE_FLAG_RW | PAGE_FLAG_US);
+        batch_mark(batch, virt_addr & ~(span - 1ULL), span);
+    }
+    table[index] = ptr_to_phys(next) | table_flags | PAGE_FLAG_PRESENT;
     return next;
 }
 
+// How much of [virt_addr, virt_addr + len) lies in the same naturally aligned span.
+static inline uint64_t span_left(uint64_t virt_addr, uint64_t span, uint64_t len)
+{
+    uint64_t left = span - (virt_addr & (span - 1ULL));
+    return left < len ? left : len;
+}
+
+// Caller holds vmm_lock. Maps as much of the range as lies under one PD entry and returns
+// the bytes mapped, or 0 if the batch needs more tables or retire slots first.
+static uint64_t map_step(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t len, uint64_t flags,
+                         struct vmm_batch *batch)
+{
+    if (batch->retired_count == VMM_BATCH_FRAMES) {
+        return 0;
+    }
+
+    uint64_t table_flags = table_flags_from_leaf(flags);
+    uint64_t leaf_flags = (flags & ((0xFFFULL & ~PAGE_FLAG_PS) | leaf_nx_mask)) | PAGE_FLAG_PRESENT;
+    uint64_t *pdpt = next_table(pml4, table_index(virt_addr, 39), table_flags, GIB, batch, virt_addr);
+    if (pdpt == 0) {
+        return 0;
+    }
+    uint64_t *pd = next_table(pdpt, table_index(virt_addr, 30), table_flags, NM_HUGE_PAGE_SIZE, batch, virt_addr);
+    if (pd == 0) {
+        return 0;
+    }
+
+    uint64_t *pde = &pd[table_index(virt_addr, 21)];
+    if (((virt_addr | phys_addr) & HUGE_MASK) == 0 && len >= NM_HUGE_PAGE_SIZE) {
+        uint64_t old = *pde;
+        *pde = phys_addr | leaf_flags | PAGE_FLAG_PS;
+        if ((old & PAGE_FLAG_PRESENT) != 0) {
+            batch_mark(batch, virt_addr, NM_HUGE_PAGE_SIZE);
+            if ((old & PAGE_FLAG_PS) == 0 && (pmm_phys_to_page(old & ~0xFFFULL)->flags & NM_PAGE_PGTABLE) != 0) {
+                batch->retired[batch->retired_count++] = old & ~0xFFFULL;
+                vmm_stats.tables_freed++;
+            }
+        }
+        vmm_stats.huge_leaves++;
+        return NM_HUGE_PAGE_SIZE;
+    }
+
+    uint64_t *pt = next_table(pd, table_index(virt_addr, 21), table_flags, PAGE_SIZE, batch, virt_addr);
+    if (pt == 0) {
+        return 0;
+    }
+    uint64_t done = 0;
+    for (uint16_t i = table_index(virt_addr, 12); i < 512 && done < len; i++, done += PAGE_SIZE) {
+        if ((pt[i] & PAGE_FLAG_PRESENT) != 0) {
+            batch_mark(batch, virt_addr + done, PAGE_SIZE);
+        }
+        pt[i] = (phys_addr + done) | leaf_flags;
+    }
+    return done;
+}
+
+// Caller holds vmm_lock. Unmaps as much of the range as lies under one PD entry, or skips
+// an absent PML4/PDPT/PD slot whole, and retires tables the unmap left empty. Returns the
+// bytes covered, or 0 if the batch needs more tables or retire slots first.
+static uint64_t unmap_step(uint64_t *pml4, uint64_t virt_addr, uint64_t len, struct vmm_batch *batch,
+                           bool *unmapped)
+{
+    if (batch->retired_count + 3U > VMM_BATCH_FRAMES) {
+        return 0;
+    }
+
+    uint64_t *pml4e = &pml4[table_index(virt_addr, 39)];
+    if ((*pml4e & PAGE_FLAG_PRESENT) == 0) {
+        return span_left(virt_addr, PML4_SPAN, len);
+    }
+    uint64_t *pdpt = phys_to_ptr(*pml4e & ~0xFFFULL);
+    uint64_t *pdpte = &pdpt[table_index(virt_addr, 30)];
+    if ((*pdpte & PAGE_FLAG_PRESENT) == 0) {
+        return span_left(virt_addr, GIB, len);
+    }
+
+    if ((*pdpte & PAGE_FLAG_PS) != 0 && !batch->release && (virt_addr & (GIB - 1ULL)) == 0 && len >= GIB) {
+        *pdpte = 0;
+        batch_mark(batch, virt_addr, GIB);
+        *unmapped = true;
+        (void)batch_retire_if_empty(batch, pml4e);
+        return GIB;
+    }
+    uint64_t *pd = next_table(pdpt, table_index(virt_addr, 30), 0, NM_HUGE_PAGE_SIZE, batch, virt_addr);
+    if (pd == 0) {
+        return 0;
+    }
+    uint64_t *pde = &pd[table_index(virt_addr, 21)];
+    if ((*pde & PAGE_FLAG_PRESENT) == 0) {
+        return span_left(virt_addr, NM_HUGE_PAGE_SIZE, len);
+    }
+
+    uint64_t step;
+    if ((*pde & PAGE_FLAG_PS) != 0 && (virt_addr & HUGE_MASK) == 0 && len >= NM_HUGE_PAGE_SIZE) {
+        if (batch->release) {
+            if (batch->released_count == VMM_RELEASE_FRAMES) {
+                return 0;
+            }
+            batch->released[batch->released_count++] = (*pde & PAGE_ADDR_MASK) | RELEASED_HUGE;
+        }
+        *pde = 0;
+        batch_mark(batch, virt_addr, NM_HUGE_PAGE_SIZE);
+        *unmapped = true;
+        step = NM_HUGE_PAGE_SIZE;
+    } else {
+        uint64_t *pt = next_table(pd, table_index(virt_addr, 21), 0, PAGE_SIZE, batch, virt_addr);
+        if (pt == 0) {
+            return 0;
+        }
+        step = 0;
+        for (uint16_t i = table_index(virt_addr, 12); i < 512 && step < len; i++, step += PAGE_SIZE) {
+            if ((pt[i] & PAGE_FLAG_PRESENT) != 0) {
+                if (batch->release) {
+                    if (batch->released_count == VMM_RELEASE_FRAMES) {
+                        break;
+                    }
+                    batch->released[batch->released_count++] = pt[i] & PAGE_ADDR_MASK;
+                }
+                pt[i] = 0;
+                batch_mark(batch, virt_addr + step, PAGE_SIZE);
+                *unmapped = true;
+            }
+        }
+        if (!batch_retire_if_empty(batch, pde)) {
+            return step;
+        }
+    }
+    if (batch_retire_if_empty(batch, pdpte)) {
+        (void)batch_retire_if_empty(batch, pml4e);
+    }
+    return step;
+}
+
+// Caller holds vmm_lock. Shares the leaves of src under one PD entry into dst, clearing RW
+// in both and taking a reference on every frame, and skips absent src slots whole. Returns
+// the bytes covered, or 0 if the batch needs more tables first; *ok turns false if a frame
+// could take no more references.
+static uint64_t clone_step(uint64_t *dst, uint64_t *src, uint64_t virt_addr, uint64_t len, struct vmm_batch *batch,
+                           bool *ok)
+{
+    const uint64_t table_flags = PAGE_FLAG_RW | PAGE_FLAG_US;
+    uint64_t src_pml4e = src[table_index(virt_addr, 39)];
+    if ((src_pml4e & PAGE_FLAG_PRESENT) == 0) {
+        return span_left(virt_addr, PML4_SPAN, len);
+    }
+    uint64_t *src_pdpt = phys_to_ptr(src_pml4e & PAGE_ADDR_MASK);
+    if ((src_pdpt[table_index(virt_addr, 30)] & PAGE_FLAG_PRESENT) == 0) {
+        return span_left(virt_addr, GIB, len);
+    }
+    // Huge leaves are split first so that sharing and copying stay per 4 KiB frame.
+    uint64_t *src_pd = next_table(src_pdpt, table_index(virt_addr, 30), 0, NM_HUGE_PAGE_SIZE, batch, virt_addr);
+    if (src_pd == 0) {
+        return 0;
+    }
+    if ((src_pd[table_index(virt_addr, 21)] & PAGE_FLAG_PRESENT) == 0) {
+        return span_left(virt_addr, NM_HUGE_PAGE_SIZE, len);
+    }
+    uint64_t *src_pt = next_table(src_pd, table_index(virt_addr, 21), 0, PAGE_SIZE, batch, virt_addr);
+    if (src_pt == 0) {
+        return 0;
+    }
+
+    uint64_t *dst_pdpt = next_table(dst, table_index(virt_addr, 39), table_flags, GIB, batch, virt_addr);
+    if (dst_pdpt == 0) {
+        return 0;
+    }
+    uint64_t *dst_pd = next_table(dst_pdpt, table_index(virt_addr, 30), table_flags, NM_HUGE_PAGE_SIZE, batch, virt_addr);
+    if (dst_pd == 0) {
+        return 0;
+    }
+    uint64_t *dst_pt = next_table(dst_pd, table_index(virt_addr, 21), table_flags, PAGE_SIZE, batch, virt_addr);
+    if (dst_pt == 0) {
+        return 0;
+    }
+
+    uint64_t step = 0;
+    for (uint16_t i = table_index(virt_addr, 12); i < 512 && step < len; i++, step += PAGE_SIZE) {
+        uint64_t entry = src_pt[i];
+        if ((entry & PAGE_FLAG_PRESENT) == 0) {
+            continue;
+        }
+        if (pmm_page_get(entry & PAGE_ADDR_MASK) == 0) {
+            *ok = false;
+            return step;
+        }
+        if ((entry & PAGE_FLAG_RW) != 0) {
+            entry &= ~PAGE_FLAG_RW;
+            src_pt[i] = entry;
+            batch_mark(batch, virt_addr + step, PAGE_SIZE);
+        }
+        dst_pt[i] = entry;
+        vmm_stats.leaves_shared++;
+    }
+    return step;
+}
+
+#ifndef NEVERMIND_HOST_TEST
+// Tables for the direct map must be reachable through the part that already exists, so
+// they come from low zones and anything above the boot window is handed back.
+static uint64_t *direct_map_table(void)
+{
+    uint64_t phys = pmm_alloc_pages_zone(1, NM_ZONE_MASK_DMA, 0);
+    if (phys == 0) {
+        phys = pmm_alloc_pages_zone(1, NM_ZONE_MASK_DMA32, 0);
+    }
+    if (phys == 0 || phys >= BOOT_DIRECT_MAP_BYTES) {
+        if (phys != 0) {
+            pmm_free_page(phys);
+        }
+        return 0;
+    }
+    uint64_t *table = phys_to_ptr(phys);
+    memset(table, 0, PAGE_SIZE);
+    pmm_phys_to_page(phys)->flags |= NM_PAGE_PGTABLE;
+    return table;
+}
+
+// Map [0, end) at NM_DIRECT_MAP_BASE with 1 GiB leaves, or 2 MiB leaves on CPUs without
+// them. Each 512 GiB slot gets a fresh PDPT that is swapped into the PML4 only once it is
+// complete, so the boot alias of the first 1 GiB stays valid throughout. Holes in the
+// physical map are mapped too; MTRRs keep MMIO in them uncached.
+static void direct_map_build(uint64_t end)
+{
+    bool gbpages = cpu_has_gbpages() != 0;
+    uint64_t mapped = 0;
+    end = (end + GIB - 1ULL) & ~(GIB - 1ULL);
+
+    for (uint64_t slot_base = 0; slot_base < end; slot_base += PML4_SPAN) {
+        uint64_t *pdpt = direct_map_table();
+        if (pdpt == 0) {
+            break;
+        }
+        uint64_t slot_end = slot_base + PML4_SPAN < end ? slot_base + PML4_SPAN : end;
+        uint64_t gib = slot_base;
+        for (; gib < slot_end; gib += GIB) {
+            uint16_t pdpt_i = (uint16_t)((gib >> 30) & 0x1FF);
+            if (gbpages) {
+                pdpt[pdpt_i] = gib | PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_PS;
+                continue;
+            }
+            uint64_t *pd = direct_map_table();
+            if (pd == 0) {
+                break;
+            }
+            for (uint64_t i = 0; i < 512; i++) {
+                pd[i] = (gib + i * NM_HUGE_PAGE_SIZE) | PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_PS;
+            }
+            pdpt[pdpt_i] = ptr_to_phys(pd) | PAGE_FLAG_PRESENT | PAGE_FLAG_RW;
+        }
+
+        uint16_t pml4_i = (uint16_t)(((NM_DIRECT_MAP_BASE + slot_base) >> 39) & 0x1FF);
+        kernel_pml4[pml4_i] = ptr_to_phys(pdpt) | PAGE_FLAG_PRESENT | PAGE_FLAG_RW;
+        mapped = gib;
+        if (gib < slot_end) {
+            break;
+        }
+    }
+
+    if (mapped > direct_map_bytes) {
+        direct_map_bytes = mapped;
+    }
+    direct_map_page_size = gbpages ? GIB : NM_HUGE_PAGE_SIZE;
+
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
 void vmm_init(void)
 {
     uint64_t cr3;
     __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
     kernel_pml4 = phys_to_ptr(cr3 & ~0xFFFULL);
+    direct_map_build(pmm_get_stats().total_frames * PAGE_SIZE);
+    if (cpu_has_nx() != 0) {
+        cpu_wrmsr(MSR_EFER, cpu_rdmsr(MSR_EFER) | EFER_NXE);
+        leaf_nx_mask = NM_PTE_NX;
+    }
+}
+
+#endif
+
+uint64_t vmm_direct_map_bytes(void)
+{
+    return direct_map_bytes;
+}
+
+uint64_t vmm_direct_map_page_size(void)
+{
+    return direct_map_page_size;
 }
 
 uint64_t *vmm_kernel_root(void)
@@ -146,158 +606,649 @@ uint64_t *vmm_kernel_root(void)
     return kernel_pml4;
 }
 
-bool vmm_map_page_in(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags)
+struct nm_vmm_stats vmm_get_stats(void)
 {
-    if (pml4 == 0) {
-        return false;
+    vmm_lock();
+    struct nm_vmm_stats snapshot = vmm_stats;
+    vmm_unlock();
+    for (uint32_t cpu = 0; cpu < NM_MAX_CPUS; cpu++) {
+        snapshot.xlate_hits += xlate_cpus[cpu].hits;
+        snapshot.xlate_misses += xlate_cpus[cpu].misses;
     }
+    return snapshot;
+}
 
-    uint64_t *prealloc[3] = {0, 0, 0};
-    if (!alloc_table_pool(prealloc, 3)) {
+bool vmm_map_range(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t len, uint64_t flags)
+{
+    if (pml4 == 0 || len == 0 || ((virt_addr | phys_addr | len) & 0xFFFULL) != 0) {
         return false;
     }
 
+    struct vmm_batch batch;
+    batch_init(&batch);
+    uint64_t done = 0;
+
     vmm_lock();
+    while (done < len) {
+        uint64_t step = map_step(pml4, virt_addr + done, phys_addr + done, len - done, flags, &batch);
+        if (step != 0) {
+            done += step;
+        } else if (!batch_recharge(&batch)) {
+            break;
+        }
+    }
+    batch_finish(&batch);
 
-    uint16_t pml4_i = (virt_addr >> 39) & 0x1FF;
-    uint16_t pdpt_i = (virt_addr >> 30) & 0x1FF;
-    uint16_t pd_i = (virt_addr >> 21) & 0x1FF;
-    uint16_t pt_i = (virt_addr >> 12) & 0x1FF;
-    uint64_t table_flags = table_flags_from_leaf(flags);
+    if (done < len) {
+        (void)vmm_unmap_range(pml4, virt_addr, done);
+        return false;
+    }
+    return true;
+}
 
-    uint64_t *pdpt = get_or_create_next(pml4, pml4_i, table_flags, prealloc, 3);
-    if (pdpt == 0) {
-        vmm_unlock();
-        free_table_pool(prealloc, 3);
+bool vmm_map_frames(uint64_t *pml4, uint64_t virt_addr, const uint64_t *frames, size_t count, uint64_t flags)
+{
+    if (pml4 == 0 || frames == 0 || count == 0 || (virt_addr & 0xFFFULL) != 0) {
         return false;
     }
 
-    uint64_t *pd = get_or_create_next(pdpt, pdpt_i, table_flags, prealloc, 3);
-    if (pd == 0) {
-        vmm_unlock();
-        free_table_pool(prealloc, 3);
+    struct vmm_batch batch;
+    batch_init(&batch);
+    size_t done = 0;
+
+    vmm_lock();
+    while (done < count) {
+        // Frames that happen to be physically consecutive go down as one run.
+        size_t run = 1;
+        while (done + run < count && frames[done + run] == frames[done] + run * PAGE_SIZE) {
+            run++;
+        }
+        uint64_t step = map_step(pml4, virt_addr + done * PAGE_SIZE, frames[done], run * PAGE_SIZE, flags, &batch);
+        if (step != 0) {
+            done += (size_t)(step / PAGE_SIZE);
+        } else if (!batch_recharge(&batch)) {
+            break;
+        }
+    }
+    batch_finish(&batch);
+
+    if (done < count) {
+        (void)vmm_unmap_range(pml4, virt_addr, done * PAGE_SIZE);
         return false;
     }
+    return true;
+}
 
-    uint64_t *pt = get_or_create_next(pd, pd_i, table_flags, prealloc, 3);
-    if (pt == 0) {
-        vmm_unlock();
-        free_table_pool(prealloc, 3);
+bool vmm_pin_pdpt(uint64_t *pml4, uint64_t virt_addr)
+{
+    if (pml4 == 0) {
+        return false;
+    }
+    uint64_t phys = pmm_alloc_zeroed_page();
+    if (phys == 0) {
         return false;
     }
 
-    pt[pt_i] = (phys_addr & ~0xFFFULL) | (flags & 0xFFFULL) | PAGE_FLAG_PRESENT;
-    __asm__ volatile("invlpg (%0)" : : "r"((void *)(uintptr_t)virt_addr) : "memory");
+    // No NM_PAGE_PGTABLE: the unmap paths only retire tables carrying it, so this one stays
+    // even when everything under it is gone.
+    vmm_lock();
+    uint64_t *pml4e = &pml4[table_index(virt_addr, 39)];
+    bool installed = (*pml4e & PAGE_FLAG_PRESENT) == 0;
+    if (installed) {
+        *pml4e = phys | PAGE_FLAG_PRESENT | PAGE_FLAG_RW;
+    }
     vmm_unlock();
-    free_table_pool(prealloc, 3);
+    if (!installed) {
+        pmm_free_page(phys);
+    }
     return true;
 }
 
-bool vmm_map_2m_in(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags)
+// Returns whether the whole range was covered; *unmapped tells if anything was mapped.
+static bool unmap_range(uint64_t *pml4, uint64_t virt_addr, uint64_t len, bool release, bool *unmapped)
+{
+    *unmapped = false;
+    if (pml4 == 0 || ((virt_addr | len) & 0xFFFULL) != 0) {
+        return false;
+    }
+
+    struct vmm_batch batch;
+    batch_init(&batch);
+    batch.release = release;
+    uint64_t done = 0;
+
+    vmm_lock();
+    while (done < len) {
+        uint64_t step = unmap_step(pml4, virt_addr + done, len - done, &batch, unmapped);
+        if (step != 0) {
+            done += step;
+        } else if (!batch_recharge(&batch)) {
+            break;
+        }
+    }
+    batch_finish(&batch);
+    return done == len;
+}
+
+bool vmm_unmap_range(uint64_t *pml4, uint64_t virt_addr, uint64_t len)
+{
+    bool unmapped;
+    return unmap_range(pml4, virt_addr, len, false, &unmapped) && unmapped;
+}
+
+bool vmm_unmap_range_release(uint64_t *pml4, uint64_t virt_addr, uint64_t len)
+{
+    bool unmapped;
+    return unmap_range(pml4, virt_addr, len, true, &unmapped) && unmapped;
+}
+
+bool vmm_unmap_ranges(uint64_t *pml4, const struct nm_vrange *ranges, size_t count)
 {
     if (pml4 == 0) {
         return false;
     }
 
-    uint64_t *prealloc[2] = {0, 0};
-    if (!alloc_table_pool(prealloc, 2)) {
+    struct vmm_batch batch;
+    batch_init(&batch);
+    bool ok = true;
+    bool unmapped = false;
+
+    vmm_lock();
+    for (size_t i = 0; i < count && ok; i++) {
+        if (((ranges[i].start | ranges[i].len) & 0xFFFULL) != 0) {
+            ok = false;
+            break;
+        }
+        uint64_t done = 0;
+        while (done < ranges[i].len) {
+            uint64_t step = unmap_step(pml4, ranges[i].start + done, ranges[i].len - done, &batch, &unmapped);
+            if (step != 0) {
+                done += step;
+            } else if (!batch_recharge(&batch)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    batch_finish(&batch);
+    return ok;
+}
+
+bool vmm_clone_range(uint64_t *dst_pml4, uint64_t *src_pml4, uint64_t virt_addr, uint64_t len)
+{
+    if (dst_pml4 == 0 || src_pml4 == 0 || ((virt_addr | len) & 0xFFFULL) != 0) {
         return false;
     }
 
+    struct vmm_batch batch;
+    batch_init(&batch);
+    uint64_t done = 0;
+    bool ok = true;
+
     vmm_lock();
+    while (done < len && ok) {
+        uint64_t step = clone_step(dst_pml4, src_pml4, virt_addr + done, len - done, &batch, &ok);
+        if (step != 0) {
+            done += step;
+        } else if (ok && !batch_recharge(&batch)) {
+            break;
+        }
+    }
+    batch_finish(&batch);
+    return ok && done == len;
+}
 
-    uint16_t pml4_i = (virt_addr >> 39) & 0x1FF;
-    uint16_t pdpt_i = (virt_addr >> 30) & 0x1FF;
-    uint16_t pd_i = (virt_addr >> 21) & 0x1FF;
-    uint64_t table_flags = table_flags_from_leaf(flags);
+// Caller holds vmm_lock. The present leaf mapping virt_addr and the size it maps, or 0.
+static uint64_t leaf_lookup(const uint64_t *pml4, uint64_t virt_addr, uint64_t *size)
+{
+    uint64_t entry = pml4[table_index(virt_addr, 39)];
+    unsigned shift = 39;
+    while (shift > 12 && (entry & PAGE_FLAG_PRESENT) != 0) {
+        shift -= 9;
+        entry = phys_to_ptr(entry & PAGE_ADDR_MASK)[table_index(virt_addr, shift)];
+        if ((entry & PAGE_FLAG_PS) != 0) {
+            break;
+        }
+    }
+    if ((entry & PAGE_FLAG_PRESENT) == 0) {
+        return 0;
+    }
+    *size = 1ULL << shift;
+    return entry;
+}
 
-    uint64_t *pdpt = get_or_create_next(pml4, pml4_i, table_flags, prealloc, 2);
-    if (pdpt == 0) {
-        vmm_unlock();
-        free_table_pool(prealloc, 2);
-        return false;
+uint64_t vmm_leaf_entry(uint64_t *pml4, uint64_t virt_addr)
+{
+    if (pml4 == 0) {
+        return 0;
     }
 
-    uint64_t *pd = get_or_create_next(pdpt, pdpt_i, table_flags, prealloc, 2);
-    if (pd == 0) {
-        vmm_unlock();
-        free_table_pool(prealloc, 2);
+    uint64_t size;
+    vmm_lock();
+    uint64_t entry = leaf_lookup(pml4, virt_addr, &size);
+    vmm_unlock();
+    return entry;
+}
+
+bool vmm_translate(const uint64_t *pml4, uint64_t virt_addr, uint64_t *phys_addr)
+{
+    if (pml4 == 0) {
         return false;
     }
 
-    pd[pd_i] = (phys_addr & ~0x1FFFFFULL) | (flags & 0xFFFULL) | PAGE_FLAG_PRESENT | PAGE_FLAG_PS;
-    __asm__ volatile("invlpg (%0)" : : "r"((void *)(uintptr_t)virt_addr) : "memory");
+    uint64_t vpage = virt_addr & ~(PAGE_SIZE - 1ULL);
+    uint64_t irq_flags = cpu_irq_save();
+    struct xlate_cpu *xc = &xlate_cpus[cpu_current_id()];
+    struct xlate_entry *slot = &xc->slots[(vpage >> 12) & (XLATE_SLOTS - 1U)];
+    uint64_t gen = __atomic_load_n(&xlate_gen, __ATOMIC_ACQUIRE);
+    if (slot->gen == gen && slot->pml4 == pml4 && slot->vpage == vpage) {
+        xc->hits++;
+        *phys_addr = slot->phys | (virt_addr & (PAGE_SIZE - 1ULL));
+        cpu_irq_restore(irq_flags);
+        return true;
+    }
+
+    uint64_t size = 0;
+    vmm_lock();
+    uint64_t entry = leaf_lookup(pml4, virt_addr, &size);
     vmm_unlock();
-    free_table_pool(prealloc, 2);
+    xc->misses++;
+    if (entry == 0) {
+        cpu_irq_restore(irq_flags);
+        return false;
+    }
+    // gen was read before the walk, so a change racing with it leaves the slot stale.
+    uint64_t phys = (entry & PAGE_ADDR_MASK & ~(size - 1ULL)) + (virt_addr & (size - 1ULL));
+    *slot = (struct xlate_entry){.pml4 = pml4, .vpage = vpage, .phys = phys & ~(PAGE_SIZE - 1ULL), .gen = gen};
+    *phys_addr = phys;
+    cpu_irq_restore(irq_flags);
     return true;
 }
 
-bool vmm_unmap_page_in(uint64_t *pml4, uint64_t virt_addr)
+static inline uint64_t canonical(uint64_t virt_addr)
 {
-    if (pml4 == 0) {
-        return false;
+    return (virt_addr & (1ULL << 47)) != 0 ? virt_addr | 0xFFFF000000000000ULL : virt_addr;
+}
+
+// Caller holds vmm_lock. Visits the present leaves of `table`, a table at `shift`, that
+// overlap [virt_addr, last], adding table_flags to every table entry passed on the way.
+static int walk_level(uint64_t *table, unsigned shift, uint64_t virt_addr, uint64_t last, nm_vmm_leaf_fn fn,
+                      void *ctx, uint64_t table_flags, struct vmm_batch *batch)
+{
+    uint64_t size = 1ULL << shift;
+    for (;;) {
+        uint64_t *entry = &table[table_index(virt_addr, shift)];
+        uint64_t base = virt_addr & ~(size - 1ULL);
+        uint64_t next = base + size;
+        if ((*entry & PAGE_FLAG_PRESENT) != 0) {
+            int rc;
+            if (shift == 12 || (*entry & PAGE_FLAG_PS) != 0) {
+                uint64_t old = *entry;
+                rc = fn(ctx, canonical(base), size, entry);
+                if (*entry != old) {
+                    batch_mark(batch, canonical(base), size);
+                }
+            } else {
+                *entry |= table_flags;
+                uint64_t *child = phys_to_ptr(*entry & PAGE_ADDR_MASK);
+                rc = walk_level(child, shift - 9U, virt_addr, next - 1ULL < last ? next - 1ULL : last, fn, ctx,
+                                table_flags, batch);
+            }
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        if (next == 0 || next > last) {
+            return 0;
+        }
+        virt_addr = next;
+    }
+}
+
+// Walks run in 48-bit terms; a range may not run across the non-canonical hole.
+static uint64_t walk_last(uint64_t start, uint64_t len)
+{
+    uint64_t last = start + (len - 1ULL);
+    if (last > 0x0000FFFFFFFFFFFFULL || last < start) {
+        last = 0x0000FFFFFFFFFFFFULL;
     }
+    return last;
+}
 
-    uint64_t to_free[3] = {0, 0, 0};
-    size_t free_count = 0;
+int vmm_walk(uint64_t *pml4, uint64_t virt_addr, uint64_t len, nm_vmm_leaf_fn fn, void *ctx)
+{
+    if (pml4 == 0 || fn == 0 || len == 0) {
+        return 0;
+    }
+    uint64_t start = virt_addr & 0x0000FFFFFFFFFFFFULL;
 
+    struct vmm_batch batch;
+    batch_init(&batch);
     vmm_lock();
+    int rc = walk_level(pml4, 39, start, walk_last(start, len), fn, ctx, 0, &batch);
+    batch_flush(&batch);
+    vmm_unlock();
+    return rc;
+}
 
-    uint16_t pml4_i = (virt_addr >> 39) & 0x1FF;
-    uint16_t pdpt_i = (virt_addr >> 30) & 0x1FF;
-    uint16_t pd_i = (virt_addr >> 21) & 0x1FF;
-    uint16_t pt_i = (virt_addr >> 12) & 0x1FF;
+struct harvest_ctx {
+    uint64_t bits;
+    uint64_t hits;
+};
 
-    if ((pml4[pml4_i] & PAGE_FLAG_PRESENT) == 0) {
-        vmm_unlock();
-        return false;
+static int harvest_leaf(void *ctx, uint64_t virt_addr, uint64_t size, uint64_t *entry)
+{
+    (void)virt_addr;
+    (void)size;
+    struct harvest_ctx *hc = (struct harvest_ctx *)ctx;
+    if ((*entry & hc->bits) != 0) {
+        hc->hits++;
+        *entry &= ~hc->bits;
     }
+    return 0;
+}
+
+uint64_t vmm_harvest(uint64_t *pml4, uint64_t virt_addr, uint64_t len, uint64_t bits)
+{
+    struct harvest_ctx hc = {.bits = bits & (NM_PTE_ACCESSED | NM_PTE_DIRTY), .hits = 0};
+    if (hc.bits != 0) {
+        (void)vmm_walk(pml4, virt_addr, len, harvest_leaf, &hc);
+    }
+    return hc.hits;
+}
+
+// Runs of leaves that continue each other virtually and physically with the same size and
+// attributes are printed as one line.
+struct dump_ctx {
+    char *out;
+    size_t cap;
+    size_t used;
+    uint64_t start;
+    uint64_t bytes;
+    uint64_t phys;
+    uint64_t size;
+    uint64_t attrs;
+    uint64_t lines;
+};
+
+static void dump_put(struct dump_ctx *dc, const char *s)
+{
+    while (*s != '\0' && dc->used + 1U < dc->cap) {
+        dc->out[dc->used++] = *s++;
+    }
+    dc->out[dc->used] = '\0';
+}
+
+static void dump_hex(struct dump_ctx *dc, uint64_t value)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[19];
+    size_t idx = sizeof(buf);
+    buf[--idx] = '\0';
+    do {
+        buf[--idx] = digits[value & 0xFU];
+        value >>= 4;
+    } while (value != 0);
+    buf[--idx] = 'x';
+    buf[--idx] = '0';
+    dump_put(dc, &buf[idx]);
+}
+
+static void dump_flush_run(struct dump_ctx *dc)
+{
+    if (dc->bytes == 0) {
+        return;
+    }
+    dump_hex(dc, dc->start);
+    dump_put(dc, "-");
+    dump_hex(dc, dc->start + dc->bytes);
+    dump_put(dc, " -> ");
+    dump_hex(dc, dc->phys);
+    dump_put(dc, dc->size == GIB ? " 1G " : dc->size == NM_HUGE_PAGE_SIZE ? " 2M " : " 4K ");
+    dump_put(dc, (dc->attrs & PAGE_FLAG_RW) != 0 ? "rw" : "r-");
+    dump_put(dc, (dc->attrs & NM_PTE_NX) != 0 ? "-" : "x");
+    dump_put(dc, (dc->attrs & PAGE_FLAG_US) != 0 ? " user" : " kernel");
+    if ((dc->attrs & NM_PTE_GLOBAL) != 0) {
+        dump_put(dc, " global");
+    }
+    dump_put(dc, "\n");
+    dc->lines++;
+    dc->bytes = 0;
+}
+
+static int dump_leaf(void *ctx, uint64_t virt_addr, uint64_t size, uint64_t *entry)
+{
+    struct dump_ctx *dc = (struct dump_ctx *)ctx;
+    uint64_t phys = *entry & PAGE_ADDR_MASK & ~(size - 1ULL);
+    uint64_t attrs = *entry & (PAGE_FLAG_RW | PAGE_FLAG_US | NM_PTE_GLOBAL | NM_PTE_NX);
+    if (dc->bytes != 0 && (virt_addr != dc->start + dc->bytes || size != dc->size || attrs != dc->attrs ||
+                           phys != dc->phys + dc->bytes)) {
+        dump_flush_run(dc);
+    }
+    if (dc->bytes == 0) {
+        dc->start = virt_addr;
+        dc->phys = phys;
+        dc->size = size;
+        dc->attrs = attrs;
+    }
+    dc->bytes += size;
+    return 0;
+}
+
+uint64_t vmm_dump(uint64_t *pml4, uint64_t virt_addr, uint64_t len, char *out, size_t cap)
+{
+    if (out == 0 || cap == 0) {
+        return 0;
+    }
+    struct dump_ctx dc = {.out = out, .cap = cap};
+    out[0] = '\0';
+    (void)vmm_walk(pml4, virt_addr, len, dump_leaf, &dc);
+    dump_flush_run(&dc);
+    return dc.lines;
+}
+
+struct resident_ctx {
+    uint64_t start;
+    uint64_t last;
+    uint64_t bytes;
+};
+
+static int resident_leaf(void *ctx, uint64_t virt_addr, uint64_t size, uint64_t *entry)
+{
+    (void)entry;
+    struct resident_ctx *rc = (struct resident_ctx *)ctx;
+    uint64_t lo = virt_addr & 0x0000FFFFFFFFFFFFULL;
+    uint64_t hi = lo + (size - 1ULL);
+    lo = lo > rc->start ? lo : rc->start;
+    hi = hi < rc->last ? hi : rc->last;
+    rc->bytes += hi - lo + 1ULL;
+    return 0;
+}
+
+uint64_t vmm_resident(uint64_t *pml4, uint64_t virt_addr, uint64_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    struct resident_ctx rc = {.start = virt_addr & 0x0000FFFFFFFFFFFFULL, .bytes = 0};
+    rc.last = walk_last(rc.start, len);
+    (void)vmm_walk(pml4, virt_addr, len, resident_leaf, &rc);
+    return rc.bytes;
+}
+
+struct protect_ctx {
+    uint64_t flags;
+    uint64_t mask;
+    uint64_t changed;
+};
+
+static int protect_leaf(void *ctx, uint64_t virt_addr, uint64_t size, uint64_t *entry)
+{
+    (void)virt_addr;
+    (void)size;
+    struct protect_ctx *pc = (struct protect_ctx *)ctx;
+    uint64_t next = (*entry & ~pc->mask) | pc->flags;
+    if (next != *entry) {
+        *entry = next;
+        pc->changed++;
+    }
+    return 0;
+}
 
-    uint64_t pml4e = pml4[pml4_i];
-    uint64_t *pdpt = phys_to_ptr(pml4e & ~0xFFFULL);
+// Caller holds vmm_lock. Splits the huge leaf virt_addr falls inside of, unless it starts
+// there, so that a range operation beginning or ending at virt_addr stops exactly at it.
+// Returns false if the pool ran dry.
+static bool split_edge(uint64_t *pml4, uint64_t virt_addr, struct vmm_batch *batch)
+{
+    uint64_t pml4e = pml4[table_index(virt_addr, 39)];
+    if ((pml4e & PAGE_FLAG_PRESENT) == 0 || (virt_addr & (GIB - 1ULL)) == 0) {
+        return true;
+    }
+    uint64_t *pdpt = phys_to_ptr(pml4e & PAGE_ADDR_MASK);
+    uint16_t pdpt_i = table_index(virt_addr, 30);
     if ((pdpt[pdpt_i] & PAGE_FLAG_PRESENT) == 0) {
-        vmm_unlock();
-        return false;
+        return true;
     }
+    uint64_t *pd = phys_to_ptr(pdpt[pdpt_i] & PAGE_ADDR_MASK);
+    if ((pdpt[pdpt_i] & PAGE_FLAG_PS) != 0) {
+        pd = next_table(pdpt, pdpt_i, 0, NM_HUGE_PAGE_SIZE, batch, virt_addr);
+        if (pd == 0) {
+            return false;
+        }
+    }
+    uint16_t pd_i = table_index(virt_addr, 21);
+    if ((pd[pd_i] & PAGE_FLAG_PS) == 0 || (virt_addr & HUGE_MASK) == 0) {
+        return true;
+    }
+    return next_table(pd, pd_i, 0, PAGE_SIZE, batch, virt_addr) != 0;
+}
 
-    uint64_t pdpte = pdpt[pdpt_i];
-    uint64_t *pd = phys_to_ptr(pdpte & ~0xFFFULL);
-    if ((pd[pd_i] & PAGE_FLAG_PRESENT) == 0 || (pd[pd_i] & PAGE_FLAG_PS) != 0) {
-        vmm_unlock();
+bool vmm_protect(uint64_t *pml4, uint64_t virt_addr, uint64_t len, uint64_t flags, uint64_t mask)
+{
+    if (pml4 == 0 || len == 0 || ((virt_addr | len) & 0xFFFULL) != 0) {
         return false;
     }
+    struct protect_ctx pc = {.mask = mask & (PAGE_FLAG_RW | PAGE_FLAG_US | leaf_nx_mask), .changed = 0};
+    pc.flags = flags & pc.mask;
 
-    uint64_t pde = pd[pd_i];
-    uint64_t *pt = phys_to_ptr(pde & ~0xFFFULL);
-    pt[pt_i] = 0;
+    struct vmm_batch batch;
+    batch_init(&batch);
+    bool ok = true;
 
-    if (table_empty(pt)) {
-        uint64_t pt_phys = pde & ~0xFFFULL;
-        pd[pd_i] = 0;
-        to_free[free_count++] = pt_phys;
+    vmm_lock();
+    while (!split_edge(pml4, virt_addr, &batch) || !split_edge(pml4, virt_addr + len, &batch)) {
+        if (!batch_recharge(&batch)) {
+            ok = false;
+            break;
+        }
+    }
+    if (ok) {
+        // Tables above a leaf that gains RW or US have to allow it too.
+        uint64_t start = virt_addr & 0x0000FFFFFFFFFFFFULL;
+        (void)walk_level(pml4, 39, start, walk_last(start, len), protect_leaf, &pc, table_flags_from_leaf(pc.flags),
+                         &batch);
+        vmm_stats.leaves_protected += pc.changed;
+    }
+    batch_finish(&batch);
+    return ok;
+}
 
-        if (table_empty(pd)) {
-            uint64_t pd_phys = pdpte & ~0xFFFULL;
-            pdpt[pdpt_i] = 0;
-            to_free[free_count++] = pd_phys;
+// Caller holds vmm_lock. If the 2 MiB block at virt_addr is mapped by a page table whose
+// 512 leaves cover one aligned, physically contiguous block with the same attributes, the
+// table is swapped for a single huge leaf and retired. Returns the bytes covered: absent
+// PML4 and PDPT slots are skipped whole.
+static uint64_t collapse_step(uint64_t *pml4, uint64_t virt_addr, uint64_t len, struct vmm_batch *batch)
+{
+    uint64_t pml4e = pml4[table_index(virt_addr, 39)];
+    if ((pml4e & PAGE_FLAG_PRESENT) == 0) {
+        return span_left(virt_addr, PML4_SPAN, len);
+    }
+    uint64_t pdpte = phys_to_ptr(pml4e & PAGE_ADDR_MASK)[table_index(virt_addr, 30)];
+    if ((pdpte & (PAGE_FLAG_PRESENT | PAGE_FLAG_PS)) != PAGE_FLAG_PRESENT) {
+        return span_left(virt_addr, GIB, len);
+    }
+    uint64_t *pde = &phys_to_ptr(pdpte & PAGE_ADDR_MASK)[table_index(virt_addr, 21)];
+    if ((*pde & (PAGE_FLAG_PRESENT | PAGE_FLAG_PS)) != PAGE_FLAG_PRESENT) {
+        return NM_HUGE_PAGE_SIZE;
+    }
+    uint64_t pt_phys = *pde & PAGE_ADDR_MASK;
+    if ((pmm_phys_to_page(pt_phys)->flags & NM_PAGE_PGTABLE) == 0) {
+        return NM_HUGE_PAGE_SIZE;
+    }
 
-            if (table_empty(pdpt)) {
-                uint64_t pdpt_phys = pml4e & ~0xFFFULL;
-                pml4[pml4_i] = 0;
-                to_free[free_count++] = pdpt_phys;
-            }
+    // Bit 7 of a 4 KiB leaf is PAT, which a huge leaf keeps elsewhere; such runs stay.
+    const uint64_t *pt = phys_to_ptr(pt_phys);
+    uint64_t base = pt[0] & PAGE_ADDR_MASK;
+    uint64_t attrs = pt[0] & ~PAGE_ADDR_MASK & ~PTE_ACCESS_BITS;
+    if ((base & HUGE_MASK) != 0 || (attrs & (PAGE_FLAG_PRESENT | PAGE_FLAG_PS)) != PAGE_FLAG_PRESENT) {
+        return NM_HUGE_PAGE_SIZE;
+    }
+    uint64_t seen = 0;
+    for (uint64_t i = 0; i < 512; i++) {
+        if ((pt[i] & ~PTE_ACCESS_BITS) != ((base + i * PAGE_SIZE) | attrs)) {
+            return NM_HUGE_PAGE_SIZE;
         }
+        seen |= pt[i] & PTE_ACCESS_BITS;
     }
+    *pde = base | attrs | seen | PAGE_FLAG_PS;
+    batch->retired[batch->retired_count++] = pt_phys;
+    batch_mark(batch, virt_addr, NM_HUGE_PAGE_SIZE);
+    vmm_stats.tables_freed++;
+    vmm_stats.huge_collapsed++;
+    return NM_HUGE_PAGE_SIZE;
+}
 
-    __asm__ volatile("invlpg (%0)" : : "r"((void *)(uintptr_t)virt_addr) : "memory");
-    vmm_unlock();
+bool vmm_advise(uint64_t *pml4, uint64_t virt_addr, uint64_t len, enum nm_madvise advice)
+{
+    if (pml4 == 0 || len == 0 || ((virt_addr | len) & 0xFFFULL) != 0) {
+        return false;
+    }
+    bool unmapped;
+    switch (advice) {
+    case NM_MADV_DONTNEED:
+        return unmap_range(pml4, virt_addr, len, true, &unmapped);
+    case NM_MADV_WILLNEED:
+        // A bare page table has nothing to read ahead from; mm_advise populates areas.
+        return true;
+    case NM_MADV_HUGEPAGE:
+        break;
+    default:
+        return false;
+    }
+
+    struct vmm_batch batch;
+    batch_init(&batch);
+    uint64_t done = (NM_HUGE_PAGE_SIZE - (virt_addr & HUGE_MASK)) & HUGE_MASK;
 
-    for (size_t i = 0; i < free_count; i++) {
-        pmm_free_page(to_free[i]);
+    vmm_lock();
+    while (done <= len && len - done >= NM_HUGE_PAGE_SIZE) {
+        if (batch.retired_count == VMM_BATCH_FRAMES) {
+            batch_flush(&batch);
+            vmm_unlock();
+            batch_release(&batch);
+            vmm_lock();
+        }
+        done += collapse_step(pml4, virt_addr + done, len - done, &batch);
     }
+    batch_finish(&batch);
     return true;
 }
 
+bool vmm_map_page_in(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags)
+{
+    return vmm_map_range(pml4, virt_addr & ~0xFFFULL, phys_addr & ~0xFFFULL, PAGE_SIZE, flags);
+}
+
+bool vmm_map_2m_in(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags)
+{
+    return vmm_map_range(pml4, virt_addr & ~HUGE_MASK, phys_addr & ~HUGE_MASK, NM_HUGE_PAGE_SIZE, flags);
+}
+
+bool vmm_unmap_page_in(uint64_t *pml4, uint64_t virt_addr)
+{
+    return vmm_unmap_range(pml4, virt_addr & ~0xFFFULL, PAGE_SIZE);
+}
+
 bool vmm_map_page(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags)
 {
     return vmm_map_page_in(kernel_pml4, virt_addr, phys_addr, flags);
@@ -5,10 +5,13 @@
 
 #include "nm/errno.h"
 #include "nm/fs.h"
+#include "nm/mm.h"
+#include "nm/string.h"
 
 #define NM_PIPE_MAX 16
 #define NM_PIPE_BUF 512
-#define NM_FDOBJ_MAX 128
+#define NM_FDOBJ_INITIAL 16U
+#define NM_FDOBJ_SPARE_MAX 8
 
 enum nm_fdobj_kind {
     NM_FDOBJ_NONE = 0,
@@ -27,15 +30,25 @@ struct nm_pipe {
 };
 
 struct nm_fdobj {
-    int used;
     uint32_t refcnt;
     enum nm_fdobj_kind kind;
     int32_t fs_fd;
     int32_t pipe_id;
+    struct nm_fdobj *next_spare;
 };
 
 static struct nm_pipe pipe_table[NM_PIPE_MAX];
-static struct nm_fdobj fdobj_table[NM_FDOBJ_MAX];
+// fd objects come from fdobj_cache and are found by id through fdobj_table, which doubles
+// when the free-id stack runs dry. The heap takes kheap_lock, which orders before fd_lock, so
+// entry points grow the table and top up fdobj_spare before locking, and released objects wait
+// there until fdobj_trim() returns the surplus after unlock.
+static struct kmem_cache *fdobj_cache;
+static struct nm_fdobj **fdobj_table;
+static int32_t *fdobj_free_ids;
+static uint32_t fdobj_capacity;
+static uint32_t fdobj_free_top;
+static struct nm_fdobj *fdobj_spare;
+static uint32_t fdobj_spare_count;
 static volatile uint32_t fd_lock_word;
 
 static inline void fd_lock(void)
@@ -63,30 +76,134 @@ static int alloc_task_fd(const struct nm_task *task)
     return NM_ERR(NM_ENOMEM);
 }
 
-static int alloc_fdobj(void)
+static void spare_push(struct nm_fdobj *obj)
 {
-    for (int i = 0; i < NM_FDOBJ_MAX; i++) {
-        if (!fdobj_table[i].used) {
-            fdobj_table[i].used = 1;
-            fdobj_table[i].refcnt = 0;
-            fdobj_table[i].kind = NM_FDOBJ_NONE;
-            fdobj_table[i].fs_fd = -1;
-            fdobj_table[i].pipe_id = -1;
-            return i;
+    obj->next_spare = fdobj_spare;
+    fdobj_spare = obj;
+    fdobj_spare_count++;
+}
+
+// Called without fd_lock. Returns 0 when the table grew, or another caller grew it first.
+static int fdobj_grow(void)
+{
+    uint32_t cap = __atomic_load_n(&fdobj_capacity, __ATOMIC_RELAXED);
+    if (cap > (uint32_t)INT32_MAX / 2U) {
+        return NM_ERR(NM_ENOMEM);
+    }
+    uint32_t new_cap = cap == 0 ? NM_FDOBJ_INITIAL : cap * 2U;
+    struct nm_fdobj **table = (struct nm_fdobj **)kmalloc(new_cap * sizeof(*table));
+    int32_t *ids = (int32_t *)kmalloc(new_cap * sizeof(*ids));
+    if (table == 0 || ids == 0) {
+        kfree(table);
+        kfree(ids);
+        return NM_ERR(NM_ENOMEM);
+    }
+
+    fd_lock();
+    if (fdobj_capacity != cap) {
+        fd_unlock();
+        kfree(table);
+        kfree(ids);
+        return 0;
+    }
+
+    if (cap != 0) {
+        memcpy(table, fdobj_table, cap * sizeof(*table));
+    }
+    memset(&table[cap], 0, (new_cap - cap) * sizeof(*table));
+    // New ids go under the remaining free ones, lowest on top, so low ids are reused first.
+    uint32_t top = 0;
+    for (uint32_t id = new_cap; id > cap; id--) {
+        ids[top++] = (int32_t)(id - 1U);
+    }
+    if (fdobj_free_top != 0) {
+        memcpy(&ids[top], fdobj_free_ids, fdobj_free_top * sizeof(*ids));
+    }
+
+    struct nm_fdobj **old_table = fdobj_table;
+    int32_t *old_ids = fdobj_free_ids;
+    fdobj_table = table;
+    fdobj_free_ids = ids;
+    fdobj_free_top += top;
+    fdobj_capacity = new_cap;
+    fd_unlock();
+
+    kfree(old_table);
+    kfree(old_ids);
+    return 0;
+}
+
+// Called without fd_lock. The unlocked counts are only hints; a racing caller that finds no
+// spare object or free id under the lock fails with ENOMEM.
+static void fdobj_reserve(uint32_t want)
+{
+    while (__atomic_load_n(&fdobj_free_top, __ATOMIC_RELAXED) < want) {
+        if (fdobj_grow() != 0) {
+            return;
         }
     }
-    return NM_ERR(NM_ENOMEM);
+    while (__atomic_load_n(&fdobj_spare_count, __ATOMIC_RELAXED) < want) {
+        struct nm_fdobj *obj = (struct nm_fdobj *)kmem_cache_alloc(fdobj_cache);
+        if (obj == 0) {
+            return;
+        }
+        fd_lock();
+        spare_push(obj);
+        fd_unlock();
+    }
 }
 
-static struct nm_fdobj *fdobj_get(int32_t id)
+// Called without fd_lock.
+static void fdobj_trim(void)
 {
-    if (id < 0 || id >= NM_FDOBJ_MAX) {
-        return 0;
+    if (__atomic_load_n(&fdobj_spare_count, __ATOMIC_RELAXED) <= NM_FDOBJ_SPARE_MAX) {
+        return;
+    }
+
+    struct nm_fdobj *surplus = 0;
+    fd_lock();
+    while (fdobj_spare_count > NM_FDOBJ_SPARE_MAX) {
+        struct nm_fdobj *obj = fdobj_spare;
+        fdobj_spare = obj->next_spare;
+        fdobj_spare_count--;
+        obj->next_spare = surplus;
+        surplus = obj;
+    }
+    fd_unlock();
+
+    while (surplus != 0) {
+        struct nm_fdobj *next = surplus->next_spare;
+        kmem_cache_free(fdobj_cache, surplus);
+        surplus = next;
     }
-    if (!fdobj_table[id].used) {
+}
+
+static int alloc_fdobj(void)
+{
+    if (fdobj_spare == 0 || fdobj_free_top == 0) {
+        return NM_ERR(NM_ENOMEM);
+    }
+
+    struct nm_fdobj *obj = fdobj_spare;
+    fdobj_spare = obj->next_spare;
+    fdobj_spare_count--;
+
+    int32_t id = fdobj_free_ids[--fdobj_free_top];
+    obj->refcnt = 0;
+    obj->kind = NM_FDOBJ_NONE;
+    obj->fs_fd = -1;
+    obj->pipe_id = -1;
+    obj->next_spare = 0;
+    fdobj_table[id] = obj;
+    return id;
+}
+
+static struct nm_fdobj *fdobj_get(int32_t id)
+{
+    if (id < 0 || (uint32_t)id >= fdobj_capacity) {
         return 0;
     }
-    return &fdobj_table[id];
+    return fdobj_table[id];
 }
 
 static void pipe_on_endpoint_acquire(enum nm_fdobj_kind kind, int32_t pipe_id)
@@ -161,10 +278,9 @@ static int fdobj_release(int32_t id)
         (void)fs_close(obj->fs_fd);
     }
 
-    obj->used = 0;
-    obj->kind = NM_FDOBJ_NONE;
-    obj->fs_fd = -1;
-    obj->pipe_id = -1;
+    fdobj_table[id] = 0;
+    fdobj_free_ids[fdobj_free_top++] = id;
+    spare_push(obj);
     return 0;
 }
 
@@ -211,7 +327,7 @@ static int create_pipe_endpoint_obj(enum nm_fdobj_kind kind, int32_t pipe_id)
         return NM_ERR(NM_ENOMEM);
     }
 
-    struct nm_fdobj *obj = &fdobj_table[obj_id];
+    struct nm_fdobj *obj = fdobj_table[obj_id];
     obj->kind = kind;
     obj->pipe_id = pipe_id;
     obj->refcnt = 1;
@@ -225,7 +341,7 @@ static int create_fs_obj(int32_t fs_fd)
         return NM_ERR(NM_ENOMEM);
     }
 
-    struct nm_fdobj *obj = &fdobj_table[obj_id];
+    struct nm_fdobj *obj = fdobj_table[obj_id];
     obj->kind = NM_FDOBJ_FS;
     obj->fs_fd = fs_fd;
     obj->refcnt = 1;
@@ -307,7 +423,7 @@ static int64_t write_to_fdobj(struct nm_fdobj *obj, const void *buf, uint64_t le
 static int adopt_legacy_fs_fd(struct nm_task *task, int32_t fd)
 {
     int32_t legacy = task_fdobj_id(task, fd);
-    if (legacy < 0 || legacy >= NM_FDOBJ_MAX) {
+    if (legacy < 0 || legacy >= NM_FD_MAX) {
         return NM_ERR(NM_EINVAL);
     }
 
@@ -327,6 +443,10 @@ static int adopt_legacy_fs_fd(struct nm_task *task, int32_t fd)
 
 void nm_fd_init(void)
 {
+    if (fdobj_cache == 0) {
+        fdobj_cache = kmem_cache_create("fdobj", sizeof(struct nm_fdobj), 0, 0);
+    }
+
     fd_lock_word = 0;
     fd_lock();
     for (size_t i = 0; i < NM_PIPE_MAX; i++) {
@@ -337,18 +457,22 @@ void nm_fd_init(void)
         pipe_table[i].writers = 0;
     }
 
-    for (size_t i = 0; i < NM_FDOBJ_MAX; i++) {
-        fdobj_table[i].used = 0;
-        fdobj_table[i].refcnt = 0;
-        fdobj_table[i].kind = NM_FDOBJ_NONE;
-        fdobj_table[i].fs_fd = -1;
-        fdobj_table[i].pipe_id = -1;
+    // Pushed in reverse so the lowest ids are handed out first.
+    fdobj_free_top = 0;
+    for (uint32_t i = fdobj_capacity; i > 0; i--) {
+        if (fdobj_table[i - 1U] != 0) {
+            spare_push(fdobj_table[i - 1U]);
+            fdobj_table[i - 1U] = 0;
+        }
+        fdobj_free_ids[fdobj_free_top++] = (int32_t)(i - 1U);
     }
     fd_unlock();
+    fdobj_trim();
 }
 
 int64_t nm_fd_read(struct nm_task *task, int32_t fd, void *buf, uint64_t len)
 {
+    fdobj_reserve(1);
     fd_lock();
     if (task == 0 || buf == 0) {
         fd_unlock();
@@ -361,7 +485,7 @@ int64_t nm_fd_read(struct nm_task *task, int32_t fd, void *buf, uint64_t len)
         return NM_ERR(NM_ENOENT);
     }
 
-    if (obj_id >= 0 && obj_id < NM_FDOBJ_MAX) {
+    if (obj_id >= 0) {
         struct nm_fdobj *obj = fdobj_get(obj_id);
         if (obj != 0) {
             int64_t ret = read_from_fdobj(obj, buf, len);
@@ -386,6 +510,7 @@ int64_t nm_fd_read(struct nm_task *task, int32_t fd, void *buf, uint64_t len)
 
 int64_t nm_fd_write(struct nm_task *task, int32_t fd, const void *buf, uint64_t len)
 {
+    fdobj_reserve(1);
     fd_lock();
     if (task == 0 || buf == 0) {
         fd_unlock();
@@ -398,7 +523,7 @@ int64_t nm_fd_write(struct nm_task *task, int32_t fd, const void *buf, uint64_t
         return NM_ERR(NM_ENOENT);
     }
 
-    if (obj_id >= 0 && obj_id < NM_FDOBJ_MAX) {
+    if (obj_id >= 0) {
         struct nm_fdobj *obj = fdobj_get(obj_id);
         if (obj != 0) {
             int64_t ret = write_to_fdobj(obj, buf, len);
@@ -423,6 +548,7 @@ int64_t nm_fd_write(struct nm_task *task, int32_t fd, const void *buf, uint64_t
 
 int nm_fd_close(struct nm_task *task, int32_t fd)
 {
+    fdobj_reserve(1);
     fd_lock();
     if (task == 0 || fd < 0 || fd >= NM_MAX_FDS) {
         fd_unlock();
@@ -435,7 +561,7 @@ int nm_fd_close(struct nm_task *task, int32_t fd)
         return NM_ERR(NM_ENOENT);
     }
 
-    if (obj_id >= 0 && obj_id < NM_FDOBJ_MAX && fdobj_get(obj_id) == 0) {
+    if (obj_id >= 0 && obj_id < NM_FD_MAX && fdobj_get(obj_id) == 0) {
         if (adopt_legacy_fs_fd(task, fd) < 0) {
             fd_unlock();
             return NM_ERR(NM_EFAIL);
@@ -444,11 +570,13 @@ int nm_fd_close(struct nm_task *task, int32_t fd)
 
     int ret = task_close_fd(task, fd);
     fd_unlock();
+    fdobj_trim();
     return ret;
 }
 
 int nm_fd_pipe(struct nm_task *task, int32_t *read_fd, int32_t *write_fd)
 {
+    fdobj_reserve(2);
     fd_lock();
     if (task == 0 || read_fd == 0 || write_fd == 0) {
         fd_unlock();
@@ -505,6 +633,7 @@ int nm_fd_pipe(struct nm_task *task, int32_t *read_fd, int32_t *write_fd)
         pipe_table[pipe_id].readers = 0;
         pipe_table[pipe_id].writers = 0;
         fd_unlock();
+        fdobj_trim();
         return NM_ERR(NM_ENOMEM);
     }
 
@@ -550,6 +679,7 @@ int64_t nm_fd_dup2(struct nm_task *task, int32_t oldfd, int32_t newfd)
     (void)task_install_fdobj(task, newfd, old_obj);
     task->fd_cloexec_mask &= ~(1U << (uint32_t)newfd);
     fd_unlock();
+    fdobj_trim();
     return newfd;
 }
 
@@ -609,6 +739,12 @@ void nm_fd_close_on_exec(struct nm_task *task)
         return;
     }
 
+    // Enough spares to adopt every legacy descriptor being closed.
+    uint32_t closing = 0;
+    for (uint32_t mask = task->fd_cloexec_mask; mask != 0; mask &= mask - 1U) {
+        closing++;
+    }
+    fdobj_reserve(closing);
     fd_lock();
     for (int fd = 0; fd < NM_MAX_FDS; fd++) {
         uint32_t bit = 1U << (uint32_t)fd;
@@ -622,7 +758,7 @@ void nm_fd_close_on_exec(struct nm_task *task)
             continue;
         }
 
-        if (obj_id >= 0 && obj_id < NM_FDOBJ_MAX && fdobj_get(obj_id) == 0) {
+        if (obj_id >= 0 && obj_id < NM_FD_MAX && fdobj_get(obj_id) == 0) {
             if (adopt_legacy_fs_fd(task, fd) < 0) {
                 continue;
             }
@@ -631,4 +767,5 @@ void nm_fd_close_on_exec(struct nm_task *task)
         (void)task_close_fd(task, fd);
     }
     fd_unlock();
+    fdobj_trim();
 }
@@ -3,12 +3,27 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "nm/cpu.h"
+#include "nm/mm.h"
+
+// One FIFO per priority level; lower numbers run first, as they weigh more under CFS.
+#define SCHED_PRIOS 40U
+
 #ifndef NEVERMIND_HOST_TEST
 extern void nm_context_switch(uint64_t **old_rsp, uint64_t *new_rsp);
 #endif
 
+struct run_queue {
+    struct nm_task *head;
+    struct nm_task *tail;
+};
+
 static enum nm_sched_policy global_policy = NM_SCHED_RR;
-static size_t rr_cursor;
+// Bit n is set while run_queues[n] is non-empty. rq_lock is a leaf taken with interrupts
+// off, since the timer tick moves tasks between queues too.
+static struct run_queue run_queues[SCHED_PRIOS];
+static uint64_t rq_bitmap;
+static volatile uint32_t rq_lock_word;
 
 static uint32_t priority_weight(uint32_t priority)
 {
@@ -18,10 +33,103 @@ static uint32_t priority_weight(uint32_t priority)
     return 40U - priority;
 }
 
+static inline uint64_t rq_lock(void)
+{
+    uint64_t flags = cpu_irq_save();
+    while (__sync_lock_test_and_set(&rq_lock_word, 1U) != 0U) {
+        __asm__ volatile("pause");
+    }
+    return flags;
+}
+
+static inline void rq_unlock(uint64_t flags)
+{
+    __sync_lock_release(&rq_lock_word);
+    cpu_irq_restore(flags);
+}
+
+static inline uint32_t queue_index(const struct nm_task *task)
+{
+    return task->sched.priority < SCHED_PRIOS ? task->sched.priority : SCHED_PRIOS - 1U;
+}
+
+// Caller holds rq_lock.
+static void rq_push_tail(struct nm_task *task, uint32_t index)
+{
+    struct run_queue *rq = &run_queues[index];
+    task->rq_index = index;
+    task->rq_next = 0;
+    task->rq_prev = rq->tail;
+    if (rq->tail != 0) {
+        rq->tail->rq_next = task;
+    } else {
+        rq->head = task;
+    }
+    rq->tail = task;
+    task->on_rq = true;
+    rq_bitmap |= 1ULL << index;
+}
+
+// Caller holds rq_lock.
+static void rq_unlink(struct nm_task *task)
+{
+    struct run_queue *rq = &run_queues[task->rq_index];
+    if (task->rq_prev != 0) {
+        task->rq_prev->rq_next = task->rq_next;
+    } else {
+        rq->head = task->rq_next;
+    }
+    if (task->rq_next != 0) {
+        task->rq_next->rq_prev = task->rq_prev;
+    } else {
+        rq->tail = task->rq_prev;
+    }
+    if (rq->head == 0) {
+        rq_bitmap &= ~(1ULL << task->rq_index);
+    }
+    task->rq_next = 0;
+    task->rq_prev = 0;
+    task->on_rq = false;
+}
+
+void sched_rq_reset(void)
+{
+    uint64_t flags = rq_lock();
+    for (uint32_t i = 0; i < SCHED_PRIOS; i++) {
+        run_queues[i].head = 0;
+        run_queues[i].tail = 0;
+    }
+    rq_bitmap = 0;
+    rq_unlock(flags);
+}
+
+void sched_enqueue(struct nm_task *task)
+{
+    if (task == 0) {
+        return;
+    }
+    uint64_t flags = rq_lock();
+    if (!task->on_rq && task->state == NM_TASK_RUNNABLE) {
+        rq_push_tail(task, queue_index(task));
+    }
+    rq_unlock(flags);
+}
+
+void sched_dequeue(struct nm_task *task)
+{
+    if (task == 0) {
+        return;
+    }
+    uint64_t flags = rq_lock();
+    if (task->on_rq) {
+        rq_unlink(task);
+    }
+    rq_unlock(flags);
+}
+
 void sched_init(enum nm_sched_policy policy)
 {
     global_policy = policy;
-    rr_cursor = 0;
 }
 
 void sched_set_policy(enum nm_sched_policy policy)
@@ -34,20 +142,32 @@ enum nm_sched_policy sched_get_policy(void)
     return global_policy;
 }
 
+// A queued task that has never been switched out (the bootstrap task, before its first
+// switch) has no stack to resume and is passed over.
+static inline bool rq_eligible(const struct nm_task *task, const struct nm_task *cur)
+{
+    return task == cur || task->saved_rsp != 0;
+}
+
+// The head of the highest non-empty priority, rotated to the tail of its queue so that
+// repeated picks take turns. The running task is not queued and is only the fallback.
 static struct nm_task *pick_rr(void)
 {
     struct nm_task *cur = task_current();
-    for (size_t probe = 0; probe < 128; probe++) {
-        size_t idx = (rr_cursor + probe) % 128;
-        struct nm_task *task = task_by_index(idx);
-        if (task != 0 &&
-            (task->state == NM_TASK_RUNNABLE || task->state == NM_TASK_RUNNING) &&
-            (task == cur || task->saved_rsp != 0)) {
-            rr_cursor = (idx + 1) % 128;
-            return task;
+    uint64_t flags = rq_lock();
+    for (uint64_t pending = rq_bitmap; pending != 0; pending &= pending - 1ULL) {
+        uint32_t index = (uint32_t)__builtin_ctzll(pending);
+        for (struct nm_task *task = run_queues[index].head; task != 0; task = task->rq_next) {
+            if (rq_eligible(task, cur)) {
+                rq_unlink(task);
+                rq_push_tail(task, index);
+                rq_unlock(flags);
+                return task;
+            }
         }
     }
-    return task_current();
+    rq_unlock(flags);
+    return cur;
 }
 
 static struct nm_task *pick_cfs(void)
@@ -55,50 +175,39 @@ static struct nm_task *pick_cfs(void)
     struct nm_task *best = 0;
     struct nm_task *cur = task_current();
 
-    for (size_t idx = 0; idx < 128; idx++) {
-        struct nm_task *task = task_by_index(idx);
-        if (task == 0) {
-            continue;
-        }
-        if (task->state != NM_TASK_RUNNABLE) {
-            continue;
-        }
-
-        if (task != cur && task->saved_rsp == 0) {
-            continue;
-        }
-
-        if (best == 0 || task->sched.vruntime < best->sched.vruntime) {
-            best = task;
+    uint64_t flags = rq_lock();
+    for (uint64_t pending = rq_bitmap; pending != 0; pending &= pending - 1ULL) {
+        for (struct nm_task *task = run_queues[__builtin_ctzll(pending)].head; task != 0; task = task->rq_next) {
+            if (rq_eligible(task, cur) && (best == 0 || task->sched.vruntime < best->sched.vruntime)) {
+                best = task;
+            }
         }
     }
+    rq_unlock(flags);
 
-    if (best != 0) {
-        return best;
+    if (best == 0) {
+        best = cur;
     }
+    return best;
+}
 
-    for (size_t idx = 0; idx < 128; idx++) {
-        struct nm_task *task = task_by_index(idx);
-        if (task == 0) {
-            continue;
-        }
-        if (task->state != NM_TASK_RUNNING) {
-            continue;
-        }
-
-        if (task != cur && task->saved_rsp == 0) {
-            continue;
-        }
-
-        if (best == 0 || task->sched.vruntime < best->sched.vruntime) {
-            best = task;
-        }
+// Hand the CPU from cur to next: next leaves its queue, and cur joins the tail of its own
+// unless it stopped being runnable (an exited task stays off the queues).
+static void switch_queues(struct nm_task *cur, struct nm_task *next)
+{
+    uint64_t flags = rq_lock();
+    if (next->on_rq) {
+        rq_unlink(next);
     }
-
-    if (best == 0) {
-        best = task_current();
+    next->state = NM_TASK_RUNNING;
+    if (cur->state == NM_TASK_RUNNING || cur->state == NM_TASK_RUNNABLE) {
+        cur->state = NM_TASK_RUNNABLE;
+        if (!cur->on_rq) {
+            rq_push_tail(cur, queue_index(cur));
+        }
     }
-    return best;
+    rq_unlock(flags);
+    proc_set_current(next);
 }
 
 struct nm_task *sched_pick_next(void)
@@ -141,9 +250,7 @@ void sched_tick(uint64_t ticks)
         return;
     }
 
-    cur->state = NM_TASK_RUNNABLE;
-    next->state = NM_TASK_RUNNING;
-    proc_set_current(next);
+    switch_queues(cur, next);
 }
 
 void sched_yield(void)
@@ -158,12 +265,11 @@ void sched_yield(void)
         return;
     }
 
-    cur->state = NM_TASK_RUNNABLE;
-    next->state = NM_TASK_RUNNING;
-    proc_set_current(next);
+    switch_queues(cur, next);
 
 #ifndef NEVERMIND_HOST_TEST
     if (next->saved_rsp != 0) {
+        (void)mm_switch(next->mm);
         nm_context_switch(&cur->saved_rsp, next->saved_rsp);
     }
 #endif
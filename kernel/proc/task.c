@@ -5,9 +5,12 @@
 
 #include "nm/errno.h"
 #include "nm/mm.h"
+#include "nm/string.h"
 
 #define NM_MAX_TASKS 128
 #define KSTACK_SIZE 8192
+// Upper bound on the name, argv and envp strings plus pointer arrays one exec copies in.
+#define EXEC_ARGS_MAX 16384U
 
 static struct nm_task task_table[NM_MAX_TASKS];
 static size_t task_used;
@@ -80,7 +83,9 @@ static uint8_t *alloc_task_stack(void)
     }
     return host_stacks[host_stack_cursor++];
 #else
-    return (uint8_t *)kmalloc(KSTACK_SIZE);
+    // Built from single frames, with an unmapped page below. An overflow cannot push the
+    // #PF frame there, so it ends in #DF, which runs on its own IST stack.
+    return (uint8_t *)vmalloc_flags(KSTACK_SIZE, NM_VMALLOC_GUARD);
 #endif
 }
 
@@ -97,7 +102,11 @@ void proc_init(void)
         task_table[i].envc = 0;
         task_table[i].sched.rr_budget = 0;
         task_table[i].saved_rsp = 0;
+        task_table[i].mm = 0;
+        task_table[i].on_rq = false;
+        task_table[i].exec_args = 0;
     }
+    sched_rq_reset();
     task_used = 0;
     next_pid = 1;
     current_task = 0;
@@ -123,6 +132,7 @@ void proc_init(void)
     bootstrap->argc = 0;
     bootstrap->envc = 0;
     bootstrap->saved_rsp = 0;
+    bootstrap->mm = mm_kernel();
     copy_name(bootstrap->name, "bootstrap", NM_TASK_NAME_MAX);
     for (size_t i = 0; i < NM_MAX_FDS; i++) {
         bootstrap->fd_table[i] = -1;
@@ -144,7 +154,7 @@ struct nm_task *task_create_kernel_thread(const char *name, void (*entry)(void *
     if (task == 0) {
         proc_unlock();
 #ifndef NEVERMIND_HOST_TEST
-        kfree(kstack);
+        vfree(kstack);
 #endif
         return 0;
     }
@@ -162,6 +172,8 @@ struct nm_task *task_create_kernel_thread(const char *name, void (*entry)(void *
     task->argc = 0;
     task->envc = 0;
     task->kernel_stack_top = (uint64_t *)(uintptr_t)(kstack + KSTACK_SIZE);
+    task->mm = mm_kernel();
+    task->exec_args = 0;
 
 #ifndef NEVERMIND_HOST_TEST
     uint64_t *sp = task->kernel_stack_top;
@@ -194,6 +206,7 @@ struct nm_task *task_create_kernel_thread(const char *name, void (*entry)(void *
     }
 
     task_used++;
+    sched_enqueue(task);
     proc_unlock();
     return task;
 }
@@ -270,6 +283,8 @@ struct nm_task *proc_fork_current(void)
         proc_unlock();
         return 0;
     }
+    // The parent is the caller, so its address space outlives this function.
+    struct nm_mm *parent_mm = current_task->mm;
 
     proc_unlock();
 
@@ -277,12 +292,21 @@ struct nm_task *proc_fork_current(void)
     if (kstack == 0) {
         return 0;
     }
+    // Cloning takes the mm, heap and page-table locks, all ordered before proc_lock.
+    struct nm_mm *child_mm = mm_fork(parent_mm);
+    if (child_mm == 0 && parent_mm != 0) {
+#ifndef NEVERMIND_HOST_TEST
+        vfree(kstack);
+#endif
+        return 0;
+    }
 
     proc_lock();
     if (current_task == 0 || child->state != NM_TASK_UNUSED) {
         proc_unlock();
+        mm_put(child_mm);
 #ifndef NEVERMIND_HOST_TEST
-        kfree(kstack);
+        vfree(kstack);
 #endif
         return 0;
     }
@@ -297,32 +321,140 @@ struct nm_task *proc_fork_current(void)
     child->regs.rsp = (uint64_t)(uintptr_t)child->kernel_stack_top;
     child->regs.rax = 0;
     child->saved_rsp = child->kernel_stack_top;
+    child->mm = child_mm;
+    child->on_rq = false;
+    // The exec argument block stays with the parent.
+    child->exec_args = 0;
+    child->entry_name = child->name;
 
     task_used++;
+    sched_enqueue(child);
     proc_unlock();
     return child;
 }
 
+// The name, argv and envp of an exec, copied out of the caller's address space before
+// exec throws it away. One allocation: the two pointer arrays, then the strings.
+struct exec_args {
+    const char *name;
+    const char **argv;
+    const char **envp;
+};
+
+static size_t string_size(const char *str)
+{
+    size_t len = 0;
+    while (len < EXEC_ARGS_MAX && str[len] != '\0') {
+        len++;
+    }
+    return len + 1;
+}
+
+static char *copy_string(char **cursor, const char *str)
+{
+    size_t size = string_size(str);
+    char *dst = *cursor;
+    memcpy(dst, str, size - 1);
+    dst[size - 1] = '\0';
+    *cursor += size;
+    return dst;
+}
+
+static struct exec_args *exec_args_copy(const char *name, const char *const *argv, uint32_t argc,
+                                        const char *const *envp, uint32_t envc)
+{
+    size_t size = sizeof(struct exec_args) + (argc + envc + 2U) * sizeof(char *) + string_size(name);
+    for (uint32_t i = 0; i < argc; i++) {
+        size += string_size(argv[i]);
+    }
+    for (uint32_t i = 0; i < envc; i++) {
+        size += string_size(envp[i]);
+    }
+    if (size > EXEC_ARGS_MAX) {
+        return 0;
+    }
+
+    struct exec_args *args = (struct exec_args *)kmalloc(size);
+    if (args == 0) {
+        return 0;
+    }
+    args->argv = (const char **)(args + 1);
+    args->envp = args->argv + argc + 1;
+    char *cursor = (char *)(args->envp + envc + 1);
+    args->name = copy_string(&cursor, name);
+    for (uint32_t i = 0; i < argc; i++) {
+        args->argv[i] = copy_string(&cursor, argv[i]);
+    }
+    args->argv[argc] = 0;
+    for (uint32_t i = 0; i < envc; i++) {
+        args->envp[i] = copy_string(&cursor, envp[i]);
+    }
+    args->envp[envc] = 0;
+    return args;
+}
+
+// Everything that can fail happens before the task is touched: the arguments are copied
+// into kernel memory and a fresh address space is built while the caller's is still
+// loaded. exec starts from an empty user half, so a forked child drops its copy-on-write
+// view of the parent last, and fork+exec never copies a page.
 int proc_exec_current(const char *name, uint64_t entry, const char *const *argv,
                       const char *const *envp)
 {
+    if (name == 0) {
+        return NM_ERR(NM_EFAIL);
+    }
+    uint32_t argc = count_ptr_vector(argv);
+    uint32_t envc = count_ptr_vector(envp);
+    struct exec_args *args = exec_args_copy(name, argv, argc, envp, envc);
+    if (args == 0) {
+        return NM_ERR(NM_ENOMEM);
+    }
+
     proc_lock();
-    if (current_task == 0 || name == 0) {
+    struct nm_mm *old = current_task != 0 ? current_task->mm : 0;
+    proc_unlock();
+    struct nm_mm *fresh = 0;
+    if (old != 0 && old != mm_kernel()) {
+        fresh = mm_create();
+        if (fresh == 0) {
+            kfree(args);
+            return NM_ERR(NM_ENOMEM);
+        }
+    }
+
+    proc_lock();
+    if (current_task == 0 || current_task->mm != old) {
         proc_unlock();
+        mm_put(fresh);
+        kfree(args);
         return NM_ERR(NM_EFAIL);
     }
 
-    current_task->entry_name = name;
-    copy_name(current_task->name, name, NM_TASK_NAME_MAX);
-    current_task->argc = count_ptr_vector(argv);
-    current_task->envc = count_ptr_vector(envp);
-    current_task->regs.rdi = (uint64_t)current_task->argc;
-    current_task->regs.rsi = (uint64_t)(uintptr_t)argv;
-    current_task->regs.rdx = (uint64_t)(uintptr_t)envp;
+    struct exec_args *old_args = (struct exec_args *)current_task->exec_args;
+    current_task->exec_args = args;
+    current_task->entry_name = args->name;
+    copy_name(current_task->name, args->name, NM_TASK_NAME_MAX);
+    current_task->argc = argc;
+    current_task->envc = envc;
+    current_task->regs.rdi = (uint64_t)argc;
+    current_task->regs.rsi = argv != 0 ? (uint64_t)(uintptr_t)args->argv : 0;
+    current_task->regs.rdx = envp != 0 ? (uint64_t)(uintptr_t)args->envp : 0;
     if (entry != 0) {
         current_task->regs.rip = entry;
     }
+    if (fresh != 0) {
+        current_task->mm = fresh;
+    }
     proc_unlock();
+
+    // Page tables and the heap take locks ordered before proc_lock.
+    if (fresh != 0) {
+        (void)mm_switch(fresh);
+        mm_put(old);
+    }
+    if (old_args != 0) {
+        kfree(old_args);
+    }
     return 0;
 }
 
@@ -335,6 +467,7 @@ void proc_exit_current(int32_t code)
     }
     current_task->exit_code = code;
     current_task->state = NM_TASK_ZOMBIE;
+    sched_dequeue(current_task);
     proc_unlock();
 }
 
@@ -372,6 +505,10 @@ int32_t proc_waitpid(int32_t pid, int32_t *status)
     }
 
     int32_t found_pid = match->pid;
+    struct nm_mm *mm = match->mm;
+    void *args = match->exec_args;
+    match->mm = 0;
+    match->exec_args = 0;
     match->state = NM_TASK_UNUSED;
     match->pid = 0;
     match->ppid = 0;
@@ -381,5 +518,10 @@ int32_t proc_waitpid(int32_t pid, int32_t *status)
         task_used--;
     }
     proc_unlock();
+    // Dropping the last reference frees page tables, which takes locks ordered before proc_lock.
+    mm_put(mm);
+    if (args != 0) {
+        kfree(args);
+    }
     return found_pid;
 }
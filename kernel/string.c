@@ -2,9 +2,16 @@
 
 void *memset(void *dest, int value, size_t count)
 {
-    unsigned char *ptr = (unsigned char *)dest;
-    for (size_t i = 0; i < count; i++) {
-        ptr[i] = (unsigned char)value;
-    }
+    // `rep stosb` is fast-string accelerated on every x86_64 we target and keeps the
+    // compiler from turning a plain byte loop back into a call to memset itself.
+    void *ptr = dest;
+    __asm__ volatile("rep stosb" : "+D"(ptr), "+c"(count) : "a"(value) : "memory");
+    return dest;
+}
+
+void *memcpy(void *dest, const void *src, size_t count)
+{
+    void *ptr = dest;
+    __asm__ volatile("rep movsb" : "+D"(ptr), "+S"(src), "+c"(count) : : "memory");
     return dest;
 }
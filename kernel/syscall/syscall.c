@@ -263,8 +263,12 @@ static int64_t sys_exec(uint64_t name_ptr, uint64_t argv_ptr, uint64_t envp_ptr,
         return NM_ERR(NM_EFAIL);
     }
 
-    nm_fd_close_on_exec(task_current());
-    return proc_exec_current(name, final_entry, argv, envp);
+    // A failed exec returns to the caller with its descriptors intact.
+    int rc = proc_exec_current(name, final_entry, argv, envp);
+    if (rc == 0) {
+        nm_fd_close_on_exec(task_current());
+    }
+    return rc;
 }
 
 void syscall_init(void)
@@ -1,6 +1,9 @@
 #include "nm/tss.h"
 
+#define DF_STACK_SIZE 8192
+
 static struct nm_tss64 kernel_tss __attribute__((aligned(16)));
+static uint8_t df_stack[DF_STACK_SIZE] __attribute__((aligned(16)));
 
 uint64_t tss_base_address(void)
 {
@@ -14,7 +17,7 @@ void tss_init(void)
     kernel_tss.rsp1 = 0;
     kernel_tss.rsp2 = 0;
     kernel_tss.reserved1 = 0;
-    kernel_tss.ist1 = 0;
+    kernel_tss.ist1 = (uint64_t)&df_stack[DF_STACK_SIZE];
     kernel_tss.ist2 = 0;
     kernel_tss.ist3 = 0;
     kernel_tss.ist4 = 0;
@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nm/cpu.h"
+#include "nm/mm.h"
+
+#define BENCH_ROUNDS 5
+#define BENCH_HEAP NM_USER_BASE
+#define BENCH_HEAP_BYTES (256ULL << 20)
+
+static uint64_t best_of(uint64_t best, uint64_t start)
+{
+    uint64_t cycles = cpu_rdtsc() - start;
+    return cycles < best ? cycles : best;
+}
+
+// What fork would cost if it copied: a frame, a 4 KiB copy and a map per resident page.
+static struct nm_mm *eager_fork(struct nm_mm *parent, uint64_t bytes)
+{
+    struct nm_mm *child = mm_create();
+    mm_map(child, BENCH_HEAP, BENCH_HEAP_BYTES, NM_VMA_READ | NM_VMA_WRITE, 0, 0);
+    for (uint64_t off = 0; off < bytes; off += 4096) {
+        uint64_t from = vmm_leaf_entry(parent->pml4, BENCH_HEAP + off) & ~0xFFFULL;
+        uint64_t to = pmm_alloc_page();
+        memcpy(pmm_host_ptr_from_key(to), pmm_host_ptr_from_key(from), 4096);
+        vmm_map_range(child->pml4, BENCH_HEAP + off, to, 4096, 0x7);
+    }
+    return child;
+}
+
+// A parent with `bytes` resident forks, and the child immediately execs, which throws
+// the cloned address space away for a fresh one.
+static void bench_fork_exec(uint64_t bytes)
+{
+    struct nm_mm *parent = mm_create();
+    mm_map(parent, BENCH_HEAP, BENCH_HEAP_BYTES, NM_VMA_READ | NM_VMA_WRITE, 0, 0);
+    for (uint64_t off = 0; off < bytes; off += 4096) {
+        mm_handle_fault(parent, BENCH_HEAP + off, NM_PF_WRITE | NM_PF_USER);
+    }
+
+    uint64_t cow = UINT64_MAX;
+    uint64_t eager = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = cpu_rdtsc();
+        struct nm_mm *child = mm_fork(parent);
+        mm_put(child);
+        mm_put(mm_create());
+        cow = best_of(cow, start);
+
+        start = cpu_rdtsc();
+        child = eager_fork(parent, bytes);
+        mm_put(child);
+        mm_put(mm_create());
+        eager = best_of(eager, start);
+    }
+    mm_put(parent);
+
+    uint64_t pages = bytes / 4096;
+    printf("%8llu MiB %14llu %10llu %16llu %10llu\n", (unsigned long long)(bytes >> 20),
+           (unsigned long long)cow, (unsigned long long)(cow / pages), (unsigned long long)eager,
+           (unsigned long long)(eager / pages));
+}
+
+int main(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x30000000, .type = NM_MEM_AVAILABLE},
+    };
+    pmm_init_from_ranges(ranges, 1);
+    kheap_init();
+    mm_space_init();
+
+    printf("%12s %14s %10s %16s %10s\n", "resident", "cow cycles", "per page", "eager cycles", "per page");
+    for (uint64_t mib = 1; mib <= 256; mib *= 4) {
+        bench_fork_exec(mib << 20);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nm/cpu.h"
+#include "nm/mm.h"
+
+#define BENCH_ROUNDS 5
+#define BENCH_LIVE 2048U
+#define BENCH_STEPS 200000U
+
+static void *live[BENCH_LIVE];
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+// Mostly small objects with an occasional buffer-sized one, roughly what the fs and net
+// paths ask for.
+static size_t pick_size(void)
+{
+    uint32_t r = rng_next();
+    if ((r & 15U) == 0) {
+        return 512U + (r >> 8) % 512U;
+    }
+    return 8U + (r >> 8) % 120U;
+}
+
+static void report(const char *name, uint64_t best, uint64_t ops)
+{
+    printf("%-28s %10llu cycles/op\n", name, (unsigned long long)(best / ops));
+}
+
+static void bench_pairs(void)
+{
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t i = 0; i < BENCH_STEPS; i++) {
+            kfree(kmalloc(64));
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    report("kmalloc(64)+kfree", best, BENCH_STEPS);
+}
+
+// Keep BENCH_LIVE objects alive and replace a random one per step, so the heap sees a
+// steady mix of sizes and free order instead of a LIFO pattern.
+static void bench_churn(void)
+{
+    for (uint32_t i = 0; i < BENCH_LIVE; i++) {
+        live[i] = kmalloc(pick_size());
+    }
+
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t i = 0; i < BENCH_STEPS; i++) {
+            uint32_t slot = rng_next() % BENCH_LIVE;
+            kfree(live[slot]);
+            live[slot] = kmalloc(pick_size());
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    report("random churn (free+alloc)", best, BENCH_STEPS);
+
+    for (uint32_t i = 0; i < BENCH_LIVE; i++) {
+        kfree(live[i]);
+    }
+}
+
+// Buffer-sized allocations that live in the boundary-tag arenas.
+static void bench_arena_churn(void)
+{
+    for (uint32_t i = 0; i < BENCH_LIVE; i++) {
+        live[i] = kmalloc(1025U + rng_next() % 7168U);
+    }
+
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t i = 0; i < BENCH_STEPS; i++) {
+            uint32_t slot = rng_next() % BENCH_LIVE;
+            kfree(live[slot]);
+            live[slot] = kmalloc(1025U + rng_next() % 7168U);
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    report("1-8 KiB churn (free+alloc)", best, BENCH_STEPS);
+    struct nm_kheap_stats stats = kheap_get_stats();
+    printf("%-28s %10llu pages, %u permille fragmented\n", "arena footprint",
+           (unsigned long long)stats.arena_pages, stats.fragmentation_permille);
+
+    for (uint32_t i = 0; i < BENCH_LIVE; i++) {
+        kfree(live[i]);
+    }
+}
+
+int main(void)
+{
+    mm_init(0);
+    bench_pairs();
+    bench_churn();
+    bench_arena_churn();
+    printf("%-28s %10llu frames\n", "frames in use after run",
+           (unsigned long long)pmm_get_stats().used_frames);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nm/cpu.h"
+#include "nm/mm.h"
+
+#define BENCH_ROUNDS 5
+#define BENCH_PAIRS 1000000U
+#define BENCH_BURST 4096U
+#define BENCH_RUNS 20000U
+
+static uint64_t burst[BENCH_BURST];
+
+static void init_ram(uint64_t bytes)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = bytes - 0x00100000, .type = NM_MEM_AVAILABLE},
+    };
+    pmm_init_from_ranges(ranges, 1);
+}
+
+static void report(const char *name, uint64_t best, uint64_t ops)
+{
+    printf("%-28s %10llu cycles/op\n", name, (unsigned long long)(best / ops));
+}
+
+static void bench_init(const char *name, uint64_t bytes)
+{
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        init_ram(bytes);
+        uint64_t cycles = pmm_get_stats().init_cycles;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    report(name, best, 1);
+}
+
+static void bench_page_pairs(void)
+{
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t i = 0; i < BENCH_PAIRS; i++) {
+            pmm_free_page(pmm_alloc_page());
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    report("alloc_page+free_page", best, BENCH_PAIRS);
+}
+
+static void bench_page_burst(void)
+{
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t i = 0; i < BENCH_BURST; i++) {
+            burst[i] = pmm_alloc_page();
+        }
+        for (uint32_t i = 0; i < BENCH_BURST; i++) {
+            pmm_free_page(burst[i]);
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    report("burst 4096 alloc+free", best, BENCH_BURST);
+}
+
+static void bench_batch(void)
+{
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t i = 0; i < BENCH_RUNS; i++) {
+            (void)pmm_alloc_batch(burst, 64);
+            pmm_free_batch(burst, 64);
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    report("alloc_batch(64)+free_batch", best, BENCH_RUNS * 64ULL);
+}
+
+static void bench_runs(const char *name, size_t count)
+{
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t i = 0; i < BENCH_RUNS; i++) {
+            pmm_free_pages(pmm_alloc_pages(count), count);
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    report(name, best, BENCH_RUNS);
+}
+
+int main(void)
+{
+    bench_init("init 4 GiB", 4ULL * 1024ULL * 1024ULL * 1024ULL);
+    bench_init("init 32 GiB", 32ULL * 1024ULL * 1024ULL * 1024ULL);
+
+    init_ram(1024ULL * 1024ULL * 1024ULL);
+    bench_page_pairs();
+    bench_page_burst();
+    bench_batch();
+    bench_runs("alloc_pages(8)+free", 8);
+    bench_runs("alloc_huge+free_huge", NM_HUGE_PAGE_FRAMES);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nm/cpu.h"
+#include "nm/mm.h"
+
+#define BENCH_ROUNDS 5
+#define BENCH_REPS 200U
+#define BENCH_VIRT 0x40000000ULL
+#define BENCH_PHYS 0x80000000ULL
+
+static uint64_t *bench_pml4;
+
+static void report(const char *name, uint64_t best, uint64_t ops, uint64_t tables)
+{
+    printf("%-32s %10llu cycles/op %6llu tables/op\n", name, (unsigned long long)(best / ops),
+           (unsigned long long)tables);
+}
+
+// Map and tear down `bytes` at an address whose tables do not exist yet, either one
+// vmm_map_page_in call per 4 KiB page or a single range call.
+static void bench_map(const char *name, uint64_t bytes, int per_page)
+{
+    uint64_t best = UINT64_MAX;
+    uint64_t tables = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        struct nm_vmm_stats before = vmm_get_stats();
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t rep = 0; rep < BENCH_REPS; rep++) {
+            if (per_page) {
+                for (uint64_t off = 0; off < bytes; off += 4096) {
+                    vmm_map_page_in(bench_pml4, BENCH_VIRT + off, BENCH_PHYS + off, 0x3);
+                }
+                for (uint64_t off = 0; off < bytes; off += 4096) {
+                    vmm_unmap_page_in(bench_pml4, BENCH_VIRT + off);
+                }
+            } else {
+                vmm_map_range(bench_pml4, BENCH_VIRT, BENCH_PHYS, bytes, 0x3);
+                vmm_unmap_range(bench_pml4, BENCH_VIRT, bytes);
+            }
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+        tables = (vmm_get_stats().tables_allocated - before.tables_allocated) / BENCH_REPS;
+    }
+    report(name, best, BENCH_REPS, tables);
+}
+
+// Look up the same 16 pages over and over (a DMA ring being refilled), then the same
+// lookups with every one missing the per-CPU cache.
+static void bench_translate(void)
+{
+    vmm_map_range(bench_pml4, BENCH_VIRT, BENCH_PHYS, 0x100000ULL, 0x3);
+    for (int miss = 0; miss < 2; miss++) {
+        uint64_t best = UINT64_MAX;
+        uint64_t sum = 0;
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            uint64_t start = cpu_rdtsc();
+            for (uint32_t rep = 0; rep < BENCH_REPS * 64U; rep++) {
+                uint64_t phys = 0;
+                // Pages 16 apart share a cache slot, so alternating between them always misses.
+                uint64_t page = miss ? (rep & 1U) * 16U : rep & 15U;
+                vmm_translate(bench_pml4, BENCH_VIRT + page * 4096 + 8, &phys);
+                sum += phys;
+            }
+            uint64_t cycles = cpu_rdtsc() - start;
+            if (cycles < best) {
+                best = cycles;
+            }
+        }
+        (void)sum;
+        report(miss ? "vmm_translate (cache miss)" : "vmm_translate (cache hit)", best, BENCH_REPS * 64U, 0);
+    }
+    vmm_unmap_range(bench_pml4, BENCH_VIRT, 0x100000ULL);
+}
+
+// Flip 1 MiB of mapped pages read-only and back: page-by-page remapping (the only way
+// before vmm_protect) against one range call per direction, each with a single flush.
+static void bench_protect(int per_page)
+{
+    vmm_map_range(bench_pml4, BENCH_VIRT, BENCH_PHYS, 0x100000ULL, 0x3);
+    uint64_t best = UINT64_MAX;
+    uint64_t flushes = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        struct nm_vmm_stats before = vmm_get_stats();
+        uint64_t start = cpu_rdtsc();
+        for (uint32_t rep = 0; rep < BENCH_REPS; rep++) {
+            if (per_page) {
+                for (uint64_t off = 0; off < 0x100000ULL; off += 4096) {
+                    vmm_unmap_page_in(bench_pml4, BENCH_VIRT + off);
+                    vmm_map_page_in(bench_pml4, BENCH_VIRT + off, BENCH_PHYS + off, 0x1);
+                }
+                for (uint64_t off = 0; off < 0x100000ULL; off += 4096) {
+                    vmm_unmap_page_in(bench_pml4, BENCH_VIRT + off);
+                    vmm_map_page_in(bench_pml4, BENCH_VIRT + off, BENCH_PHYS + off, 0x3);
+                }
+            } else {
+                vmm_protect(bench_pml4, BENCH_VIRT, 0x100000ULL, 0, 0x2);
+                vmm_protect(bench_pml4, BENCH_VIRT, 0x100000ULL, 0x2, 0x2);
+            }
+        }
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+        struct nm_vmm_stats after = vmm_get_stats();
+        flushes = (after.page_flushes - before.page_flushes + after.full_flushes - before.full_flushes) / BENCH_REPS;
+    }
+    printf("%-32s %10llu cycles/op %6llu flushes/op\n",
+           per_page ? "remap x256 ro+rw (1 MiB)" : "vmm_protect ro+rw (1 MiB)", (unsigned long long)(best / BENCH_REPS),
+           (unsigned long long)flushes);
+    vmm_unmap_range(bench_pml4, BENCH_VIRT, 0x100000ULL);
+}
+
+int main(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x04000000, .type = NM_MEM_AVAILABLE},
+    };
+    pmm_init_from_ranges(ranges, 1);
+    bench_pml4 = (uint64_t *)pmm_host_ptr_from_key(pmm_alloc_zeroed_page());
+
+    bench_map("map_page_in x256 (1 MiB)", 0x100000ULL, 1);
+    bench_map("map_range 1 MiB", 0x100000ULL, 0);
+    bench_map("map_range 64 MiB (2 MiB leaves)", 0x4000000ULL, 0);
+    bench_map("map_range 64 MiB + 4 KiB", 0x4001000ULL, 0);
+    bench_translate();
+    bench_protect(1);
+    bench_protect(0);
+    return 0;
+}
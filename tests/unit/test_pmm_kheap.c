@@ -1,7 +1,12 @@
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "nm/errno.h"
+#include "nm/fs.h"
+#include "nm/klog.h"
 #include "nm/mm.h"
 
 static void test_pmm_alloc_free(void)
@@ -19,9 +24,12 @@ static void test_pmm_alloc_free(void)
     assert(p1 != 0);
     assert(p2 != 0);
     assert(p1 != p2);
+    assert((p1 % 4096) == 0 && (p2 % 4096) == 0);
+    assert(p1 >= 0x00100000 && p2 >= 0x00100000);
 
     struct nm_mm_stats mid = pmm_get_stats();
     assert(mid.free_frames + 2 == before.free_frames);
+    assert(mid.pcp_alloc_hits + mid.pcp_alloc_misses == before.pcp_alloc_hits + before.pcp_alloc_misses + 2);
 
     pmm_free_page(p1);
     pmm_free_page(p2);
@@ -30,6 +38,444 @@ static void test_pmm_alloc_free(void)
     assert(after.free_frames == before.free_frames);
 }
 
+static void test_pmm_multi_page_free(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x04000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    struct nm_mm_stats before = pmm_get_stats();
+
+    uint64_t run3 = pmm_alloc_pages(3);
+    uint64_t run8 = pmm_alloc_pages(8);
+    assert(run3 != 0);
+    assert(run8 != 0);
+    assert(run3 != run8);
+
+    struct nm_mm_stats mid = pmm_get_stats();
+    assert(mid.free_frames + 11 == before.free_frames);
+
+    pmm_free_pages(run3, 3);
+    pmm_free_pages(run8, 8);
+
+    struct nm_mm_stats after = pmm_get_stats();
+    assert(after.free_frames == before.free_frames);
+}
+
+static void test_pmm_zone_alloc(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x04000000, .type = NM_MEM_AVAILABLE},
+        {.base = 0x100000000ULL, .length = 0x04000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    struct nm_mm_stats before = pmm_get_stats();
+    assert(before.zones[NM_ZONE_NORMAL].managed_frames == 0x04000000 / 4096);
+
+    assert(pmm_alloc_pages_zone(1, 0, 0) == 0);
+    assert(pmm_alloc_pages_zone(1, NM_ZONE_MASK_ANY, 3 * 4096) == 0);
+
+    uint64_t any = pmm_alloc_pages(2);
+    assert(any >= 0x100000000ULL);
+
+    uint64_t ring = pmm_alloc_pages_zone(3, NM_ZONE_MASK_DMA | NM_ZONE_MASK_DMA32, 0);
+    assert(ring != 0);
+    assert(ring + 3 * 4096 <= 0x100000000ULL);
+
+    uint64_t isa = pmm_alloc_pages_zone(1, NM_ZONE_MASK_DMA, 0);
+    assert(isa != 0);
+    assert(isa + 4096 <= 0x01000000);
+
+    uint64_t aligned = pmm_alloc_pages_zone(4, NM_ZONE_MASK_ANY, 0x10000);
+    assert(aligned != 0);
+    assert((aligned % 0x10000) == 0);
+    assert(pmm_get_stats().free_frames + 10 == before.free_frames);
+
+    pmm_free_pages(any, 2);
+    pmm_free_pages(ring, 3);
+    pmm_free_page(isa);
+    pmm_free_pages(aligned, 4);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+}
+
+static void test_pmm_exhaust(void)
+{
+    static uint64_t pages[0x02000000 / 4096];
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    struct nm_mm_stats before = pmm_get_stats();
+    assert(before.free_frames > 0 && before.free_frames <= sizeof(pages) / sizeof(pages[0]));
+
+    size_t count = 0;
+    for (;;) {
+        uint64_t page = pmm_alloc_page();
+        if (page == 0) {
+            break;
+        }
+        assert(count < sizeof(pages) / sizeof(pages[0]));
+        uint64_t *word = (uint64_t *)pmm_host_ptr_from_key(page);
+        assert(word != 0);
+        *word = page;
+        pages[count++] = page;
+    }
+    assert(count == before.free_frames);
+    assert(pmm_get_stats().free_frames == 0);
+
+    for (size_t i = 0; i < count; i++) {
+        assert(*(const uint64_t *)pmm_host_ptr_from_key(pages[i]) == pages[i]);
+        pmm_free_page(pages[i]);
+    }
+    assert(pmm_get_stats().free_frames == before.free_frames);
+
+    uint64_t huge = pmm_alloc_huge();
+    assert(huge != 0);
+    pmm_free_huge(huge);
+}
+
+static void test_pmm_huge_alloc(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x04000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    struct nm_mm_stats before = pmm_get_stats();
+
+    uint64_t huge = pmm_alloc_huge();
+    assert(huge != 0);
+    assert((huge % NM_HUGE_PAGE_SIZE) == 0);
+    assert(pmm_get_stats().free_frames + NM_HUGE_PAGE_FRAMES == before.free_frames);
+
+    pmm_free_huge(huge);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+}
+
+static void test_pmm_zeroed_page(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x04000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    struct nm_mm_stats before = pmm_get_stats();
+
+    (void)pmm_zero_pool_fill(4);
+    uint64_t page = pmm_alloc_zeroed_page();
+    assert(page != 0);
+
+    const uint64_t *words = (const uint64_t *)pmm_host_ptr_from_key(page);
+    assert(words != 0);
+    for (size_t i = 0; i < 4096 / sizeof(uint64_t); i++) {
+        assert(words[i] == 0);
+    }
+
+    pmm_free_page(page);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+}
+
+static void test_pmm_page_refcount(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x04000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    struct nm_mm_stats before = pmm_get_stats();
+
+    assert(pmm_page_get(0x00100000) == 0);
+    assert(pmm_page_refcount(0x00100000) == 0);
+
+    uint64_t page = pmm_alloc_page();
+    assert(page != 0);
+    struct nm_page *desc = pmm_phys_to_page(page);
+    assert(desc != 0);
+    assert(pmm_page_to_phys(desc) == page);
+    assert(desc->refcount == 1 && desc->flags == 0);
+    assert(pmm_page_zone(desc) == NM_ZONE_DMA32);
+
+    assert(pmm_page_get(page) == 2);
+    pmm_page_put(page);
+    assert(pmm_page_refcount(page) == 1);
+    assert(pmm_get_stats().free_frames + 1 == before.free_frames);
+    pmm_page_put(page);
+    assert(pmm_page_refcount(page) == 0);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+    pmm_page_put(page);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+
+    // A shared frame in the middle of a run outlives the run itself.
+    uint64_t run = pmm_alloc_pages(4);
+    assert(run != 0);
+    assert(pmm_page_get(run + 2 * 4096) == 2);
+    pmm_free_pages(run, 4);
+    assert(pmm_get_stats().free_frames + 1 == before.free_frames);
+    assert(pmm_page_refcount(run + 2 * 4096) == 1);
+    pmm_free_page(run + 2 * 4096);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+}
+
+static void test_pmm_batch(void)
+{
+    static uint64_t frames[37];
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x04000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    struct nm_mm_stats before = pmm_get_stats();
+
+    assert(pmm_alloc_batch(frames, 0) == 0);
+    assert(pmm_alloc_batch(frames, 37) == 37);
+    assert(pmm_get_stats().free_frames + 37 == before.free_frames);
+    for (size_t i = 0; i < 37; i++) {
+        assert(frames[i] != 0 && (frames[i] % 4096) == 0);
+        assert(pmm_page_refcount(frames[i]) == 1);
+        for (size_t j = 0; j < i; j++) {
+            assert(frames[i] != frames[j]);
+        }
+    }
+
+    pmm_free_batch(frames, 37);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+    pmm_free_batch(frames, 37);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+
+    // All or nothing: a batch larger than free memory leaves the allocator untouched.
+    static uint64_t too_many[0x04000000 / 4096 + 1];
+    assert(pmm_alloc_batch(too_many, sizeof(too_many) / sizeof(too_many[0])) == 0);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+}
+
+static void test_pmm_grow_pages(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    struct nm_mm_stats before = pmm_get_stats();
+
+    uint64_t run = pmm_alloc_pages(3);
+    assert(run != 0);
+    assert(pmm_grow_pages(run, 3, 40));
+    assert(pmm_get_stats().free_frames + 40 == before.free_frames);
+    for (size_t i = 0; i < 40; i++) {
+        assert(pmm_page_refcount(run + i * 4096) == 1);
+    }
+
+    // The frame right after the run is taken: growing must fail and change nothing.
+    uint64_t blocker = pmm_alloc_pages_zone(1, NM_ZONE_MASK_ANY, 0);
+    while (blocker != 0 && blocker != run + 40 * 4096) {
+        blocker = pmm_alloc_pages(1);
+    }
+    assert(blocker == run + 40 * 4096);
+    uint64_t free_before = pmm_get_stats().free_frames;
+    assert(!pmm_grow_pages(run, 40, 41));
+    assert(pmm_get_stats().free_frames == free_before);
+
+    pmm_free_pages(run, 40);
+    pmm_free_page(blocker);
+}
+
+static void test_kmalloc_large_returns_pages(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    struct nm_mm_stats before = pmm_get_stats();
+
+    void *stack = kmalloc(32768);
+    assert(stack != 0);
+    assert(pmm_get_stats().free_frames < before.free_frames);
+
+    kfree(stack);
+    assert(pmm_get_stats().free_frames == before.free_frames);
+}
+
+static void test_kmalloc_arena_coalesce(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+
+    void *blocks[8];
+    for (size_t i = 0; i < 8; i++) {
+        blocks[i] = kmalloc(4000);
+        assert(blocks[i] != 0);
+        assert(((uintptr_t)blocks[i] & 15U) == 0);
+        memset(blocks[i], (int)i, 4000);
+    }
+    struct nm_kheap_stats stats = kheap_get_stats();
+    assert(stats.arena_pages == 16);
+    uint64_t capacity = stats.arena_free_bytes;
+
+    // Free every other block: the holes are separated by live neighbours.
+    for (size_t i = 0; i < 8; i += 2) {
+        kfree(blocks[i]);
+    }
+    stats = kheap_get_stats();
+    assert(stats.fragmentation_permille > 0);
+    assert(stats.arena_largest_free < stats.arena_free_bytes);
+
+    // A smaller request reuses a hole and splits it instead of growing the heap.
+    void *small = kmalloc(1500);
+    bool in_hole = false;
+    for (size_t i = 0; i < 8; i += 2) {
+        in_hole |= small == blocks[i];
+    }
+    assert(in_hole);
+    assert(kheap_get_stats().arena_pages == 16);
+    kfree(small);
+
+    // Filling the gaps merges everything back into one block.
+    for (size_t i = 1; i < 8; i += 2) {
+        kfree(blocks[i]);
+    }
+    stats = kheap_get_stats();
+    assert(stats.fragmentation_permille == 0);
+    assert(stats.arena_largest_free == stats.arena_free_bytes);
+    assert(stats.arena_free_bytes > capacity);
+
+    void *whole = kmalloc(16384);
+    assert(whole == blocks[0]);
+    kfree(whole);
+}
+
+static void test_krealloc_aligned(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+
+    // Arena blocks grow into a free successor without moving.
+    uint8_t *buf = (uint8_t *)kmalloc(2000);
+    assert(buf != 0);
+    memset(buf, 0x5A, 2000);
+    uint8_t *grown = (uint8_t *)krealloc(buf, 9000);
+    assert(grown == buf);
+    for (size_t i = 0; i < 2000; i++) {
+        assert(grown[i] == 0x5A);
+    }
+
+    // A live neighbour forces a move that keeps the contents.
+    uint8_t *wall = (uint8_t *)kmalloc(2000);
+    assert(wall != 0);
+    uint8_t *moved = (uint8_t *)krealloc(grown, 12000);
+    assert(moved != 0 && moved != grown);
+    for (size_t i = 0; i < 2000; i++) {
+        assert(moved[i] == 0x5A);
+    }
+
+    // Slab objects move up a class; page runs extend in place when the next frames are free.
+    uint8_t *small = (uint8_t *)kmalloc(24);
+    memset(small, 0x11, 24);
+    assert(krealloc(small, 32) == small);
+    uint8_t *bigger = (uint8_t *)krealloc(small, 100);
+    assert(bigger != small && bigger[23] == 0x11);
+    uint8_t *pages = (uint8_t *)kmalloc(20000);
+    pages[19999] = 0x77;
+    assert(krealloc(pages, 60000) == pages);
+    assert(pages[19999] == 0x77);
+    assert(kheap_get_stats().large_pages == 15);
+    assert(krealloc(pages, 17000) == pages);
+    assert(kheap_get_stats().large_pages == 5);
+
+    void *fresh = krealloc(0, 64);
+    assert(fresh != 0);
+    kfree(fresh);
+    assert(krealloc(bigger, 0) == 0);
+
+    static const size_t aligns[] = {32, 64, 256, 1024, 2048, 4096, 16384};
+    for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) {
+        void *a = kmalloc_aligned(40, aligns[i]);
+        void *b = kmalloc_aligned(5000, aligns[i]);
+        void *c = kmalloc_aligned(20000, aligns[i]);
+        assert(a != 0 && b != 0 && c != 0);
+        assert(((uintptr_t)a % aligns[i]) == 0);
+        assert(((uintptr_t)b % aligns[i]) == 0);
+        assert(((uintptr_t)c % aligns[i]) == 0);
+        memset(b, 0xEE, 5000);
+        kfree(a);
+        kfree(b);
+        kfree(c);
+    }
+    assert(kmalloc_aligned(64, 48) == 0);
+
+    kfree(wall);
+    kfree(moved);
+    kfree(pages);
+    kheap_drain();
+    struct nm_kheap_stats stats = kheap_get_stats();
+    assert(stats.active_objects == 0);
+    assert(stats.large_pages == 0);
+    assert(stats.fragmentation_permille == 0);
+}
+
+#ifdef NM_KHEAP_TRACK
+__attribute__((noinline)) static void *track_site_a(void)
+{
+    return kmalloc(100);
+}
+
+__attribute__((noinline)) static void *track_site_b(void)
+{
+    return kmalloc(3000);
+}
+
+static void test_kheap_track(void)
+{
+    static void *objs[20];
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    klog_init();
+
+    for (size_t i = 0; i < 20; i++) {
+        objs[i] = (i % 4 == 0) ? track_site_b() : track_site_a();
+    }
+    struct nm_kheap_site sites[4];
+    size_t n = kheap_track_sites(sites, 4);
+    assert(n == 2);
+    assert(sites[0].allocs == 5 && sites[0].bytes == 15000);
+    assert(sites[1].allocs == 15 && sites[1].bytes == 1500);
+    assert(sites[0].callsite != sites[1].callsite);
+
+    // krealloc re-attributes the block to the resizing caller with its new size.
+    objs[1] = krealloc(objs[1], 5000);
+    n = kheap_track_sites(sites, 4);
+    assert(n == 3);
+    assert(sites[0].bytes == 15000 && sites[1].bytes == 5000 && sites[2].bytes == 1400);
+
+    kheap_track_dump(2);
+    static char log[8192];
+    klog_read(log, sizeof(log));
+    assert(strstr(log, "top callsites by live bytes") != 0);
+    assert(strstr(log, "leak suspects") != 0);
+
+    for (size_t i = 0; i < 20; i++) {
+        kfree(objs[i]);
+    }
+    assert(kheap_track_sites(sites, 4) == 0);
+}
+#endif
+
 static void test_kmalloc_reuse(void)
 {
     const struct nm_mem_range ranges[] = {
@@ -37,6 +483,7 @@ static void test_kmalloc_reuse(void)
     };
 
     pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
 
     void *a = kmalloc(64);
     assert(a != 0);
@@ -52,10 +499,742 @@ static void test_kmalloc_reuse(void)
     kfree(c);
 }
 
+static void test_kmalloc_slab_classes(void)
+{
+    static uint8_t *objs[600];
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    struct nm_mm_stats before = pmm_get_stats();
+
+    // 600 16-byte objects need several slab pages, and none of them a page of its own.
+    for (size_t i = 0; i < 600; i++) {
+        objs[i] = (uint8_t *)kmalloc(16);
+        assert(objs[i] != 0);
+        assert(((uintptr_t)objs[i] % 16) == 0);
+        memset(objs[i], (int)(i & 0xFF), 16);
+    }
+    struct nm_kheap_stats mid = kheap_get_stats();
+    assert(mid.active_objects == 600);
+    assert(mid.slab_pages >= 2 && mid.slab_pages <= 4);
+    assert(pmm_get_stats().free_frames + mid.slab_pages == before.free_frames);
+
+    for (size_t i = 0; i < 600; i++) {
+        for (size_t j = 0; j < 16; j++) {
+            assert(objs[i][j] == (uint8_t)(i & 0xFF));
+        }
+        kfree(objs[i]);
+    }
+    struct nm_kheap_stats after = kheap_get_stats();
+    assert(after.active_objects == 0);
+    assert(after.magazine_objects != 0);
+    // Freed objects stay in magazines until drained; then empty slabs go back to the PMM.
+    kheap_drain();
+    after = kheap_get_stats();
+    assert(after.active_objects == 0);
+    assert(after.magazine_objects == 0);
+    assert(after.slab_pages == 1);
+    assert(pmm_get_stats().free_frames + 1 == before.free_frames);
+
+    // Every size up to the largest class lands in a slab, then an arena, then whole pages.
+    for (size_t size = 1; size <= 1024; size++) {
+        void *p = kmalloc(size);
+        assert(p != 0);
+        assert(((uintptr_t)p % 16) == 0);
+        assert(kheap_get_stats().large_pages == 0);
+        kfree(p);
+    }
+    void *medium = kmalloc(1025);
+    assert(medium != 0);
+    assert(kheap_get_stats().large_pages == 0);
+    assert(kheap_get_stats().arena_pages != 0);
+    kfree(medium);
+    void *big = kmalloc(16385);
+    assert(big != 0);
+    assert(kheap_get_stats().large_pages == 5);
+    kfree(big);
+    assert(kheap_get_stats().large_pages == 0);
+    assert(kheap_get_stats().active_objects == 0);
+}
+
+static uint32_t ctor_calls;
+
+static void test_obj_ctor(void *obj)
+{
+    ctor_calls++;
+    memset(obj, 0xA5, 40);
+}
+
+static void test_kmem_cache(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    struct nm_mm_stats before = pmm_get_stats();
+
+    assert(kmem_cache_create("bad", 0, 0, 0) == 0);
+    assert(kmem_cache_create("bad", 32, 24, 0) == 0);
+
+    struct kmem_cache *objs = kmem_cache_create("test-obj", 40, 64, test_obj_ctor);
+    assert(objs != 0);
+
+    uint8_t *a = (uint8_t *)kmem_cache_alloc(objs);
+    uint8_t *b = (uint8_t *)kmem_cache_alloc(objs);
+    assert(a != 0 && b != 0 && a != b);
+    assert(((uintptr_t)a % 64) == 0 && ((uintptr_t)b % 64) == 0);
+    assert(a[0] == 0xA5 && a[39] == 0xA5);
+    uint32_t calls = ctor_calls;
+    assert(calls > 2);
+
+    // Freed objects come back constructed without running the constructor again.
+    kmem_cache_free(objs, a);
+    uint8_t *again = (uint8_t *)kmem_cache_alloc(objs);
+    assert(again == a);
+    assert(again[0] == 0xA5 && again[39] == 0xA5);
+    assert(ctor_calls == calls);
+
+    struct kmem_cache *stacks = kmem_cache_create("test-stack", 8192, 0, 0);
+    assert(stacks != 0);
+    void *stack = kmem_cache_alloc(stacks);
+    assert(stack != 0 && ((uintptr_t)stack % 4096) == 0);
+    kmem_cache_free(stacks, stack);
+    assert(kmem_cache_alloc(stacks) == stack);
+    kmem_cache_free(stacks, stack);
+
+    struct nm_kmem_cache_stats stats[16];
+    size_t count = kmem_cache_stats(stats, 16);
+    assert(count == 9);
+    bool found = false;
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(stats[i].name, "test-obj") == 0) {
+            assert(stats[i].obj_size == 40);
+            assert(stats[i].active_objs == 2);
+            assert(stats[i].allocs == 3 && stats[i].frees == 1);
+            found = true;
+        }
+    }
+    assert(found);
+
+    kmem_cache_free(objs, again);
+    kmem_cache_free(objs, b);
+    kmem_cache_free(objs, b);
+    assert(pmm_get_stats().free_frames < before.free_frames);
+}
+
+// Returns the leaf entry mapping virt_addr, or 0; *size gets the leaf size.
+static uint64_t test_leaf(uint64_t *pml4, uint64_t virt_addr, uint64_t *size)
+{
+    uint64_t *table = pml4;
+    for (unsigned shift = 39; shift >= 12; shift -= 9) {
+        uint64_t entry = table[(virt_addr >> shift) & 0x1FF];
+        if ((entry & 0x1) == 0) {
+            return 0;
+        }
+        if (shift == 12 || (entry & 0x80) != 0) {
+            *size = 1ULL << shift;
+            return entry;
+        }
+        table = (uint64_t *)pmm_host_ptr_from_key(entry & ~0xFFFULL);
+    }
+    return 0;
+}
+
+static void test_vmm_map_range(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    uint64_t root = pmm_alloc_zeroed_page();
+    assert(root != 0);
+    uint64_t *pml4 = (uint64_t *)pmm_host_ptr_from_key(root);
+    uint64_t frames = pmm_get_stats().free_frames;
+    struct nm_vmm_stats before = vmm_get_stats();
+    const uint64_t base = 0x40000000ULL;
+    uint64_t size = 0;
+
+    // 1 MiB of 4 KiB pages needs exactly one PDPT, PD and PT, and no flush.
+    assert(vmm_map_range(pml4, base, 0x10000000ULL, 0x100000ULL, 0x3));
+    struct nm_vmm_stats s = vmm_get_stats();
+    assert(s.tables_allocated == before.tables_allocated + 3);
+    assert(s.page_flushes == before.page_flushes && s.full_flushes == before.full_flushes);
+    assert(pmm_get_stats().free_frames + 3 == frames);
+    assert(test_leaf(pml4, base + 0x5000, &size) == (0x10005000ULL | 0x3) && size == 4096);
+
+    // Aligned stretches become 2 MiB leaves under the existing PD.
+    assert(vmm_map_range(pml4, base + 0x200000, 0x20000000ULL, 0x400000ULL + 0x1000, 0x3));
+    s = vmm_get_stats();
+    assert(s.huge_leaves == before.huge_leaves + 2);
+    assert(s.tables_allocated == before.tables_allocated + 4);
+    assert(test_leaf(pml4, base + 0x500000, &size) == (0x20200000ULL | 0x83) && size == 0x200000);
+    assert(test_leaf(pml4, base + 0x600000, &size) == (0x20400000ULL | 0x3) && size == 4096);
+
+    // Remapping present pages flushes once: a few pages by invlpg, many by CR3 reload.
+    assert(vmm_map_range(pml4, base, 0x30000000ULL, 0x2000ULL, 0x3));
+    assert(vmm_get_stats().page_flushes == s.page_flushes + 2);
+    assert(vmm_map_range(pml4, base, 0x30000000ULL, 0x100000ULL, 0x3));
+    assert(vmm_get_stats().full_flushes == s.full_flushes + 1);
+
+    // Unmapping part of a huge leaf splits it; the rest keeps its translation.
+    assert(vmm_unmap_range(pml4, base + 0x200000, 0x1000));
+    assert(test_leaf(pml4, base + 0x200000, &size) == 0);
+    assert(test_leaf(pml4, base + 0x201000, &size) == (0x20001000ULL | 0x3) && size == 4096);
+
+    // Tearing the whole range down frees every table it allocated.
+    assert(vmm_unmap_range(pml4, base, 0x800000ULL));
+    assert(!vmm_unmap_range(pml4, base, 0x800000ULL));
+    s = vmm_get_stats();
+    assert(s.tables_freed - before.tables_freed == s.tables_allocated - before.tables_allocated);
+    assert(pml4[(base >> 39) & 0x1FF] == 0);
+    assert(pmm_get_stats().free_frames == frames);
+    pmm_free_page(root);
+}
+
+static void test_mm_pcid(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    mm_space_init();
+    // Warm the slab class so the descriptor allocations do not show up as used frames.
+    kfree(kmalloc(sizeof(struct nm_mm)));
+    uint64_t frames = pmm_get_stats().free_frames;
+    const uint64_t noflush = 1ULL << 63;
+
+    struct nm_mm *a = mm_create();
+    struct nm_mm *b = mm_create();
+    assert(a != 0 && b != 0 && a->refcount == 1);
+
+    // A fresh PCID flushes once; switching back while it is valid keeps the TLB.
+    assert(mm_switch(a) == (a->root | 1));
+    assert(mm_switch(b) == (b->root | 2));
+    assert(mm_switch(a) == (a->root | 1 | noflush));
+    assert(mm_switch(a) == 0);
+    assert(mm_switch(mm_kernel()) == (mm_kernel()->root | 0));
+    assert(mm_switch(b) == (b->root | 2 | noflush));
+
+    // Changes made while an address space is switched out cost it its PCID.
+    mm_tlb_invalidate(a);
+    assert(mm_switch(a) == (a->root | 3));
+
+    // With PCIDs off every load flushes; turning them back on starts a new generation.
+    mm_pcid_set_enabled(false);
+    assert(mm_switch(b) == b->root);
+    assert(mm_switch(a) == a->root);
+    mm_pcid_set_enabled(true);
+    assert(mm_switch(b) == (b->root | 1));
+
+    // Using up the PCID space rolls the generation over, so b has to flush again.
+    struct nm_mm_switch_stats before = mm_switch_stats();
+    for (uint32_t i = 0; i < NM_PCID_COUNT; i++) {
+        mm_tlb_invalidate(a);
+        (void)mm_switch(a);
+        (void)mm_switch(mm_kernel());
+    }
+    assert(mm_switch_stats().rollovers == before.rollovers + 1);
+    assert((mm_switch(b) & noflush) == 0);
+
+    // The last reference tears down the user half and the PML4.
+    assert(vmm_map_range(a->pml4, NM_USER_BASE, 0x10000000ULL, 0x3000, 0x7));
+    (void)mm_switch(mm_kernel());
+    mm_get(a);
+    mm_put(a);
+    assert(a->refcount == 1);
+    mm_put(a);
+    mm_put(b);
+    kheap_drain();
+    assert(pmm_get_stats().free_frames == frames);
+}
+
+static int count_leaf(void *ctx, uint64_t virt_addr, uint64_t size, uint64_t *entry)
+{
+    (void)virt_addr;
+    (void)entry;
+    uint64_t *counts = (uint64_t *)ctx;
+    counts[size == 4096 ? 0 : 1]++;
+    return 0;
+}
+
+static int touch_leaf(void *ctx, uint64_t virt_addr, uint64_t size, uint64_t *entry)
+{
+    (void)ctx;
+    (void)size;
+    *entry |= NM_PTE_ACCESSED | ((virt_addr & 0x1000) != 0 ? NM_PTE_DIRTY : 0);
+    return 0;
+}
+
+static int stop_at_huge(void *ctx, uint64_t virt_addr, uint64_t size, uint64_t *entry)
+{
+    (void)entry;
+    *(uint64_t *)ctx = virt_addr;
+    return size == 0x200000 ? 7 : 0;
+}
+
+static void test_vmm_walk_translate(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    uint64_t *pml4 = (uint64_t *)pmm_host_ptr_from_key(pmm_alloc_zeroed_page());
+    const uint64_t base = 0x40000000ULL;
+    assert(vmm_map_range(pml4, base, 0x10000000ULL, 0x4000, 0x3));
+    assert(vmm_map_range(pml4, base + 0x200000, 0x20000000ULL, 0x200000, 0x7));
+    assert(vmm_map_range(pml4, base + 0x400000, 0x30000000ULL, 0x1000, 0x3));
+
+    // The walker sees each leaf once, at its own size, and skips absent tables whole.
+    uint64_t counts[2] = {0, 0};
+    assert(vmm_walk(pml4, 0, 1ULL << 47, count_leaf, counts) == 0);
+    assert(counts[0] == 5 && counts[1] == 1);
+    counts[0] = counts[1] = 0;
+    assert(vmm_walk(pml4, base + 0x3000, 0x200000, count_leaf, counts) == 0);
+    assert(counts[0] == 1 && counts[1] == 1);
+    uint64_t where = 0;
+    assert(vmm_walk(pml4, base, 0x1000000, stop_at_huge, &where) == 7 && where == base + 0x200000);
+
+    // Translation: misses fill the per-CPU cache, repeats hit it, any flush drops it.
+    struct nm_vmm_stats before = vmm_get_stats();
+    uint64_t phys = 0;
+    assert(vmm_translate(pml4, base + 0x1234, &phys) && phys == 0x10001234ULL);
+    assert(vmm_translate(pml4, base + 0x1ff8, &phys) && phys == 0x10001ff8ULL);
+    assert(vmm_translate(pml4, base + 0x3456ab, &phys) && phys == 0x201456abULL);
+    assert(!vmm_translate(pml4, base + 0x5000, &phys));
+    struct nm_vmm_stats s = vmm_get_stats();
+    assert(s.xlate_hits == before.xlate_hits + 1 && s.xlate_misses == before.xlate_misses + 3);
+    assert(vmm_unmap_range(pml4, base + 0x1000, 0x1000));
+    assert(!vmm_translate(pml4, base + 0x1234, &phys));
+    assert(vmm_map_range(pml4, base + 0x1000, 0x18000000ULL, 0x1000, 0x3));
+    assert(vmm_translate(pml4, base + 0x1234, &phys) && phys == 0x18000234ULL);
+
+    // Accessed/dirty harvesting clears the bits it counts, with one flush for the lot.
+    assert(vmm_walk(pml4, base, 0x4000, touch_leaf, 0) == 0);
+    assert(vmm_harvest(pml4, base, 0x4000, NM_PTE_DIRTY) == 2);
+    before = vmm_get_stats();
+    assert(vmm_harvest(pml4, base, 0x4000, NM_PTE_DIRTY) == 0);
+    assert(vmm_harvest(pml4, base, 0x4000, NM_PTE_ACCESSED | NM_PTE_DIRTY) == 4);
+    s = vmm_get_stats();
+    assert(s.page_flushes - before.page_flushes == 4 && s.full_flushes == before.full_flushes);
+    assert(vmm_leaf_entry(pml4, base) == (0x10000000ULL | 0x3));
+
+    // The dump folds contiguous leaves with equal attributes into one line.
+    char out[512];
+    assert(vmm_dump(pml4, base, 0x400000, out, sizeof(out)) == 4);
+    assert(strcmp(out, "0x40000000-0x40001000 -> 0x10000000 4K rwx kernel\n"
+                       "0x40001000-0x40002000 -> 0x18000000 4K rwx kernel\n"
+                       "0x40002000-0x40004000 -> 0x10002000 4K rwx kernel\n"
+                       "0x40200000-0x40400000 -> 0x20000000 2M rwx user\n") == 0);
+    assert(vmm_dump(pml4, base + 0x400000, 0x1000, out, sizeof(out)) == 1);
+    assert(vmm_dump(pml4, base + 0x10000000, 0x1000, out, sizeof(out)) == 0 && out[0] == '\0');
+}
+
+static int64_t test_file_read(struct nm_vnode *node, void *buf, uint64_t offset, uint64_t len)
+{
+    if (offset >= node->size) {
+        return 0;
+    }
+    uint64_t n = node->size - offset < len ? node->size - offset : len;
+    memcpy(buf, node->data + offset, n);
+    return (int64_t)n;
+}
+
+static void test_vmm_protect_advise(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    uint64_t *pml4 = (uint64_t *)pmm_host_ptr_from_key(pmm_alloc_zeroed_page());
+    const uint64_t base = 0x40000000ULL;
+    assert(vmm_map_range(pml4, base, 0x20000000ULL, 0x200000, 0x3));
+
+    // Protecting the middle of a huge leaf splits it once and flushes once.
+    struct nm_vmm_stats before = vmm_get_stats();
+    assert(vmm_protect(pml4, base + 0x1000, 0x2000, NM_PTE_NX, 0x2 | NM_PTE_NX));
+    struct nm_vmm_stats s = vmm_get_stats();
+    assert(s.tables_allocated == before.tables_allocated + 1 && s.leaves_protected == before.leaves_protected + 2);
+    assert(s.page_flushes - before.page_flushes == 512 || s.full_flushes == before.full_flushes + 1);
+    char out[512];
+    assert(vmm_dump(pml4, base, 0x200000, out, sizeof(out)) == 3);
+    assert(strcmp(out, "0x40000000-0x40001000 -> 0x20000000 4K rwx kernel\n"
+                       "0x40001000-0x40003000 -> 0x20001000 4K r-- kernel\n"
+                       "0x40003000-0x40200000 -> 0x20003000 4K rwx kernel\n") == 0);
+    uint64_t phys = 0;
+    assert(vmm_translate(pml4, base + 0x2345, &phys) && phys == 0x20002345ULL);
+
+    // Granting US reaches the tables above the leaf too; a repeat changes nothing.
+    assert(vmm_protect(pml4, base, 0x1000, 0x4, 0x4));
+    assert((pml4[0] & 0x4) != 0 && (vmm_leaf_entry(pml4, base) & 0x4) != 0);
+    before = vmm_get_stats();
+    assert(vmm_protect(pml4, base, 0x1000, 0x4, 0x4));
+    assert(vmm_get_stats().leaves_protected == before.leaves_protected);
+    assert(!vmm_protect(pml4, base + 0x10, 0x1000, 0, 0x2));
+
+    // HUGEPAGE folds a table back into a huge leaf only once it maps one contiguous block
+    // with uniform attributes.
+    assert(vmm_advise(pml4, base, 0x200000, NM_MADV_HUGEPAGE));
+    assert(vmm_get_stats().huge_collapsed == before.huge_collapsed);
+    assert(vmm_protect(pml4, base, 0x200000, 0x2, 0x6 | NM_PTE_NX));
+    assert(vmm_advise(pml4, base, 0x200000, NM_MADV_HUGEPAGE));
+    s = vmm_get_stats();
+    assert(s.huge_collapsed == before.huge_collapsed + 1 && s.tables_freed == before.tables_freed + 1);
+    assert(vmm_leaf_entry(pml4, base) == (0x20000000ULL | 0x83));
+    assert(vmm_translate(pml4, base + 0x2345, &phys) && phys == 0x20002345ULL);
+
+    // DONTNEED drops real frames, a huge leaf's 512 included, after the flush.
+    uint64_t huge = pmm_alloc_huge();
+    uint64_t page = pmm_alloc_page();
+    assert(huge != 0 && page != 0);
+    uint64_t frames = pmm_get_stats().free_frames;
+    assert(vmm_map_range(pml4, base + 0x400000, huge, 0x200000, 0x3));
+    assert(vmm_map_range(pml4, base + 0x600000, page, 0x1000, 0x3));
+    assert(vmm_resident(pml4, base + 0x200000, 0x600000) == 0x201000);
+    assert(vmm_advise(pml4, base + 0x400000, 0x400000, NM_MADV_WILLNEED));
+    assert(vmm_advise(pml4, base + 0x400000, 0x400000, NM_MADV_DONTNEED));
+    assert(vmm_resident(pml4, base, 0x1000000) == 0x200000);
+    assert(pmm_page_refcount(huge) == 0 && pmm_page_refcount(huge + 0x1FF000) == 0 && pmm_page_refcount(page) == 0);
+    assert(pmm_get_stats().free_frames == frames + 513);
+}
+
+static void test_mm_demand_fault(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    mm_space_init();
+    kfree(kmalloc(sizeof(struct nm_mm)));
+    kfree(kmalloc(sizeof(struct nm_vma)));
+    uint64_t frames = pmm_get_stats().free_frames;
+    struct nm_mm *mm = mm_create();
+    assert(mm != 0);
+
+    // Reserving 1 GiB costs a descriptor, not frames.
+    const uint64_t heap = NM_USER_BASE;
+    uint64_t reserved = pmm_get_stats().free_frames;
+    assert(mm_map(mm, heap, 1ULL << 30, NM_VMA_READ | NM_VMA_WRITE, 0, 0) == 0);
+    assert(pmm_get_stats().free_frames == reserved);
+    assert(mm_map(mm, heap + 0x1000, 0x1000, NM_VMA_READ, 0, 0) == NM_ERR(NM_EBUSY));
+    assert(mm_map(mm, 0x1000, 0x1000, NM_VMA_READ, 0, 0) == NM_ERR(NM_EINVAL));
+
+    // First touch maps one zeroed, user-accessible page; a repeat fault is a no-op.
+    assert(mm_handle_fault(mm, heap + 0x5123, NM_PF_WRITE | NM_PF_USER) == 0);
+    uint64_t entry = vmm_leaf_entry(mm->pml4, heap + 0x5000);
+    assert((entry & 0x7) == 0x7);
+    const uint8_t *page = (const uint8_t *)pmm_host_ptr_from_key(entry & ~0xFFFULL);
+    for (size_t i = 0; i < 4096; i++) {
+        assert(page[i] == 0);
+    }
+    assert(mm_handle_fault(mm, heap + 0x5000, NM_PF_PRESENT | NM_PF_WRITE) == 0);
+    assert(vmm_leaf_entry(mm->pml4, heap + 0x6000) == 0);
+
+    // True faults: no area, or an access the area does not allow.
+    assert(mm_handle_fault(mm, heap - 0x1000, 0) == NM_ERR(NM_EFAULT));
+    assert(mm_handle_fault(mm, 0xFFFF888000001000ULL, 0) == NM_ERR(NM_EFAULT));
+    assert(mm_handle_fault(mm, heap, NM_PF_FETCH) == NM_ERR(NM_EFAULT));
+
+    // File-backed pages are read on first touch; bytes past the end of the file are 0.
+    static uint8_t contents[6000];
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (uint8_t)(i * 7U + 1U);
+    }
+    static const struct nm_file_ops file_ops = {.read = test_file_read};
+    struct nm_vnode file = {.used = true, .data = contents, .size = sizeof(contents), .ops = &file_ops};
+    const uint64_t text = NM_USER_BASE + (2ULL << 30);
+    assert(mm_map(mm, text, 0x3000, NM_VMA_READ | NM_VMA_EXEC, &file, 0x1000) == 0);
+    assert(mm_handle_fault(mm, text + 0x10, NM_PF_FETCH | NM_PF_USER) == 0);
+    entry = vmm_leaf_entry(mm->pml4, text);
+    assert((entry & 0x7) == 0x5);
+    page = (const uint8_t *)pmm_host_ptr_from_key(entry & ~0xFFFULL);
+    assert(page[0] == contents[4096] && page[6000 - 4097] == contents[5999] && page[6000 - 4096] == 0);
+    assert(mm_handle_fault(mm, text + 0x1000, NM_PF_WRITE) == NM_ERR(NM_EFAULT));
+
+    // Unmapping the middle of an area splits it and frees the populated page; the
+    // neighbour keeps the page table alive so exactly one frame comes back.
+    assert(mm_handle_fault(mm, heap + 0x7000, NM_PF_WRITE) == 0);
+    uint64_t populated = pmm_get_stats().free_frames;
+    assert(mm_unmap(mm, heap + 0x4000, 0x2000) == 0);
+    assert(pmm_get_stats().free_frames == populated + 1);
+    assert(mm_find_vma(mm, heap + 0x5000) == 0);
+    struct nm_vma *low = mm_find_vma(mm, heap);
+    struct nm_vma *high = mm_find_vma(mm, heap + 0x6000);
+    assert(low != 0 && high != 0 && low != high);
+    assert(low->end == heap + 0x4000 && high->start == heap + 0x6000 && low->next == high);
+    assert(mm_handle_fault(mm, heap + 0x4000, NM_PF_WRITE) == NM_ERR(NM_EFAULT));
+
+    (void)mm_switch(mm_kernel());
+    mm_put(mm);
+    kheap_drain();
+    assert(pmm_get_stats().free_frames == frames);
+}
+
+static void test_mm_cow_fork(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    mm_space_init();
+    kfree(kmalloc(sizeof(struct nm_mm)));
+    kfree(kmalloc(sizeof(struct nm_vma)));
+    assert(mm_fork(mm_kernel()) == mm_kernel());
+
+    uint64_t frames = pmm_get_stats().free_frames;
+    struct nm_mm *parent = mm_create();
+    assert(parent != 0);
+    const uint64_t heap = NM_USER_BASE;
+    assert(mm_map(parent, heap, 0x10000, NM_VMA_READ | NM_VMA_WRITE, 0, 0) == 0);
+    for (uint64_t off = 0; off < 0x4000; off += 0x1000) {
+        assert(mm_handle_fault(parent, heap + off, NM_PF_WRITE | NM_PF_USER) == 0);
+    }
+    uint64_t frame = vmm_leaf_entry(parent->pml4, heap) & ~0xFFFULL;
+    memset(pmm_host_ptr_from_key(frame), 0x5A, 4096);
+
+    // Forking copies the VMAs and page tables (root, PDPT, PD, PT) but no data pages.
+    uint64_t before = pmm_get_stats().free_frames;
+    struct nm_mm *child = mm_fork(parent);
+    assert(child != 0);
+    assert(before - pmm_get_stats().free_frames == 4);
+    struct nm_vma *vma = mm_find_vma(child, heap + 0xF000);
+    assert(vma != 0 && vma->start == heap && vma->end == heap + 0x10000);
+    for (uint64_t off = 0; off < 0x4000; off += 0x1000) {
+        uint64_t mine = vmm_leaf_entry(parent->pml4, heap + off);
+        assert(mine == vmm_leaf_entry(child->pml4, heap + off));
+        assert((mine & 0x7) == 0x5 && pmm_page_refcount(mine & ~0xFFFULL) == 2);
+    }
+    assert(vmm_leaf_entry(child->pml4, heap + 0x4000) == 0);
+
+    // Reads keep sharing; the first write gets a private copy with the same contents.
+    struct nm_mm_fault_stats stats = mm_fault_stats();
+    assert(mm_handle_fault(child, heap + 0x10, NM_PF_PRESENT | NM_PF_USER) == 0);
+    assert(mm_handle_fault(child, heap + 0x10, NM_PF_PRESENT | NM_PF_WRITE | NM_PF_USER) == 0);
+    uint64_t copied = vmm_leaf_entry(child->pml4, heap);
+    assert((copied & 0x7) == 0x7 && (copied & ~0xFFFULL) != frame);
+    assert(memcmp(pmm_host_ptr_from_key(copied & ~0xFFFULL), pmm_host_ptr_from_key(frame), 4096) == 0);
+    assert(pmm_page_refcount(frame) == 1);
+    assert(mm_fault_stats().cow_copies == stats.cow_copies + 1);
+
+    // The last sharer writes in place.
+    assert(mm_handle_fault(parent, heap, NM_PF_PRESENT | NM_PF_WRITE) == 0);
+    assert(vmm_leaf_entry(parent->pml4, heap) == (frame | 0x7));
+    assert(mm_fault_stats().cow_reused == stats.cow_reused + 1);
+
+    // Dropping the child, as exec does, hands the shared pages back to the parent alone.
+    mm_put(child);
+    for (uint64_t off = 0x1000; off < 0x4000; off += 0x1000) {
+        assert(pmm_page_refcount(vmm_leaf_entry(parent->pml4, heap + off) & ~0xFFFULL) == 1);
+    }
+    mm_put(parent);
+    kheap_drain();
+    assert(pmm_get_stats().free_frames == frames);
+}
+
+static void test_mm_protect_advise(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x02000000, .type = NM_MEM_AVAILABLE},
+    };
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    mm_space_init();
+    kfree(kmalloc(sizeof(struct nm_mm)));
+    kfree(kmalloc(sizeof(struct nm_vma)));
+
+    uint64_t frames = pmm_get_stats().free_frames;
+    struct nm_mm *mm = mm_create();
+    assert(mm != 0);
+    const uint64_t heap = NM_USER_BASE;
+    assert(mm_map(mm, heap, 0x400000, NM_VMA_READ | NM_VMA_WRITE, 0, 0) == 0);
+    for (uint64_t off = 0; off < 0x3000; off += 0x1000) {
+        assert(mm_handle_fault(mm, heap + off, NM_PF_WRITE | NM_PF_USER) == 0);
+    }
+
+    // Read-only in the middle splits the area in three and takes RW off the leaf.
+    assert(mm_protect(mm, heap + 0x1000, 0x1000, NM_VMA_READ) == 0);
+    struct nm_vma *vma = mm_find_vma(mm, heap + 0x1000);
+    assert(vma != 0 && vma->start == heap + 0x1000 && vma->end == heap + 0x2000 && vma->prot == NM_VMA_READ);
+    assert(mm_find_vma(mm, heap)->end == heap + 0x1000 && mm_find_vma(mm, heap + 0x2000)->end == heap + 0x400000);
+    assert((vmm_leaf_entry(mm->pml4, heap + 0x1000) & 0x7) == 0x5);
+    assert((vmm_leaf_entry(mm->pml4, heap) & 0x7) == 0x7);
+    assert(mm_handle_fault(mm, heap + 0x1000, NM_PF_PRESENT | NM_PF_WRITE | NM_PF_USER) == NM_ERR(NM_EFAULT));
+
+    // No access hides the page from user mode; write access comes back through a fault.
+    assert(mm_protect(mm, heap + 0x1000, 0x1000, 0) == 0);
+    assert((vmm_leaf_entry(mm->pml4, heap + 0x1000) & 0x4) == 0);
+    assert(mm_protect(mm, heap + 0x1000, 0x1000, NM_VMA_READ | NM_VMA_WRITE) == 0);
+    assert((vmm_leaf_entry(mm->pml4, heap + 0x1000) & 0x7) == 0x5);
+    assert(mm_handle_fault(mm, heap + 0x1000, NM_PF_PRESENT | NM_PF_WRITE | NM_PF_USER) == 0);
+    assert((vmm_leaf_entry(mm->pml4, heap + 0x1000) & 0x7) == 0x7);
+    assert(mm_protect(mm, heap + 0x3FF000, 0x2000, NM_VMA_READ) == NM_ERR(NM_EFAULT));
+
+    // WILLNEED populates the rest up front; DONTNEED frees it and the next touch is zero.
+    struct nm_mm_fault_stats stats = mm_fault_stats();
+    assert(mm_advise(mm, heap, 0x8000, NM_MADV_WILLNEED) == 0);
+    assert(mm_fault_stats().zero_fills == stats.zero_fills + 5);
+    assert(vmm_resident(mm->pml4, heap, 0x400000) == 0x8000);
+    uint64_t phys = 0;
+    assert(vmm_translate(mm->pml4, heap + 0x4000, &phys));
+    memset(pmm_host_ptr_from_key(phys), 0x5A, 4096);
+    uint64_t used = pmm_get_stats().free_frames;
+    assert(mm_advise(mm, heap, 0x8000, NM_MADV_DONTNEED) == 0);
+    assert(vmm_resident(mm->pml4, heap, 0x400000) == 0);
+    assert(pmm_get_stats().free_frames > used + 8);
+    assert(mm_find_vma(mm, heap + 0x4000) != 0);
+    assert(mm_handle_fault(mm, heap + 0x4000, NM_PF_USER) == 0);
+    assert(vmm_translate(mm->pml4, heap + 0x4000, &phys));
+    assert(*(const uint8_t *)pmm_host_ptr_from_key(phys) == 0);
+
+    // HUGEPAGE fills the one whole aligned 2 MiB stretch with a huge frame.
+    assert(mm_advise(mm, heap, 0x400000, NM_MADV_HUGEPAGE) == 0);
+    assert(mm_fault_stats().huge_fills == stats.huge_fills + 1);
+    assert((vmm_leaf_entry(mm->pml4, heap + 0x200000) & 0x87) == 0x87);
+    assert(vmm_translate(mm->pml4, heap + 0x201000, &phys));
+    memset(pmm_host_ptr_from_key(phys), 0x3C, 4096);
+
+    // A fork shares it page by page; the child's write copies just the page it hit.
+    struct nm_mm *child = mm_fork(mm);
+    assert(child != 0);
+    assert(mm_handle_fault(child, heap + 0x201000, NM_PF_PRESENT | NM_PF_WRITE | NM_PF_USER) == 0);
+    uint64_t copied = 0;
+    assert(vmm_translate(child->pml4, heap + 0x201000, &copied) && copied != phys);
+    assert(memcmp(pmm_host_ptr_from_key(copied), pmm_host_ptr_from_key(phys), 4096) == 0);
+    mm_put(child);
+    assert(pmm_page_refcount(phys) == 1);
+
+    assert(mm_unmap(mm, heap, 0x400000) == 0);
+    assert(pmm_page_refcount(phys) == 0);
+    mm_put(mm);
+    kheap_drain();
+    assert(pmm_get_stats().free_frames == frames);
+}
+
+static void test_vmalloc(void)
+{
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x01000000, .type = NM_MEM_AVAILABLE},
+    };
+    static uint64_t frames[8192];
+
+    pmm_init_from_ranges(ranges, sizeof(ranges) / sizeof(ranges[0]));
+    kheap_init();
+    vmalloc_init();
+    kfree(kmalloc(64));
+    kfree(kmalloc(256));
+
+    // Shatter memory: every odd frame stays taken, so no two free frames touch.
+    size_t count = 0;
+    while (count < 8192 && (frames[count] = pmm_alloc_page()) != 0) {
+        count++;
+    }
+    size_t held = 0;
+    for (size_t i = 0; i < count; i++) {
+        if ((frames[i] & 0x1000U) == 0) {
+            pmm_free_page(frames[i]);
+        } else {
+            frames[held++] = frames[i];
+        }
+    }
+    assert(pmm_alloc_pages(2) == 0);
+
+    uint64_t free_before = pmm_get_stats().free_frames;
+    uint64_t tables = vmm_get_stats().tables_allocated;
+    uint8_t *buf = (uint8_t *)vmalloc(16 * 4096 - 100);
+    assert(vmalloc_contains(buf) && ((uintptr_t)buf & 0xFFFU) == 0);
+    assert(free_before - pmm_get_stats().free_frames == 16 + vmm_get_stats().tables_allocated - tables);
+    for (uint64_t i = 0; i < 16; i++) {
+        uint64_t phys = vmalloc_to_phys(buf + i * 4096 + 0x123);
+        assert(phys != 0 && (phys & 0xFFFU) == 0x123);
+        if (i != 0) {
+            assert(phys != vmalloc_to_phys(buf + (i - 1) * 4096 + 0x123) + 4096);
+        }
+    }
+    assert(vmalloc_to_phys(buf + 16 * 4096) == 0);
+
+    uint8_t *stack = (uint8_t *)vmalloc_flags(8192, NM_VMALLOC_GUARD);
+    assert(stack != 0 && vmalloc_to_phys(stack) != 0 && vmalloc_to_phys(stack + 4096) != 0);
+    assert(vmalloc_to_phys(stack - 4096) == 0 && vmalloc_to_phys(stack + 8192) == 0);
+    assert(vmalloc_get_stats().areas == 2 && vmalloc_get_stats().pages == 18);
+
+    // Freeing only queues the area; a purge unmaps everything queued under one flush.
+    struct nm_vmm_stats vmm_before = vmm_get_stats();
+    vfree(buf);
+    vfree(stack);
+    assert(vmalloc_to_phys(buf) != 0);
+    struct nm_vmalloc_stats stats = vmalloc_get_stats();
+    assert(stats.areas == 0 && stats.lazy_areas == 2 && stats.lazy_pages == 18 && stats.purges == 0);
+    vmalloc_purge();
+    struct nm_vmm_stats vmm_after = vmm_get_stats();
+    assert(vmm_after.page_flushes + vmm_after.full_flushes - vmm_before.page_flushes - vmm_before.full_flushes >= 1);
+    assert(vmm_after.full_flushes - vmm_before.full_flushes <= 1);
+    assert(vmalloc_to_phys(buf) == 0 && vmalloc_get_stats().lazy_areas == 0);
+    assert(vmalloc_get_stats().purges == 1);
+    kheap_drain();
+    assert(pmm_get_stats().free_frames == free_before);
+    // The purged addresses are free for reuse.
+    assert(vmalloc(4096) == buf);
+    vfree(buf);
+
+    // Enough small frees trigger a purge on their own.
+    for (int i = 0; i < 64; i++) {
+        vfree(vmalloc(4096));
+    }
+    assert(vmalloc_get_stats().purges >= 2 && vmalloc_get_stats().lazy_areas < 64);
+
+    void *small = kvmalloc(64);
+    assert(small != 0 && !vmalloc_contains(small));
+    kvfree(small);
+    assert(vmalloc(0) == 0);
+    vmalloc_purge();
+
+    for (size_t i = 0; i < held; i++) {
+        pmm_free_page(frames[i]);
+    }
+}
+
 int main(void)
 {
     test_pmm_alloc_free();
+    test_pmm_multi_page_free();
+    test_pmm_zone_alloc();
+    test_pmm_exhaust();
+    test_pmm_huge_alloc();
+    test_pmm_zeroed_page();
+    test_pmm_page_refcount();
+    test_pmm_batch();
+    test_pmm_grow_pages();
+    test_vmm_map_range();
+    test_vmm_walk_translate();
+    test_vmm_protect_advise();
+    test_mm_pcid();
+    test_mm_demand_fault();
+    test_mm_cow_fork();
+    test_mm_protect_advise();
+    test_vmalloc();
+    test_kmalloc_large_returns_pages();
+    test_kmalloc_arena_coalesce();
+    test_krealloc_aligned();
+#ifdef NM_KHEAP_TRACK
+    test_kheap_track();
+#endif
     test_kmalloc_reuse();
+    test_kmalloc_slab_classes();
+    test_kmem_cache();
     puts("test_pmm_kheap: PASS");
     return 0;
 }
@@ -25,6 +25,49 @@ static void test_rr_pick(void)
     assert(p1 != p2);
 }
 
+static void test_rr_queues(void)
+{
+    proc_init();
+    struct nm_task *boot = task_current();
+    struct nm_task *a = task_create_kernel_thread("a", kthread_stub, 0);
+    struct nm_task *b = task_create_kernel_thread("b", kthread_stub, 0);
+    struct nm_task *c = task_create_kernel_thread("c", kthread_stub, 0);
+    assert(a != 0 && b != 0 && c != 0);
+    assert(a->on_rq && b->on_rq && c->on_rq && !boot->on_rq);
+
+    // Equal priorities take turns in FIFO order; a pick rotates without switching.
+    sched_init(NM_SCHED_RR);
+    assert(sched_pick_next() == a);
+    assert(sched_pick_next() == b);
+    assert(sched_pick_next() == c);
+    assert(sched_pick_next() == a);
+
+    // A switch takes the next task off its queue and puts the previous one at the tail.
+    // The bootstrap task has no saved stack on the host, so it is never picked.
+    sched_yield();
+    assert(task_current() == b && b->state == NM_TASK_RUNNING && !b->on_rq);
+    assert(boot->on_rq && boot->state == NM_TASK_RUNNABLE);
+    sched_yield();
+    assert(task_current() == c && b->on_rq);
+
+    // A better priority always goes first.
+    sched_dequeue(a);
+    a->sched.priority = 10;
+    sched_enqueue(a);
+    assert(sched_pick_next() == a);
+    assert(sched_pick_next() == a);
+
+    // Only runnable tasks stay queued: an exited task is not put back.
+    sched_yield();
+    assert(task_current() == a);
+    proc_exit_current(0);
+    sched_yield();
+    assert(task_current() != a && !a->on_rq && a->state == NM_TASK_ZOMBIE);
+    for (int i = 0; i < 4; i++) {
+        assert(sched_pick_next() != a);
+    }
+}
+
 static void test_cfs_pick(void)
 {
     proc_init();
@@ -48,6 +91,7 @@ static void test_cfs_pick(void)
 int main(void)
 {
     test_rr_pick();
+    test_rr_queues();
     test_cfs_pick();
     puts("test_sched: PASS");
     return 0;
@@ -29,10 +29,23 @@ static void test_pipe(void)
     assert(out[0] == 'p');
 }
 
+static void test_vmmap(void)
+{
+    shell_init();
+
+    char out[256];
+    // Host builds have no kernel page tables, so any range is empty.
+    assert(shell_execute_line("vmmap 0xffff888000000000 0x1000", out, sizeof(out)) == 0);
+    assert(out[0] == 'v');
+    assert(shell_execute_line("vmmap 0xzz 1", out, sizeof(out)) != 0);
+    assert(shell_execute_line("vmmap 4096", out, sizeof(out)) != 0);
+}
+
 int main(void)
 {
     test_echo_cat_redirect();
     test_pipe();
+    test_vmmap();
     puts("test_shell: PASS");
     return 0;
 }
@@ -1,8 +1,10 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "nm/fs.h"
+#include "nm/mm.h"
 #include "nm/proc.h"
 #include "nm/syscall.h"
 
@@ -39,6 +41,58 @@ static void test_pipe_and_dup2(void)
     assert(syscall_dispatch(NM_SYS_CLOSE, 7, 0, 0, 0, 0, 0) == 0);
 }
 
+static uint64_t fdobj_active(void)
+{
+    struct nm_kmem_cache_stats stats[16];
+    size_t count = kmem_cache_stats(stats, 16);
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(stats[i].name, "fdobj") == 0) {
+            return stats[i].active_objs;
+        }
+    }
+    assert(0);
+    return 0;
+}
+
+static void test_fdobj_cache(void)
+{
+    proc_init();
+    syscall_init();
+
+    // Objects are carved from the cache on demand, 24 of them outgrow the initial 16-slot id
+    // table, and the surplus goes back once closed.
+    int32_t fds[12][2];
+    for (int i = 0; i < 12; i++) {
+        assert(syscall_dispatch(NM_SYS_PIPE, (uint64_t)(uintptr_t)fds[i], 0, 0, 0, 0, 0) == 0);
+    }
+    assert(fdobj_active() >= 24);
+
+    for (int i = 0; i < 12; i++) {
+        assert(syscall_dispatch(NM_SYS_CLOSE, (uint64_t)fds[i][0], 0, 0, 0, 0, 0) == 0);
+        assert(syscall_dispatch(NM_SYS_CLOSE, (uint64_t)fds[i][1], 0, 0, 0, 0, 0) == 0);
+    }
+    assert(fdobj_active() <= 8);
+
+    // Freed ids and the grown table are reused.
+    for (int i = 0; i < 12; i++) {
+        assert(syscall_dispatch(NM_SYS_PIPE, (uint64_t)(uintptr_t)fds[i], 0, 0, 0, 0, 0) == 0);
+    }
+    const char *msg = "x";
+    assert(syscall_dispatch(NM_SYS_WRITE, (uint64_t)fds[11][1], (uint64_t)(uintptr_t)msg, 1, 0, 0, 0) == 1);
+    char got = 0;
+    assert(syscall_dispatch(NM_SYS_READ, (uint64_t)fds[11][0], (uint64_t)(uintptr_t)&got, 1, 0, 0, 0) == 1);
+    assert(got == 'x');
+    for (int i = 0; i < 12; i++) {
+        assert(syscall_dispatch(NM_SYS_CLOSE, (uint64_t)fds[i][0], 0, 0, 0, 0, 0) == 0);
+        assert(syscall_dispatch(NM_SYS_CLOSE, (uint64_t)fds[i][1], 0, 0, 0, 0, 0) == 0);
+    }
+
+    // Reinitialising hands live objects back as well.
+    assert(syscall_dispatch(NM_SYS_PIPE, (uint64_t)(uintptr_t)fds[0], 0, 0, 0, 0, 0) == 0);
+    syscall_init();
+    assert(fdobj_active() <= 8);
+}
+
 static void test_exit_waitpid(void)
 {
     proc_init();
@@ -131,12 +185,83 @@ static void test_cloexec_on_exec(void)
     assert(cur->fd_table[3] == -1);
 }
 
+static void test_exec_args_from_forked_mapping(void)
+{
+    proc_init();
+    syscall_init();
+    fs_init();
+    assert(fs_mount_root(tmpfs_filesystem()) == 0);
+    int prog = fs_open("/sh", NM_O_CREAT | NM_O_RDWR, 0644);
+    assert(prog >= 0);
+    assert(fs_close(prog) == 0);
+
+    struct nm_task *parent = task_current();
+    struct nm_mm *parent_mm = mm_create();
+    assert(parent_mm != 0);
+    parent->mm = parent_mm;
+    assert(mm_map(parent_mm, NM_USER_BASE, 0x1000, NM_VMA_READ | NM_VMA_WRITE, 0, 0) == 0);
+    assert(mm_handle_fault(parent_mm, NM_USER_BASE, NM_PF_WRITE | NM_PF_USER) == 0);
+
+    int64_t child_pid = syscall_dispatch(NM_SYS_FORK, 0, 0, 0, 0, 0, 0);
+    assert(child_pid > 0);
+    struct nm_task *child = task_by_pid((int32_t)child_pid);
+    assert(child != 0 && child->mm != parent_mm);
+
+    // The child's own copy of the page holds the exec name and vectors, as a user program's
+    // would; exec frees that page along with the rest of the old address space.
+    struct nm_mm *old_mm = child->mm;
+    assert(mm_handle_fault(old_mm, NM_USER_BASE, NM_PF_PRESENT | NM_PF_WRITE | NM_PF_USER) == 0);
+    uint64_t phys = 0;
+    assert(vmm_translate(old_mm->pml4, NM_USER_BASE, &phys));
+    char *page = (char *)pmm_host_ptr_from_key(phys);
+    strcpy(page, "/sh");
+    strcpy(page + 16, "-c");
+    strcpy(page + 32, "TERM=vt100");
+    const char **vec = (const char **)(void *)(page + 64);
+    vec[0] = page;
+    vec[1] = page + 16;
+    vec[2] = 0;
+    vec[3] = page + 32;
+    vec[4] = 0;
+
+    proc_set_current(child);
+    assert(syscall_dispatch(NM_SYS_EXEC, (uint64_t)(uintptr_t)page, (uint64_t)(uintptr_t)vec,
+                            (uint64_t)(uintptr_t)&vec[3], 0, 0, 0) == 0);
+    assert(child->mm != old_mm && pmm_page_refcount(phys) == 0);
+    memset(page, 0xAA, 4096);
+
+    const char *const *argv = (const char *const *)(uintptr_t)child->regs.rsi;
+    const char *const *envp = (const char *const *)(uintptr_t)child->regs.rdx;
+    assert(child->argc == 2 && child->envc == 1 && child->regs.rdi == 2);
+    assert(strcmp(argv[0], "/sh") == 0 && strcmp(argv[1], "-c") == 0 && argv[2] == 0);
+    assert(strcmp(envp[0], "TERM=vt100") == 0 && envp[1] == 0);
+    assert(strcmp(child->entry_name, "/sh") == 0 && strcmp(child->name, "/sh") == 0);
+
+    assert(syscall_dispatch(NM_SYS_EXIT, 0, 0, 0, 0, 0, 0) == 0);
+    proc_set_current(parent);
+    int32_t status = -1;
+    assert(syscall_dispatch(NM_SYS_WAITPID, (uint64_t)child_pid, (uint64_t)(uintptr_t)&status, 0, 0, 0, 0) ==
+           child_pid);
+    parent->mm = mm_kernel();
+    mm_put(parent_mm);
+}
+
 int main(void)
 {
+    // exec copies its arguments into the kernel heap.
+    const struct nm_mem_range ranges[] = {
+        {.base = 0x00100000, .length = 0x01000000, .type = NM_MEM_AVAILABLE},
+    };
+    pmm_init_from_ranges(ranges, 1);
+    kheap_init();
+    mm_space_init();
+
     test_pipe_and_dup2();
+    test_fdobj_cache();
     test_exit_waitpid();
     test_fork_exec();
     test_cloexec_on_exec();
+    test_exec_args_from_forked_mapping();
     puts("test_syscall_m9: PASS");
     return 0;
 }
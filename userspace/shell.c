@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "nm/fs.h"
+#include "nm/mm.h"
 
 static void out_append(char *out, size_t cap, size_t *used, const char *s)
 {
@@ -128,6 +129,51 @@ static int cmd_ls(int argc, char argv[][64], char *out, size_t out_cap, const ch
     return 0;
 }
 
+// Decimal, or hex with a 0x prefix.
+static int parse_u64(const char *s, uint64_t *value)
+{
+    uint64_t v = 0;
+    unsigned base = 10;
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        s += 2;
+    }
+    if (*s == '\0') {
+        return -1;
+    }
+    for (; *s != '\0'; s++) {
+        unsigned digit;
+        if (*s >= '0' && *s <= '9') {
+            digit = (unsigned)(*s - '0');
+        } else if (base == 16 && *s >= 'a' && *s <= 'f') {
+            digit = (unsigned)(*s - 'a' + 10);
+        } else if (base == 16 && *s >= 'A' && *s <= 'F') {
+            digit = (unsigned)(*s - 'A' + 10);
+        } else {
+            return -1;
+        }
+        v = v * base + digit;
+    }
+    *value = v;
+    return 0;
+}
+
+// vmmap <start> <len>: the kernel page tables' mappings in that range.
+static int cmd_vmmap(int argc, char argv[][64], char *out, size_t out_cap, const char *in)
+{
+    (void)in;
+    uint64_t start;
+    uint64_t len;
+    if (argc != 3 || parse_u64(argv[1], &start) != 0 || parse_u64(argv[2], &len) != 0) {
+        return -1;
+    }
+    if (vmm_dump(vmm_kernel_root(), start, len, out, out_cap) == 0) {
+        size_t used = 0;
+        out_append(out, out_cap, &used, "vmmap: nothing mapped\n");
+    }
+    return 0;
+}
+
 static int run_simple(const char *line, char *out, size_t out_cap, const char *in)
 {
     char argv[16][64];
@@ -148,6 +194,9 @@ static int run_simple(const char *line, char *out, size_t out_cap, const char *i
     if (str_eq(argv[0], "ls")) {
         return cmd_ls(argc, argv, out, out_cap, in);
     }
+    if (str_eq(argv[0], "vmmap")) {
+        return cmd_vmmap(argc, argv, out, out_cap, in);
+    }
     return -1;
 }
 